@@ -6,21 +6,42 @@
 
 constexpr char COMPILER[] = "gcc";
 constexpr char BUILDDIR[] = "build";
-constexpr char OUTBIN[] = "build/out";
-constexpr char UPDATESUBMODULES[] =
-    "git submodule update --init --recursive --remote";
 constexpr char SRC[][BUFSIZ] = {
     "src/main.c",
     "src/config.c",
-    "src/globdef.c",
     "src/completions.c",
-    "minimal-c-json-parser/src/json.c",
+    "src/buffer.c",
+    "src/context.c",
+    "src/escape.c",
+    "src/jsonscan.c",
+    "src/request.c",
+    "src/sse.c",
+    "src/reactor.c",
+    "src/render.c",
+    "src/batch.c",
+    "src/cache.c",
+    "src/session.c",
+    "src/tokenizer.c",
+    "src/exec.c",
+    "src/ratelimit.c",
+    "src/daemon.c",
+    "src/response.c",
+    "src/editor.c",
+};
+constexpr char MOCK_SRC[][BUFSIZ] = {
+    "tools/mock.c",
+    "src/buffer.c",
+};
+constexpr char BENCH_SRC[][BUFSIZ] = {
+    "tools/bench.c",
 };
 constexpr char CFLAGS[][BUFSIZ] = {"-Wall",      "-Werror", "-Wextra",
-                                   "-std=gnu23", "-O2",     "-lcurl"};
-constexpr char INCL[][BUFSIZ] = {"-Iinclude",
-                                 "-Iminimal-c-json-parser/include"};
+                                   "-std=gnu23", "-O2",     "-lcurl",
+                                   "-lz"};
+constexpr char INCL[][BUFSIZ] = {"-Iinclude"};
 constexpr size_t SRCCOUNT = sizeof(SRC) / sizeof(SRC[0]);
+constexpr size_t MOCKSRCCOUNT = sizeof(MOCK_SRC) / sizeof(MOCK_SRC[0]);
+constexpr size_t BENCHSRCCOUNT = sizeof(BENCH_SRC) / sizeof(BENCH_SRC[0]);
 constexpr size_t CFLAGSCOUNT = sizeof(CFLAGS) / sizeof(CFLAGS[0]);
 constexpr size_t INCLCOUNT = sizeof(INCL) / sizeof(INCL[0]);
 constexpr size_t ARGSLEN =
@@ -36,35 +57,44 @@ static bool ensure_dir(const char *const src) {
   return true;
 }
 
-int main() {
-  if (!ensure_dir(BUILDDIR)) {
-    term_print_color("Build directory could not be created", term_color_red);
-    return 1;
-  }
-  term_print_color("Build directory created", term_color_green);
+typedef struct {
+  const char *name;
+  const char *output;
+  const char (*sources)[BUFSIZ];
+  size_t count;
+} build_target_t;
 
+// The first target is the one built when no target is named
+static const build_target_t TARGETS[] = {
+    {"out", "build/out", SRC, SRCCOUNT},
+    {"mock", "build/mock", MOCK_SRC, MOCKSRCCOUNT},
+    {"bench", "build/bench", BENCH_SRC, BENCHSRCCOUNT},
+};
+constexpr size_t TARGETCOUNT = sizeof(TARGETS) / sizeof(TARGETS[0]);
+
+static bool build_target(const build_target_t *const target) {
   char command[ARGSLEN];
-  auto total = snprintf(command, ARGSLEN, "%s && %s -o %s", UPDATESUBMODULES,
-                        COMPILER, OUTBIN);
+  auto total =
+      snprintf(command, ARGSLEN, "%s -o %s", COMPILER, target->output);
   if (total < 0) {
     term_print_color("Compiler and output were unable to be set",
                      term_color_red);
-    return 1;
+    return false;
   }
 
-  for (size_t i = 0; i < SRCCOUNT; i++) {
-    if (snprintf(&command[total], ARGSLEN, " %s", SRC[i]) < 0) {
+  for (size_t i = 0; i < target->count; i++) {
+    if (snprintf(&command[total], ARGSLEN, " %s", target->sources[i]) < 0) {
       term_print_color("Source files were unable to be set", term_color_red);
-      return 1;
+      return false;
     }
-    total += strlen(SRC[i]) + 1;
+    total += strlen(target->sources[i]) + 1;
   }
 
   for (size_t i = 0; i < INCLCOUNT; i++) {
     if (snprintf(&command[total], ARGSLEN, " %s", INCL[i]) < 0) {
       term_print_color("Include directories were unable to be set",
                        term_color_red);
-      return 1;
+      return false;
     }
     total += strlen(INCL[i]) + 1;
   }
@@ -72,12 +102,42 @@ int main() {
   for (size_t i = 0; i < CFLAGSCOUNT; i++) {
     if (snprintf(&command[total], ARGSLEN, " %s", CFLAGS[i]) < 0) {
       term_print_color("CFLAGS were unable to be set", term_color_red);
-      return 1;
+      return false;
     }
     total += strlen(CFLAGS[i]) + 1;
   }
 
-  system(command);
+  return system(command) == 0;
+}
+
+int main(int argc, char **argv) {
+  if (!ensure_dir(BUILDDIR)) {
+    term_print_color("Build directory could not be created", term_color_red);
+    return 1;
+  }
+  term_print_color("Build directory created", term_color_green);
+
+  // `./build mock bench` builds the named targets, `./build all` every one
+  const int requested = argc > 1 ? argc - 1 : 1;
+  for (int i = 0; i < requested; i++) {
+    const char *const name = argc > 1 ? argv[i + 1] : TARGETS[0].name;
+    const bool all = strcmp(name, "all") == 0;
+    bool found = false;
+    for (size_t j = 0; j < TARGETCOUNT; j++) {
+      if (!all && strcmp(name, TARGETS[j].name) != 0) {
+        continue;
+      }
+      found = true;
+      if (!build_target(&TARGETS[j])) {
+        term_print_color("Target could not be built", term_color_red);
+        return 1;
+      }
+    }
+    if (!found) {
+      term_print_color("Unknown target", term_color_red);
+      return 1;
+    }
+  }
   term_print_color("Executable file created", term_color_green);
 
   return 0;
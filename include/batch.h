@@ -0,0 +1,24 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "config.h"
+#include <stddef.h>
+
+/**
+ * @brief Sends every prompt of a JSONL file concurrently and writes one JSONL
+ * result per prompt to stdout, in input order.
+ *
+ * Every input line is an object such as `{"id":7,"prompt":"..."}`, where the
+ * optional `id` is copied to the result unchanged. Every result carries the
+ * index of the line, its status, the HTTP status and the timings of the
+ * request.
+ *
+ * @param config Configuration of the session
+ * @param path Path of the JSONL file, "-" reads from stdin
+ * @param parallel Maximum amount of requests in flight
+ * @return The status of the operation
+ */
+size_t batch_run(const termchat_config_t *const config, const char *const path,
+                 const size_t parallel);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include <stddef.h>
+
+typedef struct {
+  char *data;
+  size_t length;
+  size_t capacity;
+} buffer_t;
+
+/**
+ * @brief Makes sure the buffer can hold at least `capacity` bytes plus a
+ * terminating null byte, growing the storage geometrically
+ * @param buffer Buffer to grow
+ * @param capacity Amount of bytes the buffer must be able to hold
+ * @returns The status of the operation
+ */
+size_t buffer_reserve(buffer_t *const buffer, const size_t capacity);
+
+/**
+ * @brief Appends bytes to the end of the buffer. The content is always kept
+ * null terminated.
+ * @param buffer Buffer to append to
+ * @param src Bytes to append
+ * @param length Amount of bytes to append
+ * @returns The status of the operation
+ */
+size_t buffer_append(buffer_t *const buffer, const void *const src,
+                     const size_t length);
+
+/**
+ * @brief Appends formatted text to the end of the buffer
+ * @param buffer Buffer to append to
+ * @param format printf-style format string
+ * @returns The status of the operation
+ */
+[[gnu::format(printf, 2, 3)]] size_t buffer_printf(buffer_t *const buffer,
+                                                   const char *const format,
+                                                   ...);
+
+/**
+ * @brief Empties the buffer while keeping its storage
+ * @param buffer Buffer to empty
+ */
+void buffer_clear(buffer_t *const buffer);
+
+/**
+ * @brief Releases the storage of the buffer
+ * @param buffer Buffer to release
+ */
+void buffer_free(buffer_t *const buffer);
+
+#endif
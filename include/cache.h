@@ -0,0 +1,82 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "buffer.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+typedef struct cache_index cache_index_t;
+
+typedef struct {
+  int index_fd;
+  int data_fd;
+  int lock_fd;
+  cache_index_t *index;
+  int64_t ttl_s;
+  uint64_t max_bytes;
+} cache_t;
+
+/**
+ * @brief Hashes a request body into the key of its cached response
+ * @param segments Segments of the body, in order
+ * @param count Amount of segments
+ * @return The key of the body, never zero
+ */
+uint64_t cache_key(const struct iovec *const segments, const size_t count);
+
+/**
+ * @brief Opens the response cache under `$XDG_CACHE_HOME/termchat`, creating
+ * its mmap'd index and append-only data file when needed
+ * @param cache Cache to open
+ * @param ttl_s Seconds a response stays valid
+ * @param max_mb Megabytes the data file may grow to before it is recycled
+ * @return The status of the operation
+ */
+size_t cache_open(cache_t *const cache, const int64_t ttl_s,
+                  const int64_t max_mb);
+
+/**
+ * @brief Unmaps and closes the cache
+ * @param cache Cache to close
+ */
+void cache_close(cache_t *const cache);
+
+/**
+ * @brief Looks up a response that has not expired yet
+ * @param cache Cache to search
+ * @param key Key of the request body
+ * @param output Buffer receiving the response on a hit
+ * @return True on a hit
+ */
+bool cache_get(cache_t *const cache, const uint64_t key,
+               buffer_t *const output);
+
+/**
+ * @brief Stores a response, recycling the whole cache once it is full
+ * @param cache Cache to store into
+ * @param key Key of the request body
+ * @param data Response to store
+ * @param length Length of the response
+ * @return The status of the operation
+ */
+size_t cache_put(cache_t *const cache, const uint64_t key,
+                 const char *const data, const size_t length);
+
+/**
+ * @brief Claims the right to fetch a key upstream, across processes
+ * @param cache Cache owning the lock file
+ * @param key Key of the request body
+ * @param wait Whether to block until another process released the key
+ * @return True if the key was claimed
+ */
+bool cache_lock(cache_t *const cache, const uint64_t key, const bool wait);
+
+/**
+ * @brief Releases a key claimed with `cache_lock`
+ * @param cache Cache owning the lock file
+ * @param key Key of the request body
+ */
+void cache_unlock(cache_t *const cache, const uint64_t key);
+
+#endif
@@ -2,14 +2,226 @@
 #ifndef COMPLETIONS_H
 #define COMPLETIONS_H
 
+#include "buffer.h"
+#include "cache.h"
+#include "config.h"
+#include "context.h"
+#include "ratelimit.h"
+#include "reactor.h"
+#include "response.h"
+#include <curl/curl.h>
 #include <stddef.h>
 #include <stdint.h>
 
-typedef enum : uint8_t {
-  role_type_user,
-  role_type_assistant,
-  role_type_developer
-} role_type_t;
+typedef struct {
+  int64_t build_us;
+  int64_t dns_us;
+  int64_t connect_us;
+  int64_t tls_us;
+  int64_t wait_us;
+  int64_t transfer_us;
+  int64_t parse_us;
+  int64_t render_us;
+  int64_t upload_bytes;
+  int64_t download_bytes;
+  int64_t retries;
+  bool reused;
+  bool cached;
+  bool hedged;
+  bool compressed;
+} completion_stats_t;
+
+/**
+ * @brief Callback consuming input of a watched descriptor
+ * @param fd Descriptor that became readable
+ * @param data Pointer given to `completions_watch_input`
+ * @return True once the input that is waited for is complete
+ */
+typedef bool (*completion_input_cb_t)(const int fd, void *const data);
+
+/**
+ * @brief Callback receiving every content fragment of a streamed response
+ * @param fragment Unescaped content of the fragment
+ * @param length Length of the fragment
+ * @param data Pointer given to `get_prompt_stream`
+ */
+typedef void (*completion_delta_cb_t)(const char *const fragment,
+                                      const size_t length, void *const data);
+
+/**
+ * @brief Prepares the long-lived HTTP client reused by every turn
+ * @return The status of the operation
+ */
+size_t completions_init();
+
+/**
+ * @brief Releases the long-lived HTTP client
+ */
+void completions_cleanup();
+
+/**
+ * @brief Counts the tokens the last request held with the local tokenizer,
+ * reusing the cached count of every stored message
+ * @param config Configuration naming the model and holding the instruction
+ * @return The amount of tokens, or CONTEXT_TOKENS_UNKNOWN without a ranks
+ * file
+ */
+size_t completions_count_tokens(const termchat_config_t *const config);
+
+/**
+ * @brief Gets the token usage the API reported for the last turn
+ * @return The usage, not reported if the answer came from the cache
+ */
+const completion_usage_t *completions_usage();
+
+/**
+ * @brief Gets the fields of the last response `get_prompt_response` received
+ * @return The fields, pointing into the output buffer of that call
+ */
+const response_fields_t *completions_response();
+
+/**
+ * @brief Gets the token usage of every turn of the session
+ * @return The summed usage
+ */
+const completion_usage_t *completions_usage_total();
+
+/**
+ * @brief Gets the time every phase of the last request took. Streamed
+ * responses are parsed and rendered while they arrive, so their transfer
+ * includes the parse and render phases.
+ * @return The phases, with the network ones zero if the answer came from the
+ * cache
+ */
+const completion_stats_t *completions_stats();
+
+/**
+ * @brief Opens a named session, restoring its messages into the context.
+ * Every message added afterwards is appended to its log.
+ * @param name Name of the session
+ * @param restored Receives the amount of restored messages
+ * @return The status of the operation
+ */
+size_t completions_open_session(const char *const name,
+                                size_t *const restored);
+
+/**
+ * @brief Starts a new conversation. The messages of the context and the
+ * session total are dropped and the open session is closed, while the
+ * connection, the cache and the key pool stay.
+ */
+void completions_reset_context();
+
+/**
+ * @brief Drops the user message of the last turn from the context and the
+ * session log. Called when the turn got no usable answer.
+ * @return The status of the operation
+ */
+size_t completions_discard_turn();
+
+/**
+ * @brief Creates an additional handle sharing the caches of the session
+ * @param config Configuration holding the endpoint and the timeouts
+ * @return The new handle, or null on failure
+ */
+CURL *completions_new_handle(const termchat_config_t *const config);
+
+/**
+ * @brief Sets up the pool of keys the first time it is needed, building the
+ * headers every request sent with each key carries
+ * @param config Configuration holding the keys and their endpoints
+ * @return The pool, or null on failure
+ */
+ratelimit_pool_t *completions_pool(const termchat_config_t *const config);
+
+/**
+ * @brief Estimates the tokens a request counts against the rate limit of its
+ * key, its prompt and the completion it may generate
+ * @param config Configuration holding the token limit of the completion
+ * @param body_length Length of the request body
+ * @return The estimated tokens
+ */
+double completions_estimate_tokens(const termchat_config_t *const config,
+                                   const size_t body_length);
+
+/**
+ * @brief Points a handle at the endpoint and headers of a key, reading the
+ * rate-limit headers of its responses into the buckets of the key
+ * @param curl Handle to configure
+ * @param key Key the request is sent with
+ */
+void completions_use_key(CURL *const curl, ratelimit_key_t *const key);
+
+/**
+ * @brief Whether a failed attempt is worth repeating
+ * @param code Result of the transfer
+ * @param httpStatus HTTP status of the response
+ * @return True for rate limits, server errors and broken connections
+ */
+bool completions_is_retryable(const CURLcode code, const long httpStatus);
+
+/**
+ * @brief Gets how long to wait before the next attempt. `Retry-After` is
+ * honored, otherwise the delay doubles with every attempt and half of it is
+ * random so that clients failing together do not retry together.
+ * @param config Configuration holding the base delay
+ * @param curl Handle of the failed attempt
+ * @param attempt Number of the failed attempt, starting at 0
+ * @return The delay in milliseconds
+ */
+int64_t completions_retry_delay_ms(const termchat_config_t *const config,
+                                   CURL *const curl, const int64_t attempt);
+
+/**
+ * @brief Writes the model, token limit and instruction that open every
+ * request body, leaving the `messages` array open
+ * @param dest Buffer the header is appended to
+ * @param config Configuration holding the model and the instruction
+ * @return The status of the operation
+ */
+size_t completions_write_header(buffer_t *const dest,
+                                const termchat_config_t *const config);
+
+/**
+ * @brief Opens the response cache the first time it is needed
+ * @param config Configuration enabling the cache
+ * @return The cache, or null if it is disabled or could not be opened
+ */
+cache_t *completions_cache(const termchat_config_t *const config);
+
+/**
+ * @brief Gets the reactor driving every transfer of the session
+ * @return The reactor
+ */
+reactor_t *completions_reactor();
+
+/**
+ * @brief Consumes input of a descriptor whenever it arrives while a request
+ * runs or the connection is warmed up
+ * @param fd Descriptor to watch, -1 stops watching
+ * @param on_input Callback consuming the input
+ * @param data Pointer handed to the callback
+ */
+void completions_watch_input(const int fd, const completion_input_cb_t on_input,
+                             void *const data);
+
+/**
+ * @brief Waits until a terminal has input, or until the watcher of the
+ * descriptor reports its input complete, opening the connection to the
+ * endpoint in the meantime and keeping it from going idle. Returns right away
+ * when the descriptor is not a terminal or `prewarm` is disabled.
+ * @param config Configuration naming the endpoint
+ * @param fd Descriptor the next prompt is read from
+ * @return The status of the operation
+ */
+size_t completions_await_input(const termchat_config_t *const config,
+                               const int fd);
+
+/**
+ * @brief Whether the last request was sent over an already open connection
+ * @return True if no new connection had to be established
+ */
+bool completions_connection_reused();
 
 /**
  * @brief Adds context based on the provided input.
@@ -21,19 +233,28 @@ size_t add_context(const char *const input, role_type_t role_type);
 
 /**
  * @brief Calls the OpenAI Completions API with the user input
- * @param api_key OpenAI generated api key
- * @param model GPT model to use
- * @param role Role of the LLM: 'system' | 'user' | 'developer' | 'tool' |
- * 'assistant'
- * @param instruction instruction on what the LLM should do
+ * @param config Configuration holding the key, model, instruction and endpoint
+ * @param input user input
+ * @param output Buffer receiving the raw response body, grown as needed
+ * @return Whether the function was successful
+ */
+size_t get_prompt_response(const termchat_config_t *const config,
+                           const char *const input, buffer_t *const output);
+
+/**
+ * @brief Calls the OpenAI Completions API with the user input and streams the
+ * reply back fragment by fragment
+ * @param config Configuration holding the key, model, instruction and endpoint
  * @param input user input
- * @param output output buffer to be written to
- * @param outputSize size of the buffer
+ * @param on_delta Callback receiving every content fragment
+ * @param data Pointer handed to the callback
+ * @param output Buffer receiving the assembled, unescaped message content,
+ * grown as needed
  * @return Whether the function was successful
  */
-size_t get_prompt_response(const char *const api_key, const char *const model,
-                           const char *const role,
-                           const char *const instruction,
-                           const char *const input, char *const output);
+size_t get_prompt_stream(const termchat_config_t *const config,
+                         const char *const input,
+                         const completion_delta_cb_t on_delta,
+                         void *const data, buffer_t *const output);
 
 #endif
@@ -1,11 +1,50 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 constexpr uint8_t FILE_EXISTS = 0;
 constexpr uint8_t FILE_NOT_EXISTS = 1;
 
+typedef struct {
+  char *api_key;
+  char *endpoint;
+} termchat_upstream_t;
+
+typedef struct {
+  char *api_key;
+  char *model;
+  char *role;
+  char *instruction;
+  char *endpoint;
+  int64_t connect_timeout_ms;
+  int64_t timeout_ms;
+  int64_t max_tokens;
+  bool stream;
+  bool cache;
+  bool prewarm;
+  int64_t exec_parallel;
+  int64_t retries;
+  int64_t retry_base_ms;
+  double hedge_percentile;
+  int64_t hedge_min_ms;
+  bool compress;
+  int64_t compress_min_bytes;
+  int64_t cache_ttl_s;
+  int64_t cache_max_mb;
+  char *tokenizer;
+  double input_cost;
+  double cached_input_cost;
+  double output_cost;
+  int64_t context_max_bytes;
+  int64_t context_max_tokens;
+  int64_t context_keep_turns;
+  termchat_upstream_t *pool;
+  size_t pool_count;
+  char *storage;
+} termchat_config_t;
+
 /**
  * @brief Retrieves the path to the configuration file.
  * @param output A character array to store the resulting path.
@@ -21,13 +60,19 @@ int get_rc_path(char *const output, const int len);
 int get_rc_exists();
 
 /**
- * @brief Reads the contents of the specified configuration file.
+ * @brief Reads the configuration file with a single read and fills the typed
+ * configuration in one pass over its contents. String values point into
+ * storage owned by the configuration and keep their JSON escapes.
  * @param filename The name of the configuration file to read.
- * @param buffer A character array to store the file's contents.
- * @param bufferLength Size of the buffer array
+ * @param config Configuration to fill
  * @return 0 on success, or a non-zero error code on failure.
  */
-int get_rc_contents(const char *const filename, char *const buffer,
-                    unsigned long bufferLength);
+int config_load(const char *const filename, termchat_config_t *const config);
+
+/**
+ * @brief Releases the storage of a loaded configuration
+ * @param config Configuration to release
+ */
+void config_free(termchat_config_t *const config);
 
 #endif
@@ -0,0 +1,79 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include "buffer.h"
+#include <stddef.h>
+#include <stdint.h>
+
+constexpr size_t CONTEXT_TOKENS_UNKNOWN = SIZE_MAX;
+
+typedef enum : uint8_t {
+  role_type_user,
+  role_type_assistant,
+  role_type_developer
+} role_type_t;
+
+typedef struct {
+  role_type_t role;
+  size_t offset;
+  size_t length;
+  size_t json_offset;
+  size_t json_length;
+  size_t tokens;
+  bool elided;
+} context_message_t;
+
+typedef struct {
+  buffer_t arena;
+  buffer_t json;
+  context_message_t *messages;
+  size_t count;
+  size_t capacity;
+} context_t;
+
+/**
+ * @brief Appends a message to the conversation. The content is copied into
+ * the arena of the conversation, so storage grows with the actual size of the
+ * messages. The message is also serialized once into the `json` buffer as
+ * `,{"role":"...","content":"..."}`, so the buffer always holds the tail of the
+ * `messages` array of a request.
+ * @param context Conversation to append to
+ * @param role Role of the author of the message
+ * @param content Plain, unescaped content of the message
+ * @param length Length of the content
+ * @returns The status of the operation
+ */
+size_t context_push(context_t *const context, const role_type_t role,
+                    const char *const content, const size_t length);
+
+/**
+ * @brief Gets the null terminated content of a stored message
+ * @param context Conversation holding the message
+ * @param index Position of the message inside the conversation
+ * @returns Pointer to the content, valid until the next push
+ */
+const char *context_content(const context_t *const context,
+                            const size_t index);
+
+/**
+ * @brief Gets the name the completions API uses for a role
+ * @param role Role to name
+ * @returns The name of the role, or null for unknown roles
+ */
+const char *context_role_name(const role_type_t role);
+
+/**
+ * @brief Drops every message from the given position on, together with its
+ * content and serialized form
+ * @param context Conversation to shorten
+ * @param count Amount of messages to keep
+ */
+void context_truncate(context_t *const context, const size_t count);
+
+/**
+ * @brief Releases every message of the conversation
+ * @param context Conversation to release
+ */
+void context_free(context_t *const context);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include "config.h"
+#include <stddef.h>
+
+/**
+ * @brief Callback answering a request forwarded by a client. While it runs,
+ * stdin, stdout and stderr are the ones of the client and the working
+ * directory is the one of the client.
+ * @param argc Amount of arguments
+ * @param argv Arguments the client was started with
+ * @param data Pointer given to `daemon_serve`
+ * @return The status the client exits with
+ */
+typedef size_t (*daemon_request_cb_t)(const int argc,
+                                      const char *const *const argv,
+                                      void *const data);
+
+/**
+ * @brief Hands a prompt to a running daemon instead of answering it in this
+ * process. The arguments, the working directory and the standard descriptors
+ * are sent over the socket, the daemon writes the reply straight to them. A
+ * daemon reading another configuration file than this process leaves the
+ * prompt to it.
+ * @param argc Amount of arguments
+ * @param argv Arguments of the program
+ * @param status Receives the status the daemon answered with
+ * @return True if a daemon took the request, false if none is listening or
+ * it rejected the request
+ */
+bool daemon_forward(const int argc, const char *const *const argv,
+                    size_t *const status);
+
+/**
+ * @brief Listens on `$XDG_RUNTIME_DIR/termchat.sock`, or inside the private
+ * directory `/tmp/termchat-<uid>` without a runtime directory, and detaches into
+ * the background. The caller returns once the socket accepts connections,
+ * the detached process answers one client after another and keeps the
+ * connection to the endpoint warm while idle. It stops on SIGTERM or SIGINT.
+ * @param config Configuration of the daemon
+ * @param on_request Callback answering every request
+ * @param data Pointer handed to the callback
+ * @return The status of the operation
+ */
+size_t daemon_serve(const termchat_config_t *const config,
+                    const daemon_request_cb_t on_request, void *const data);
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef EDITOR_H
+#define EDITOR_H
+
+#include "buffer.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <termios.h>
+
+typedef struct {
+  int fd;
+  // Whether the terminal was switched out of canonical mode
+  bool raw;
+  // Whether keystrokes are echoed, off while an answer is arriving
+  bool visible;
+  bool closed;
+  // Whether the line is drawn below an answer that is still arriving
+  bool previewed;
+  // Position inside an escape sequence such as an arrow key
+  uint8_t escape;
+  struct termios saved;
+  buffer_t line;
+  // Finished lines waiting to be sent, each null terminated
+  buffer_t queue;
+  size_t queued;
+} editor_t;
+
+/**
+ * @brief Starts editing lines read from a descriptor. A terminal is switched
+ * out of canonical mode and echo, so keystrokes are only shown while the
+ * editor is visible and are kept even while it is hidden.
+ * @param editor Editor to open
+ * @param fd Descriptor the keystrokes are read from
+ * @return The status of the operation
+ */
+size_t editor_open(editor_t *const editor, const int fd);
+
+/**
+ * @brief Restores the terminal and releases the lines of the editor
+ * @param editor Editor to close
+ */
+void editor_close(editor_t *const editor);
+
+/**
+ * @brief Switches the terminal back to the mode it had before the editor was
+ * opened, leaving the lines untouched. Only calls `tcsetattr`, so it is safe
+ * inside a signal handler.
+ * @param editor Editor whose terminal is restored
+ */
+void editor_restore(const editor_t *const editor);
+
+/**
+ * @brief Consumes the input that is available right now with a single read,
+ * which must not block. Backspace, Ctrl-U and Ctrl-W edit the current line,
+ * Enter queues it and Ctrl-D on an empty line ends the input. Once a line
+ * was queued the editor is hidden, so text typed after it is not echoed.
+ * @param editor Editor receiving the input
+ * @return The status of the operation
+ */
+size_t editor_feed(editor_t *const editor);
+
+/**
+ * @brief Blocks until input is available and consumes it
+ * @param editor Editor receiving the input
+ * @return The status of the operation
+ */
+size_t editor_wait(editor_t *const editor);
+
+/**
+ * @brief Draws the line being typed while the editor is hidden, dimmed on the
+ * current line of the terminal, which must be empty. Lines already queued
+ * are counted in front of it. Only the end of the line that fits the width
+ * of the terminal is drawn, so erasing it never has to cross rows.
+ * @param editor Editor holding the line
+ */
+void editor_preview(editor_t *const editor);
+
+/**
+ * @brief Erases the line drawn by `editor_preview`, leaving the cursor at the
+ * start of the now empty terminal line
+ * @param editor Editor holding the line
+ */
+void editor_clear_preview(editor_t *const editor);
+
+/**
+ * @brief Consumes every keystroke typed so far without blocking, so none of
+ * them is taken as the answer to a question asked afterwards
+ * @param editor Editor receiving the input
+ */
+void editor_drain(editor_t *const editor);
+
+/**
+ * @brief Shows the line typed so far and echoes keystrokes from now on
+ * @param editor Editor to show
+ */
+void editor_show(editor_t *const editor);
+
+/**
+ * @brief Stops echoing keystrokes, they are still edited and queued
+ * @param editor Editor to hide
+ */
+void editor_hide(editor_t *const editor);
+
+/**
+ * @brief Whether a finished line is waiting to be taken
+ * @param editor Editor to ask
+ * @return True if at least one line is queued
+ */
+bool editor_has_line(const editor_t *const editor);
+
+/**
+ * @brief Takes the oldest queued line
+ * @param editor Editor holding the line
+ * @param dest Destination of the line, null terminated
+ * @param len Size of the destination, longer lines are cut
+ * @return The status of the operation, unrecoverable if no line is queued
+ */
+size_t editor_take_line(editor_t *const editor, char *const dest,
+                        const size_t len);
+
+#endif
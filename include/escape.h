@@ -0,0 +1,32 @@
+#ifndef ESCAPE_H
+#define ESCAPE_H
+
+#include "buffer.h"
+#include <stddef.h>
+
+/**
+ * @brief Appends a string to the buffer escaped as the contents of a JSON
+ * string. Quotes, backslashes and control characters are escaped, everything
+ * else including UTF-8 sequences is copied in runs.
+ * @param dest Buffer to append to
+ * @param src String to escape
+ * @param length Length of the string
+ * @returns The status of the operation
+ */
+size_t json_escape(buffer_t *const dest, const char *const src,
+                   const size_t length);
+
+/**
+ * @brief Decodes the contents of a JSON string. `\uXXXX` escapes, including
+ * surrogate pairs, are written as UTF-8. The output is never longer than the
+ * input, so `dest` may be the same pointer as `src`. The result is null
+ * terminated.
+ * @param dest Where the decoded string is written
+ * @param src Escaped contents of a JSON string
+ * @param length Length of the escaped contents
+ * @returns Length of the decoded string
+ */
+size_t json_unescape(char *const dest, const char *const src,
+                     const size_t length);
+
+#endif
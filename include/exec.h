@@ -0,0 +1,52 @@
+#ifndef EXEC_H
+#define EXEC_H
+
+#include "buffer.h"
+#include <stddef.h>
+#include <sys/types.h>
+
+typedef struct {
+  const char *command;
+  pid_t pid;
+  // Becomes readable once the command exited, -1 where pidfds are missing
+  int pidfd;
+  int fds[2];
+  bool line_start[2];
+  buffer_t head;
+  buffer_t tail;
+  size_t total;
+  int status;
+  bool spawned;
+  bool finished;
+} exec_job_t;
+
+/**
+ * @brief Runs shell commands through `posix_spawn`, at most `parallel` of
+ * them at once. Their stdout and stderr are streamed to the terminal while
+ * they arrive, prefixed with the number of the command when several run
+ * together, and captured for `exec_output`.
+ * @param jobs Jobs holding the commands, their other fields are filled
+ * @param count Amount of jobs
+ * @param parallel Upper bound of commands running at once
+ * @return The status of the operation
+ */
+size_t exec_run(exec_job_t *const jobs, const size_t count,
+                const size_t parallel);
+
+/**
+ * @brief Appends the captured output of a finished command. Output beyond the
+ * capture bound keeps its beginning and its end, with a note in place of the
+ * dropped middle.
+ * @param job Finished job
+ * @param dest Buffer to append to
+ * @return The status of the operation
+ */
+size_t exec_output(const exec_job_t *const job, buffer_t *const dest);
+
+/**
+ * @brief Releases the captured output of a job
+ * @param job Job to release
+ */
+void exec_job_free(exec_job_t *const job);
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef JSONSCAN_H
+#define JSONSCAN_H
+
+#include <stddef.h>
+
+/**
+ * @brief Callback invoked for every member of a JSON object
+ * @param key Name of the member, still escaped and not null terminated
+ * @param length Length of the name
+ * @param value Start of the value
+ * @param end End of the document
+ * @param data Pointer given to `json_object_each`
+ * @returns Position right after the value, or null to stop with an error
+ */
+typedef const char *(*json_member_cb_t)(const char *const key,
+                                        const size_t length,
+                                        const char *const value,
+                                        const char *const end,
+                                        void *const data);
+
+/**
+ * @brief Callback invoked for every element of a JSON array
+ * @param value Start of the element
+ * @param end End of the document
+ * @param data Pointer given to `json_array_each`
+ * @returns Position right after the element, or null to stop with an error
+ */
+typedef const char *(*json_element_cb_t)(const char *const value,
+                                         const char *const end,
+                                         void *const data);
+
+/**
+ * @brief Skips whitespace between JSON tokens
+ * @param cursor Current position
+ * @param end End of the document
+ * @returns The first position that is not whitespace
+ */
+const char *json_skip_space(const char *cursor, const char *const end);
+
+/**
+ * @brief Finds the closing quote of a JSON string
+ * @param cursor Position of the opening quote
+ * @param end End of the document
+ * @returns Position of the closing quote, or null if the string never ends
+ */
+const char *json_scan_string(const char *cursor, const char *const end);
+
+/**
+ * @brief Skips a JSON value of any type, including nested objects and arrays
+ * @param cursor Start of the value
+ * @param end End of the document
+ * @returns Position right after the value, or null on malformed input
+ */
+const char *json_skip_value(const char *cursor, const char *const end);
+
+/**
+ * @brief Walks the members of a JSON object once, handing every member to
+ * the callback which consumes its value
+ * @param cursor Position of the opening brace, whitespace may precede it
+ * @param end End of the document
+ * @param on_member Callback consuming each value
+ * @param data Pointer handed to the callback
+ * @returns Position right after the closing brace, or null on error
+ */
+const char *json_object_each(const char *cursor, const char *const end,
+                             const json_member_cb_t on_member,
+                             void *const data);
+
+/**
+ * @brief Walks the elements of a JSON array once, handing every element to
+ * the callback which consumes it
+ * @param cursor Position of the opening bracket, whitespace may precede it
+ * @param end End of the document
+ * @param on_element Callback consuming each element
+ * @param data Pointer handed to the callback
+ * @returns Position right after the closing bracket, or null on error
+ */
+const char *json_array_each(const char *cursor, const char *const end,
+                            const json_element_cb_t on_element,
+                            void *const data);
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include "config.h"
+#include <curl/curl.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  // Zero until the server announced the limit
+  double limit;
+  double level;
+  // Units regained per millisecond until the bucket is full again
+  double rate;
+  int64_t updated_ms;
+} ratelimit_bucket_t;
+
+typedef struct {
+  const char *api_key;
+  const char *endpoint;
+  struct curl_slist *headers;
+  // Announces a gzip body, null unless compression is enabled
+  struct curl_slist *gzip_headers;
+  // Set once the endpoint refused a compressed body
+  bool gzip_rejected;
+  ratelimit_bucket_t requests;
+  ratelimit_bucket_t tokens;
+  int64_t blocked_until_ms;
+  size_t in_flight;
+  size_t index;
+} ratelimit_key_t;
+
+typedef struct {
+  ratelimit_key_t *keys;
+  size_t count;
+} ratelimit_pool_t;
+
+/**
+ * @brief Creates an entry for the configured key and for every key of the
+ * `pool`, without headers yet
+ * @param pool Pool to fill
+ * @param config Configuration holding the keys and their endpoints
+ * @return The status of the operation
+ */
+size_t ratelimit_open(ratelimit_pool_t *const pool,
+                      const termchat_config_t *const config);
+
+/**
+ * @brief Releases the keys of a pool and their headers
+ * @param pool Pool to release
+ */
+void ratelimit_close(ratelimit_pool_t *const pool);
+
+/**
+ * @brief Picks the key with the most headroom left for a request and takes
+ * the request and its tokens out of its buckets. Keys the server has not
+ * reported limits for yet count as having full headroom, shared by the
+ * requests already in flight on them.
+ * @param pool Pool to pick from
+ * @param tokens Estimated tokens of the request, prompt and completion
+ * @param wait_ms Receives how long to wait until a key has room, when none
+ * has right now
+ * @return The key, or null when every key is exhausted or blocked
+ */
+ratelimit_key_t *ratelimit_pick(ratelimit_pool_t *const pool,
+                                const double tokens, int64_t *const wait_ms);
+
+/**
+ * @brief Header callback for libcurl reading the `x-ratelimit-limit-*`,
+ * `x-ratelimit-remaining-*` and `x-ratelimit-reset-*` headers of a response
+ * into the buckets of the key that sent the request
+ * @param line Header line, not null terminated
+ * @param size Size of a single element
+ * @param nitems Amount of elements
+ * @param data Key the request was sent with
+ * @return The amount of bytes consumed
+ */
+size_t ratelimit_header_cb(char *const line, size_t size, size_t nitems,
+                           void *const data);
+
+/**
+ * @brief Releases the request of a key once it finished. A rejected request
+ * keeps the key out of the rotation until the server allows it again.
+ * @param key Key the request was sent with
+ * @param http_status Status of the response
+ * @param retry_after_s Seconds the `Retry-After` header asked for, 0 if none
+ */
+void ratelimit_finish(ratelimit_key_t *const key, const long http_status,
+                      const int64_t retry_after_s);
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <curl/curl.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct reactor_transfer reactor_transfer_t;
+
+/**
+ * @brief Callback invoked once a transfer finished, successfully or not
+ * @param transfer The transfer that finished
+ * @param code Result of the transfer
+ */
+typedef void (*reactor_done_cb_t)(reactor_transfer_t *const transfer,
+                                  const CURLcode code);
+
+/**
+ * @brief Callback invoked periodically while the reactor is running
+ * @param data Pointer given to `reactor_set_ticker`
+ */
+typedef void (*reactor_tick_cb_t)(void *const data);
+
+/**
+ * @brief Callback invoked whenever the watched input descriptor is readable.
+ * The callback must consume the pending input.
+ * @param fd The readable descriptor
+ * @param data Pointer given to `reactor_watch_input`
+ */
+typedef void (*reactor_input_cb_t)(const int fd, void *const data);
+
+struct reactor_transfer {
+  CURL *curl;
+  reactor_done_cb_t on_done;
+  void *data;
+  bool active;
+};
+
+typedef struct {
+  int epoll;
+  int timer;
+  int ticker;
+  int input;
+  size_t active;
+  CURLM *multi;
+  reactor_tick_cb_t on_tick;
+  void *tick_data;
+  reactor_input_cb_t on_input;
+  void *input_data;
+} reactor_t;
+
+/**
+ * @brief Creates the epoll instance, the timers and the curl multi handle
+ * @param reactor Reactor to initialize
+ * @returns The status of the operation
+ */
+size_t reactor_init(reactor_t *const reactor);
+
+/**
+ * @brief Releases every resource held by the reactor
+ * @param reactor Reactor to clean up
+ */
+void reactor_cleanup(reactor_t *const reactor);
+
+/**
+ * @brief Starts a transfer on the reactor. The transfer must stay valid until
+ * its `on_done` callback was invoked.
+ * @param reactor Reactor driving the transfer
+ * @param transfer Transfer holding the configured easy handle
+ * @returns The status of the operation
+ */
+size_t reactor_add(reactor_t *const reactor,
+                   reactor_transfer_t *const transfer);
+
+/**
+ * @brief Stops a transfer before it finished. Its callback is not invoked.
+ * @param reactor Reactor driving the transfer
+ * @param transfer Transfer to stop
+ */
+void reactor_remove(reactor_t *const reactor,
+                    reactor_transfer_t *const transfer);
+
+/**
+ * @brief Calls a function periodically while transfers are running
+ * @param reactor Reactor owning the timer
+ * @param interval_ms Interval between two calls, 0 disables the ticker
+ * @param on_tick Function to call
+ * @param data Pointer handed to the function
+ * @returns The status of the operation
+ */
+size_t reactor_set_ticker(reactor_t *const reactor, const uint32_t interval_ms,
+                          const reactor_tick_cb_t on_tick, void *const data);
+
+/**
+ * @brief Watches a descriptor for input while transfers are running
+ * @param reactor Reactor owning the descriptor
+ * @param fd Descriptor to watch, -1 stops watching
+ * @param on_input Function called whenever the descriptor is readable
+ * @param data Pointer handed to the function
+ * @returns The status of the operation
+ */
+size_t reactor_watch_input(reactor_t *const reactor, const int fd,
+                           const reactor_input_cb_t on_input,
+                           void *const data);
+
+/**
+ * @brief Blocks until every transfer of the reactor finished. The thread only
+ * wakes up for socket activity, curl timeouts, ticks and input.
+ * @param reactor Reactor to run
+ * @returns The status of the operation
+ */
+size_t reactor_run(reactor_t *const reactor);
+
+#endif
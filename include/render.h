@@ -0,0 +1,98 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "buffer.h"
+#include "term.h"
+#include <stddef.h>
+
+// Longest line marker held back, a nine digit list number with its dot and
+// space
+constexpr size_t RENDER_MARKER_MAX = 11;
+
+typedef enum : uint8_t {
+  render_line_indent,
+  render_line_marker,
+  render_line_prose,
+  render_line_heading,
+  render_line_fence,
+  render_line_code
+} render_line_t;
+
+typedef struct {
+  int fd;
+  bool tty;
+  bool open;
+  term_color_t color;
+  // Whether the output written so far ends with a newline
+  bool line_start;
+  buffer_t out;
+  // Markdown state, only ever about the current line and block
+  render_line_t line;
+  size_t indent;
+  char marker[RENDER_MARKER_MAX];
+  size_t marker_length;
+  bool code_block;
+  bool inline_code;
+  size_t ticks;
+  size_t open_ticks;
+} term_renderer_t;
+
+/**
+ * @brief Prepares a renderer writing to a descriptor. Escape codes are only
+ * emitted when the descriptor is a terminal.
+ * @param renderer Renderer to initialize
+ * @param fd Descriptor the output is written to
+ */
+void render_init(term_renderer_t *const renderer, const int fd);
+
+/**
+ * @brief Queues text in a color. The color escape is only written when a new
+ * run of color starts, and bytes are copied untouched so UTF-8 sequences stay
+ * intact.
+ * @param renderer Renderer collecting the output
+ * @param text Text to render
+ * @param length Length of the text
+ * @param color Color of the text
+ * @returns The status of the operation
+ */
+size_t render_text(term_renderer_t *const renderer, const char *const text,
+                   const size_t length, const term_color_t color);
+
+/**
+ * @brief Queues a fragment of a markdown answer. Fenced code blocks, inline
+ * code, headings and list markers are colored as they arrive, every byte is
+ * kept as it is. Only the few bytes that may still turn out to be the marker
+ * of a line are held back, so the work done is proportional to the fragment
+ * and nothing is redrawn.
+ * @param renderer Renderer collecting the output
+ * @param text Fragment of the answer, split at any byte
+ * @param length Length of the fragment
+ * @returns The status of the operation
+ */
+size_t render_markdown(term_renderer_t *const renderer, const char *const text,
+                       const size_t length);
+
+/**
+ * @brief Writes everything queued so far with a single system call, leaving
+ * the current run of color open. Other output written in between must set
+ * `open` to false, so the next text starts its color again.
+ * @param renderer Renderer to flush
+ * @returns The status of the operation
+ */
+size_t render_flush(term_renderer_t *const renderer);
+
+/**
+ * @brief Queues the marker bytes still held back, closes the current run of
+ * color and flushes the renderer
+ * @param renderer Renderer to finish
+ * @returns The status of the operation
+ */
+size_t render_finish(term_renderer_t *const renderer);
+
+/**
+ * @brief Releases the output buffer of the renderer
+ * @param renderer Renderer to release
+ */
+void render_free(term_renderer_t *const renderer);
+
+#endif
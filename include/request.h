@@ -0,0 +1,72 @@
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include "buffer.h"
+#include <curl/curl.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+typedef struct {
+  struct iovec *segments;
+  size_t count;
+  size_t capacity;
+  size_t total;
+  size_t segment;
+  size_t offset;
+} request_body_t;
+
+/**
+ * @brief Empties the body and rewinds it, keeping the segment storage
+ * @param body Body to reset
+ */
+void request_body_reset(request_body_t *const body);
+
+/**
+ * @brief Appends a segment to the body without copying it. The memory must
+ * stay valid and unchanged until the upload finished.
+ * @param body Body to append to
+ * @param data Start of the segment
+ * @param length Length of the segment
+ * @returns The status of the operation
+ */
+size_t request_body_add(request_body_t *const body, const void *const data,
+                        const size_t length);
+
+/**
+ * @brief Read callback for libcurl, uploading the segments one after another
+ * @param buffer Buffer libcurl wants the next bytes in
+ * @param size Size of one item
+ * @param nitems Amount of items fitting into the buffer
+ * @param body Body being uploaded
+ * @returns The amount of bytes written into the buffer
+ */
+size_t request_body_read(char *const buffer, const size_t size,
+                         const size_t nitems, void *const body);
+
+/**
+ * @brief Seek callback for libcurl, used when a request must be sent again
+ * @param body Body being uploaded
+ * @param offset Absolute position to continue from
+ * @param origin Only `SEEK_SET` is supported
+ * @returns A `CURL_SEEKFUNC_*` status
+ */
+int request_body_seek(void *const body, const curl_off_t offset,
+                      const int origin);
+
+/**
+ * @brief Compresses the segments of a body into a single gzip stream, feeding
+ * them to zlib one after another without joining them first
+ * @param body Body to compress
+ * @param dest Buffer receiving the compressed body, replacing its content
+ * @returns The status of the operation
+ */
+size_t request_body_gzip(const request_body_t *const body,
+                         buffer_t *const dest);
+
+/**
+ * @brief Releases the segment storage of the body
+ * @param body Body to release
+ */
+void request_body_free(request_body_t *const body);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  int64_t prompt_tokens;
+  int64_t completion_tokens;
+  int64_t cached_tokens;
+  bool reported;
+} completion_usage_t;
+
+typedef struct {
+  // Strings point into the response and are still escaped, null if the
+  // response does not hold them
+  const char *content;
+  size_t content_length;
+  const char *finish_reason;
+  size_t finish_reason_length;
+  const char *error;
+  size_t error_length;
+  completion_usage_t usage;
+} response_fields_t;
+
+/**
+ * @brief Reads `choices[0].message.content`, or `choices[0].delta.content`
+ * of a streamed event, `choices[0].finish_reason`, `usage` and
+ * `error.message` out of a completions response in a single pass, without
+ * copying or allocating. Members at any other path are skipped unread, so a
+ * `content` key nested inside tool output or a later choice never matches.
+ * @param response Body of the response, or the payload of a single event
+ * @param length Length of the response
+ * @param fields Receives the fields that were found
+ * @return True if the response is a well-formed JSON object
+ */
+bool response_parse(const char *const response, const size_t length,
+                    response_fields_t *const fields);
+
+#endif
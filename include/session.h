@@ -0,0 +1,66 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "context.h"
+#include <stddef.h>
+
+typedef struct {
+  int fd;
+  size_t count;
+  // Bytes of the log holding complete records
+  size_t length;
+} session_t;
+
+/**
+ * @brief Callback receiving every message stored in a session log
+ * @param role Role of the message
+ * @param content Content of the message, not null terminated
+ * @param length Length of the content
+ * @param data Pointer given to `session_open`
+ * @return The status of the operation
+ */
+typedef size_t (*session_message_cb_t)(const role_type_t role,
+                                       const char *const content,
+                                       const size_t length, void *const data);
+
+/**
+ * @brief Opens the log of a named session under
+ * `$XDG_STATE_HOME/termchat/sessions`, replaying every stored message. A
+ * record cut short by a crash is dropped.
+ * @param session Session to open
+ * @param name Name of the session
+ * @param on_message Callback receiving every stored message
+ * @param data Pointer handed to the callback
+ * @return The status of the operation
+ */
+size_t session_open(session_t *const session, const char *const name,
+                    const session_message_cb_t on_message, void *const data);
+
+/**
+ * @brief Appends a message to the log with a single write and waits until it
+ * reached the disk
+ * @param session Session to append to
+ * @param role Role of the message
+ * @param content Content of the message
+ * @param length Length of the content
+ * @return The status of the operation
+ */
+size_t session_append(session_t *const session, const role_type_t role,
+                      const char *const content, const size_t length);
+
+/**
+ * @brief Cuts the log back to an earlier state, dropping every message
+ * appended since
+ * @param session Session to cut back
+ * @param mark Copy of the session taken before the messages were appended
+ * @return The status of the operation
+ */
+size_t session_rewind(session_t *const session, const session_t *const mark);
+
+/**
+ * @brief Closes the log of a session
+ * @param session Session to close
+ */
+void session_close(session_t *const session);
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef SSE_H
+#define SSE_H
+
+#include "buffer.h"
+#include <stddef.h>
+
+/**
+ * @brief Callback invoked once for every complete server-sent event
+ * @param data Payload of the event, all `data:` lines joined by newlines
+ * @param length Length of the payload
+ * @param user Pointer given to `sse_init`
+ */
+typedef void (*sse_event_cb_t)(const char *const data, const size_t length,
+                               void *const user);
+
+typedef struct {
+  bool skip_lf;
+  sse_event_cb_t on_event;
+  void *user;
+  buffer_t line;
+  buffer_t data;
+} sse_parser_t;
+
+/**
+ * @brief Prepares a parser to receive an event stream. A parser must be zero
+ * initialized before its first use; its buffers are kept between streams.
+ * @param parser Parser to initialize
+ * @param on_event Function called for each complete event
+ * @param user Pointer handed back to the callback
+ */
+void sse_init(sse_parser_t *const parser, const sse_event_cb_t on_event,
+              void *const user);
+
+/**
+ * @brief Releases the buffers of the parser
+ * @param parser Parser to release
+ */
+void sse_free(sse_parser_t *const parser);
+
+/**
+ * @brief Feeds a chunk of the event stream into the parser. Chunks may split
+ * lines and events at any byte; incomplete lines are kept until the next call.
+ * @param parser Parser holding the state between chunks
+ * @param chunk Bytes received from the network
+ * @param length Amount of bytes inside the chunk
+ * @returns The status of the operation
+ */
+size_t sse_feed(sse_parser_t *const parser, const char *const chunk,
+                const size_t length);
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef TERM_H
+#define TERM_H
+
+#include <stdint.h>
+
+typedef enum : uint8_t {
+  term_color_red = 31,
+  term_color_green = 32,
+  term_color_yellow = 33,
+  term_color_blue = 34,
+  term_color_cyan = 36,
+  term_color_none = 37,
+} term_color_t;
+
+typedef enum : uint8_t {
+  term_code_newline = 10,
+  term_code_space = 32,
+  term_code_backslash = 92
+} term_code_t;
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  uint64_t hash;
+  uint32_t offset;
+  uint32_t length;
+  uint32_t rank;
+} tokenizer_entry_t;
+
+// Pre-tokenization pattern text is split with before merging
+typedef enum : uint8_t {
+  tokenizer_split_cl100k,
+  tokenizer_split_o200k
+} tokenizer_split_t;
+
+typedef struct {
+  unsigned char *blob;
+  tokenizer_entry_t *table;
+  size_t mask;
+  size_t count;
+  tokenizer_split_t split;
+} tokenizer_t;
+
+/**
+ * @brief Gets the name of the byte-pair encoding a model uses
+ * @param model Name of the model
+ * @return Name of the encoding, such as "o200k_base"
+ */
+const char *tokenizer_encoding(const char *const model);
+
+/**
+ * @brief Loads a tiktoken ranks file, one base64 encoded token and its rank
+ * per line, into a hash table of merges
+ * @param tokenizer Tokenizer to fill
+ * @param path Path of the ranks file
+ * @param encoding Name of the encoding, which picks the pre-tokenization
+ * pattern
+ * @return The status of the operation
+ */
+size_t tokenizer_load(tokenizer_t *const tokenizer, const char *const path,
+                      const char *const encoding);
+
+/**
+ * @brief Counts the tokens a text is encoded into
+ * @param tokenizer Loaded tokenizer
+ * @param text Text to count
+ * @param length Length of the text
+ * @return The amount of tokens
+ */
+size_t tokenizer_count(const tokenizer_t *const tokenizer,
+                       const char *const text, const size_t length);
+
+/**
+ * @brief Releases the tables of a tokenizer
+ * @param tokenizer Tokenizer to release
+ */
+void tokenizer_free(tokenizer_t *const tokenizer);
+
+#endif
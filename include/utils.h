@@ -2,22 +2,14 @@
 #define UTILS_H
 
 #include "globdef.h"
+#include "term.h"
+#include <errno.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
-
-typedef enum : uint8_t {
-  term_color_red = 31,
-  term_color_green = 32,
-  term_color_none = 37,
-} term_color_t;
-
-typedef enum : uint8_t {
-  term_code_newline = 10,
-  term_code_space = 32,
-  term_code_backslash = 92
-} term_code_t;
+#include <sys/uio.h>
+#include <unistd.h>
 
 typedef struct {
   size_t length;
@@ -58,21 +50,61 @@ cleanup:
 }
 
 /**
- * @brief Prints a string char by char
+ * @brief Writes every vector to stdout, continuing after partial writes
+ * @param iov Vectors to write, modified while writing
+ * @param count Amount of vectors
+ * @returns Whether everything was written
+ */
+static bool term_writev_all(struct iovec *iov, int count) {
+  while (count > 0) {
+    const ssize_t written = writev(STDOUT_FILENO, iov, count);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+
+    size_t left = written;
+    while (count > 0 && left >= iov->iov_len) {
+      left -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + left;
+      iov->iov_len -= left;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Prints a string in a single run of color with one system call.
+ * Escape codes are left out when stdout is not a terminal.
  * @param src Source string to print
  * @param len Length of the string
  * @param color Color of the string to print out
  */
 static void custom_print_string(const char *const src, const size_t len,
                                 const term_color_t color) {
-  for (size_t i = 0; i < len; i++) {
-    if (src[i] == term_code_backslash && ++i <= len && src[i] == 'n') {
-      printf("\n");
-      continue;
-    }
-    printf("\033[%dm%c\033[0m", color, src[i]);
+  char open[16];
+  const int openLength = snprintf(open, sizeof(open), "\033[%dm", color);
+  const bool tty = isatty(STDOUT_FILENO);
+  char reset[] = "\033[0m";
+  char newline[] = "\n";
+  struct iovec iov[] = {
+      {.iov_base = open, .iov_len = tty ? (size_t)openLength : 0},
+      {.iov_base = (void *)src, .iov_len = len},
+      {.iov_base = reset, .iov_len = tty ? sizeof(reset) - 1 : 0},
+      {.iov_base = newline, .iov_len = 1},
+  };
+
+  // Text printed through stdio must come out first
+  fflush(stdout);
+  if (!term_writev_all(iov, sizeof(iov) / sizeof(iov[0]))) {
+    fprintf(stderr, "Failed to write to stdout\n");
   }
-  printf("\n");
 }
 
 /**
@@ -0,0 +1,674 @@
+#define _GNU_SOURCE
+#include "batch.h"
+#include "buffer.h"
+#include "cache.h"
+#include "completions.h"
+#include "escape.h"
+#include "globdef.h"
+#include "jsonscan.h"
+#include "ratelimit.h"
+#include "reactor.h"
+#include "response.h"
+#include <curl/curl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+
+// Results wait in a window of slots until every earlier line was written
+constexpr size_t BATCH_WINDOW_FACTOR = 4;
+constexpr int64_t USEC_PER_MSEC = 1000;
+constexpr char BATCH_STDIN[] = "-";
+constexpr long HTTP_TOO_MANY_REQUESTS = 429;
+
+typedef struct {
+  // Must stay the first member, the reactor hands back this pointer
+  reactor_transfer_t transfer;
+  size_t index;
+  buffer_t id;
+  buffer_t body;
+  buffer_t response;
+  buffer_t error;
+  int64_t queued_ms;
+  long http_status;
+  CURLcode code;
+  uint64_t key;
+  ratelimit_key_t *upstream;
+  int64_t attempts;
+  // Time an item backing off after a failure may be sent again at
+  int64_t resume_ms;
+  bool cached;
+  bool waiting;
+  bool deferred;
+  bool locked;
+  bool done;
+} batch_item_t;
+
+typedef struct {
+  const termchat_config_t *config;
+  reactor_t *reactor;
+  cache_t *cache;
+  ratelimit_pool_t *pool;
+  FILE *input;
+  char *line;
+  size_t line_capacity;
+  bool eof;
+  batch_item_t *items;
+  size_t window;
+  size_t parallel;
+  size_t in_flight;
+  size_t deferred;
+  int64_t resume_ms;
+  size_t next_index;
+  size_t next_emit;
+  size_t succeeded;
+  size_t failed;
+  int64_t started_ms;
+  bool broken;
+  buffer_t header;
+  buffer_t result;
+} batch_t;
+
+typedef struct {
+  const char *id;
+  size_t id_length;
+  const char *prompt;
+  size_t prompt_length;
+} batch_line_t;
+
+/**
+ * @brief Reads the monotonic clock
+ * @returns Milliseconds since an arbitrary point in the past
+ */
+static int64_t now_ms() {
+  struct timespec now = {};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Appends the received bytes of a response to the item owning it
+ * @param ptr Received bytes
+ * @param size Size of a single element
+ * @param nmemb Amount of elements
+ * @param data Item owning the transfer
+ * @returns The amount of bytes consumed
+ */
+static size_t write_item(void *const ptr, size_t size, size_t nmemb,
+                         void *const data) {
+  const size_t totalSize = size * nmemb;
+  batch_item_t *const item = (batch_item_t *)data;
+  if (buffer_append(&item->response, ptr, totalSize) == ERR_UNRECOVERABLE) {
+    return 0;
+  }
+  return totalSize;
+}
+
+/**
+ * @brief Records the `id` and `prompt` members of an input line
+ * @param key Name of the member
+ * @param length Length of the name
+ * @param value Start of the value
+ * @param end End of the line
+ * @param data Line being parsed
+ * @returns Position right after the value, or null on malformed input
+ */
+static const char *on_line_member(const char *const key, const size_t length,
+                                  const char *const value,
+                                  const char *const end, void *const data) {
+  batch_line_t *const line = (batch_line_t *)data;
+  if (length == 2 && memcmp(key, "id", length) == 0) {
+    const char *const after = json_skip_value(value, end);
+    if (after != nullptr) {
+      line->id = value;
+      line->id_length = after - value;
+    }
+    return after;
+  }
+
+  if (length == 6 && memcmp(key, "prompt", length) == 0) {
+    if (*value != '"') {
+      return nullptr;
+    }
+    const char *const quote = json_scan_string(value, end);
+    if (quote != nullptr) {
+      // The prompt is still escaped, so it can be embedded as it is
+      line->prompt = value + 1;
+      line->prompt_length = quote - value - 1;
+      return quote + 1;
+    }
+    return nullptr;
+  }
+
+  return json_skip_value(value, end);
+}
+
+/**
+ * @brief Records why an item failed, escaped for the output
+ * @param item Item that failed
+ * @param message Reason of the failure
+ * @returns The status of the operation
+ */
+static size_t fail_item(batch_item_t *const item, const char *const message) {
+  buffer_clear(&item->error);
+  item->done = true;
+  return json_escape(&item->error, message, strlen(message));
+}
+
+/**
+ * @brief Writes the result of an item as a single JSONL line
+ * @param batch Batch owning the item
+ * @param item Finished item
+ * @returns The status of the operation
+ */
+static size_t emit_item(batch_t *const batch, batch_item_t *const item) {
+  buffer_t *const result = &batch->result;
+  buffer_clear(result);
+
+  curl_off_t ttfb = 0, total = 0;
+  if (item->transfer.curl != nullptr && item->error.length == 0 &&
+      !item->cached) {
+    curl_easy_getinfo(item->transfer.curl, CURLINFO_STARTTRANSFER_TIME_T,
+                      &ttfb);
+    curl_easy_getinfo(item->transfer.curl, CURLINFO_TOTAL_TIME_T, &total);
+  }
+
+  // Values are written out of the response still escaped
+  response_fields_t fields = {};
+  bool ok = false;
+  if (item->error.length == 0 && item->code == CURLE_OK) {
+    const bool parsed = response_parse(item->response.data,
+                                       item->response.length, &fields);
+    if (item->http_status < 400 && parsed && fields.content != nullptr) {
+      ok = true;
+    } else if (item->http_status < 400) {
+      fail_item(item, "Response holds no content");
+    } else if (fields.error == nullptr) {
+      char reason[64];
+      snprintf(reason, sizeof(reason), "HTTP status %ld", item->http_status);
+      fail_item(item, reason);
+    }
+  } else if (item->error.length == 0) {
+    fail_item(item, curl_easy_strerror(item->code));
+  }
+
+  const char *const id = item->id.length > 0 ? item->id.data : "null";
+  size_t status = buffer_printf(
+      result, "{\"index\":%zu,\"id\":%s,\"status\":\"%s\",\"http_status\":%ld,",
+      item->index, id, ok ? "ok" : "error", item->http_status);
+  if (item->upstream != nullptr) {
+    status |= buffer_printf(result, "\"key\":%zu,", item->upstream->index);
+  }
+  if (ok) {
+    status |= buffer_printf(result, "\"content\":\"%.*s\",",
+                            (int)fields.content_length, fields.content);
+  } else if (item->error.length > 0) {
+    status |= buffer_printf(result, "\"error\":\"%s\",", item->error.data);
+  } else {
+    status |= buffer_printf(result, "\"error\":\"%.*s\",",
+                            (int)fields.error_length, fields.error);
+  }
+  status |= buffer_printf(
+      result, "\"cached\":%s,\"queued_ms\":%lld,\"ttfb_ms\":%lld,\"total_ms\":%lld}\n",
+      item->cached ? "true" : "false", (long long)item->queued_ms,
+      (long long)(ttfb / USEC_PER_MSEC),
+      (long long)(total / USEC_PER_MSEC));
+
+  if (status == ERR_UNRECOVERABLE ||
+      fwrite(result->data, 1, result->length, stdout) != result->length) {
+    fprintf(stderr, "Could not write batch result\n");
+    return ERR_UNRECOVERABLE;
+  }
+
+  if (ok) {
+    batch->succeeded++;
+  } else {
+    batch->failed++;
+  }
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Writes every finished result that has no unfinished predecessor
+ * @param batch Batch owning the results
+ * @returns The status of the operation
+ */
+static size_t emit_ready(batch_t *const batch) {
+  bool written = false;
+  while (batch->next_emit < batch->next_index) {
+    batch_item_t *const item =
+        &batch->items[batch->next_emit % batch->window];
+    if (!item->done) {
+      break;
+    }
+    if (emit_item(batch, item) == ERR_UNRECOVERABLE) {
+      return ERR_UNRECOVERABLE;
+    }
+    batch->next_emit++;
+    written = true;
+  }
+
+  if (written) {
+    fflush(stdout);
+  }
+  return ERR_RECOVERABLE;
+}
+
+static void on_item_done(reactor_transfer_t *const transfer,
+                         const CURLcode code);
+static size_t dispatch_item(batch_t *const batch, batch_item_t *const item);
+static void on_resume_tick(void *const data);
+
+/**
+ * @brief Finds an earlier request with the same body as an item that has not
+ * finished yet, whether it is in flight, deferred by the rate limiter or
+ * about to be sent again
+ * @param batch Batch owning the items
+ * @param item Item about to be sent
+ * @returns The unfinished item, or null if there is none
+ */
+static const batch_item_t *find_leader(const batch_t *const batch,
+                                       const batch_item_t *const item) {
+  for (size_t i = batch->next_emit; i < item->index; i++) {
+    const batch_item_t *const other = &batch->items[i % batch->window];
+    if (!other->done && !other->waiting && other->key == item->key) {
+      return other;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * @brief Hands the response of a finished request to every item that waited
+ * for the same body
+ * @param batch Batch owning the items
+ * @param leader Item whose request finished
+ */
+static void share_response(batch_t *const batch,
+                           const batch_item_t *const leader) {
+  for (size_t i = batch->next_emit; i < batch->next_index; i++) {
+    batch_item_t *const item = &batch->items[i % batch->window];
+    if (!item->waiting || item->key != leader->key) {
+      continue;
+    }
+
+    item->waiting = false;
+    item->done = true;
+    item->http_status = leader->http_status;
+    item->code = leader->code;
+    buffer_clear(&item->response);
+    if (leader->response.length > 0 &&
+        buffer_append(&item->response, leader->response.data,
+                      leader->response.length) == ERR_UNRECOVERABLE) {
+      fail_item(item, "Shared response could not be copied");
+    }
+  }
+}
+
+/**
+ * @brief Prepares the request of an item from its input line and hands it to
+ * the reactor. Lines that cannot be parsed finish the item right away.
+ *
+ * @param batch Batch owning the item
+ * @param item Item to start
+ * @param text Input line
+ * @param length Length of the input line
+ * @returns The status of the operation
+ */
+static size_t start_item(batch_t *const batch, batch_item_t *const item,
+                         const char *const text, const size_t length) {
+  buffer_clear(&item->id);
+  buffer_clear(&item->body);
+  buffer_clear(&item->response);
+  buffer_clear(&item->error);
+  item->http_status = 0;
+  item->code = CURLE_OK;
+  item->queued_ms = 0;
+  item->key = 0;
+  item->upstream = nullptr;
+  item->attempts = 0;
+  item->resume_ms = 0;
+  item->cached = false;
+  item->waiting = false;
+  item->deferred = false;
+  item->locked = false;
+  item->done = false;
+
+  batch_line_t line = {};
+  if (json_object_each(text, text + length, on_line_member, &line) ==
+          nullptr ||
+      line.prompt == nullptr) {
+    return fail_item(item, "Line is not an object with a string prompt");
+  }
+
+  if (line.id != nullptr &&
+      buffer_append(&item->id, line.id, line.id_length) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+
+  const char *const open = ",{\"role\":\"user\",\"content\":\"";
+  const char *const close = "\"}]}";
+  if (buffer_append(&item->body, batch->header.data, batch->header.length) ==
+          ERR_UNRECOVERABLE ||
+      buffer_append(&item->body, open, strlen(open)) == ERR_UNRECOVERABLE ||
+      buffer_append(&item->body, line.prompt, line.prompt_length) ==
+          ERR_UNRECOVERABLE ||
+      buffer_append(&item->body, close, strlen(close)) == ERR_UNRECOVERABLE) {
+    fprintf(stderr, "Batch request body could not be built\n");
+    return ERR_UNRECOVERABLE;
+  }
+
+  if (batch->cache != nullptr) {
+    const struct iovec segment = {item->body.data, item->body.length};
+    item->key = cache_key(&segment, 1);
+    if (cache_get(batch->cache, item->key, &item->response)) {
+      item->cached = true;
+      item->http_status = 200;
+      item->done = true;
+      return ERR_RECOVERABLE;
+    }
+
+    // Identical prompts of the batch share a single request
+    if (find_leader(batch, item) != nullptr) {
+      item->cached = true;
+      item->waiting = true;
+      return ERR_RECOVERABLE;
+    }
+
+    // Never wait for other processes here, holding keys while waiting for
+    // more could deadlock two batches
+    item->locked = cache_lock(batch->cache, item->key, false);
+  }
+  return dispatch_item(batch, item);
+}
+
+/**
+ * @brief Holds an item back until a point in time, arming the ticker that
+ * resumes the deferred items if it would fire later
+ * @param batch Batch owning the item
+ * @param item Item to defer
+ * @param wait Milliseconds to wait
+ */
+static void defer_item(batch_t *const batch, batch_item_t *const item,
+                       int64_t wait) {
+  // A ticker armed with no interval would never fire
+  wait = wait > 0 ? wait : 1;
+  if (!item->deferred) {
+    item->deferred = true;
+    batch->deferred++;
+  }
+  const int64_t resume = now_ms() + wait;
+  if (batch->resume_ms == 0 || resume < batch->resume_ms) {
+    batch->resume_ms = resume;
+    // Transfers in flight keep the reactor running, the ticker resumes the
+    // deferred items in between
+    reactor_set_ticker(batch->reactor, (uint32_t)wait, on_resume_tick, batch);
+  }
+}
+
+/**
+ * @brief Hands the request of an item to the reactor, sent with the key of
+ * the pool that has the most headroom. While every key is exhausted the item
+ * is deferred until one has room again.
+ *
+ * @param batch Batch owning the item
+ * @param item Item whose body is built
+ * @returns The status of the operation
+ */
+static size_t dispatch_item(batch_t *const batch, batch_item_t *const item) {
+  int64_t wait = 0;
+  const double tokens =
+      completions_estimate_tokens(batch->config, item->body.length);
+  ratelimit_key_t *const key = ratelimit_pick(batch->pool, tokens, &wait);
+  if (key == nullptr) {
+    defer_item(batch, item, wait);
+    return ERR_RECOVERABLE;
+  }
+
+  if (item->deferred) {
+    item->deferred = false;
+    batch->deferred--;
+  }
+
+  if (item->transfer.curl == nullptr &&
+      (item->transfer.curl = completions_new_handle(batch->config)) ==
+          nullptr) {
+    ratelimit_finish(key, 0, 0);
+    return ERR_UNRECOVERABLE;
+  }
+
+  CURL *const curl = item->transfer.curl;
+  completions_use_key(curl, key);
+  item->upstream = key;
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDS, item->body.data);
+  curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE,
+                   (curl_off_t)item->body.length);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_item);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, item);
+
+  item->transfer.on_done = on_item_done;
+  item->transfer.data = batch;
+  item->queued_ms = now_ms() - batch->started_ms;
+  if (reactor_add(batch->reactor, &item->transfer) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+  batch->in_flight++;
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Reads further input lines while the in-flight limit and the window
+ * of pending results allow it
+ * @param batch Batch to refill
+ * @returns The status of the operation
+ */
+static size_t fill(batch_t *const batch) {
+  // Finished responses may have refilled the buckets before the ticker fires
+  if (batch->deferred > 0) {
+    reactor_set_ticker(batch->reactor, 0, nullptr, nullptr);
+    batch->resume_ms = 0;
+    for (size_t i = batch->next_emit;
+         i < batch->next_index && batch->in_flight < batch->parallel; i++) {
+      batch_item_t *const item = &batch->items[i % batch->window];
+      if (!item->deferred) {
+        continue;
+      }
+      // Items backing off after a failure wait for their own time
+      const int64_t wait = item->resume_ms - now_ms();
+      if (wait > 0) {
+        defer_item(batch, item, wait);
+        continue;
+      }
+      if (dispatch_item(batch, item) == ERR_UNRECOVERABLE) {
+        return ERR_UNRECOVERABLE;
+      }
+    }
+  }
+
+  // Deferred items take up their share of the in-flight limit
+  while (!batch->eof && batch->in_flight + batch->deferred < batch->parallel &&
+         batch->next_index - batch->next_emit < batch->window) {
+    const ssize_t read =
+        getline(&batch->line, &batch->line_capacity, batch->input);
+    if (read < 0) {
+      batch->eof = true;
+      break;
+    }
+
+    size_t length = read;
+    while (length > 0 && (batch->line[length - 1] == '\n' ||
+                          batch->line[length - 1] == '\r')) {
+      length--;
+    }
+    if (json_skip_space(batch->line, batch->line + length) ==
+        batch->line + length) {
+      continue;
+    }
+
+    batch_item_t *const item = &batch->items[batch->next_index % batch->window];
+    item->index = batch->next_index++;
+    if (start_item(batch, item, batch->line, length) == ERR_UNRECOVERABLE) {
+      return ERR_UNRECOVERABLE;
+    }
+  }
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Called by the reactor once the request of an item finished
+ * @param transfer Transfer of the item
+ * @param code Result of the transfer
+ */
+static void on_item_done(reactor_transfer_t *const transfer,
+                         const CURLcode code) {
+  batch_item_t *const item = (batch_item_t *)transfer;
+  batch_t *const batch = (batch_t *)transfer->data;
+  item->code = code;
+  curl_easy_getinfo(transfer->curl, CURLINFO_RESPONSE_CODE, &item->http_status);
+  curl_off_t retryAfter = 0;
+  curl_easy_getinfo(transfer->curl, CURLINFO_RETRY_AFTER, &retryAfter);
+  ratelimit_finish(item->upstream, item->http_status, retryAfter);
+  batch->in_flight--;
+
+  if (item->attempts < batch->config->retries &&
+      completions_is_retryable(code, item->http_status)) {
+    buffer_clear(&item->response);
+    size_t status = ERR_RECOVERABLE;
+    if (code == CURLE_OK && item->http_status == HTTP_TOO_MANY_REQUESTS) {
+      // A rejected key sits out, the item goes to another key of the pool
+      // or waits until one has room
+      status = dispatch_item(batch, item);
+    } else {
+      const int64_t delay = completions_retry_delay_ms(
+          batch->config, transfer->curl, item->attempts);
+      item->resume_ms = now_ms() + delay;
+      defer_item(batch, item, delay);
+    }
+    item->attempts++;
+    if (status == ERR_UNRECOVERABLE || fill(batch) == ERR_UNRECOVERABLE) {
+      batch->broken = true;
+    }
+    return;
+  }
+  item->done = true;
+
+  if (batch->cache != nullptr) {
+    if (code == CURLE_OK && item->http_status == 200) {
+      cache_put(batch->cache, item->key, item->response.data,
+                item->response.length);
+    }
+    if (item->locked) {
+      cache_unlock(batch->cache, item->key);
+      item->locked = false;
+    }
+    share_response(batch, item);
+  }
+
+  // Keep the reactor busy without returning to the caller
+  if (emit_ready(batch) == ERR_UNRECOVERABLE ||
+      fill(batch) == ERR_UNRECOVERABLE) {
+    batch->broken = true;
+  }
+}
+
+/**
+ * @brief Resumes the deferred items once a key has room again
+ * @param data Batch owning the items
+ */
+static void on_resume_tick(void *const data) {
+  batch_t *const batch = (batch_t *)data;
+  if (fill(batch) == ERR_UNRECOVERABLE) {
+    batch->broken = true;
+  }
+}
+
+size_t batch_run(const termchat_config_t *const config, const char *const path,
+                 const size_t parallel) {
+  size_t status = ERR_UNRECOVERABLE;
+  batch_t batch = {
+      .config = config,
+      .reactor = completions_reactor(),
+      .cache = completions_cache(config),
+      .parallel = parallel > 0 ? parallel : 1,
+      .started_ms = now_ms(),
+  };
+  batch.window = batch.parallel * BATCH_WINDOW_FACTOR;
+
+  const bool from_stdin = strcmp(path, BATCH_STDIN) == 0;
+  if ((batch.input = from_stdin ? stdin : fopen(path, "r")) == nullptr) {
+    fprintf(stderr, "Could not open batch file %s\n", path);
+    return ERR_UNRECOVERABLE;
+  }
+
+  if ((batch.items = calloc(batch.window, sizeof(batch_item_t))) == nullptr) {
+    fprintf(stderr, "Could not allocate memory for the batch\n");
+    goto cleanup;
+  }
+
+  if ((batch.pool = completions_pool(config)) == nullptr ||
+      completions_write_header(&batch.header, config) == ERR_UNRECOVERABLE) {
+    goto cleanup;
+  }
+
+  while (true) {
+    if (fill(&batch) == ERR_UNRECOVERABLE ||
+        emit_ready(&batch) == ERR_UNRECOVERABLE) {
+      goto cleanup;
+    }
+
+    if (batch.in_flight == 0) {
+      if (batch.eof && batch.next_emit == batch.next_index) {
+        break;
+      }
+      // Nothing is in flight while every key is exhausted
+      const int64_t wait = batch.resume_ms - now_ms();
+      if (batch.deferred > 0 && wait > 0) {
+        const struct timespec pause = {
+            .tv_sec = wait / 1000,
+            .tv_nsec = (wait % 1000) * 1000000,
+        };
+        nanosleep(&pause, nullptr);
+      }
+      continue;
+    }
+
+    // Finished transfers refill the reactor from their callbacks
+    if (reactor_run(batch.reactor) == ERR_UNRECOVERABLE || batch.broken) {
+      goto cleanup;
+    }
+  }
+
+  fprintf(stderr, "Batch finished: %zu ok, %zu failed in %lld ms\n",
+          batch.succeeded, batch.failed,
+          (long long)(now_ms() - batch.started_ms));
+  status = ERR_RECOVERABLE;
+
+cleanup:
+  if (batch.items != nullptr) {
+    for (size_t i = 0; i < batch.window; i++) {
+      batch_item_t *const item = &batch.items[i];
+      if (item->transfer.curl != nullptr) {
+        reactor_remove(batch.reactor, &item->transfer);
+        curl_easy_cleanup(item->transfer.curl);
+      }
+      if (item->locked) {
+        cache_unlock(batch.cache, item->key);
+      }
+      buffer_free(&item->id);
+      buffer_free(&item->body);
+      buffer_free(&item->response);
+      buffer_free(&item->error);
+    }
+    free(batch.items);
+  }
+  reactor_set_ticker(batch.reactor, 0, nullptr, nullptr);
+  buffer_free(&batch.header);
+  buffer_free(&batch.result);
+  free(batch.line);
+  if (!from_stdin && batch.input != nullptr) {
+    fclose(batch.input);
+  }
+  return status;
+}
@@ -0,0 +1,77 @@
+#include "buffer.h"
+#include "globdef.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+constexpr size_t BUFFER_MIN_CAPACITY = 256;
+
+size_t buffer_reserve(buffer_t *const buffer, const size_t capacity) {
+  if (capacity < buffer->capacity) {
+    return ERR_RECOVERABLE;
+  }
+
+  size_t next = buffer->capacity > 0 ? buffer->capacity : BUFFER_MIN_CAPACITY;
+  while (next <= capacity) {
+    next *= 2;
+  }
+
+  char *const data = realloc(buffer->data, next);
+  if (data == nullptr) {
+    fprintf(stderr, "Buffer could not grow to %zu bytes\n", next);
+    return ERR_UNRECOVERABLE;
+  }
+
+  buffer->data = data;
+  buffer->capacity = next;
+  return ERR_RECOVERABLE;
+}
+
+size_t buffer_append(buffer_t *const buffer, const void *const src,
+                     const size_t length) {
+  if (buffer_reserve(buffer, buffer->length + length) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+
+  if (length > 0) {
+    memcpy(&buffer->data[buffer->length], src, length);
+  }
+  buffer->length += length;
+  buffer->data[buffer->length] = '\0';
+  return ERR_RECOVERABLE;
+}
+
+size_t buffer_printf(buffer_t *const buffer, const char *const format, ...) {
+  va_list args;
+  va_start(args, format);
+  const int length = vsnprintf(nullptr, 0, format, args);
+  va_end(args);
+
+  if (length < 0) {
+    fprintf(stderr, "Formatted text could not be measured\n");
+    return ERR_UNRECOVERABLE;
+  }
+
+  if (buffer_reserve(buffer, buffer->length + length) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+
+  va_start(args, format);
+  vsnprintf(&buffer->data[buffer->length], length + 1, format, args);
+  va_end(args);
+  buffer->length += length;
+  return ERR_RECOVERABLE;
+}
+
+void buffer_clear(buffer_t *const buffer) {
+  buffer->length = 0;
+  if (buffer->data != nullptr) {
+    buffer->data[0] = '\0';
+  }
+}
+
+void buffer_free(buffer_t *const buffer) {
+  free(buffer->data);
+  *buffer = (buffer_t){};
+}
@@ -0,0 +1,338 @@
+#define _GNU_SOURCE
+#include "cache.h"
+#include "globdef.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+constexpr uint32_t CACHE_MAGIC = 0x54434348;
+constexpr uint32_t CACHE_VERSION = 1;
+constexpr size_t CACHE_SLOTS = 4096;
+// The index is recycled before probe sequences grow long
+constexpr size_t CACHE_MAX_ENTRIES = CACHE_SLOTS / 4 * 3;
+constexpr uint64_t CACHE_LOCK_RANGE = 1ULL << 30;
+constexpr uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+constexpr uint64_t FNV_PRIME = 0x100000001b3ULL;
+constexpr uint64_t BYTES_PER_MB = 1024 * 1024;
+
+typedef struct {
+  uint64_t key;
+  uint64_t offset;
+  uint64_t length;
+  int64_t created;
+} cache_entry_t;
+
+struct cache_index {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t data_length;
+  uint64_t count;
+  cache_entry_t entries[CACHE_SLOTS];
+};
+
+uint64_t cache_key(const struct iovec *const segments, const size_t count) {
+  uint64_t hash = FNV_OFFSET_BASIS;
+  for (size_t i = 0; i < count; i++) {
+    const unsigned char *const bytes = segments[i].iov_base;
+    for (size_t j = 0; j < segments[i].iov_len; j++) {
+      hash = (hash ^ bytes[j]) * FNV_PRIME;
+    }
+  }
+  // Zero marks an empty slot of the index
+  return hash != 0 ? hash : 1;
+}
+
+/**
+ * @brief Builds the path of a file inside the cache directory
+ * @param dest Destination of the path
+ * @param len Size of the destination
+ * @param name Name of the file, or null for the directory itself
+ * @returns The status of the operation
+ */
+static size_t get_cache_path(char *const dest, const size_t len,
+                             const char *const name) {
+  const char *const cache_dir = getenv("XDG_CACHE_HOME");
+  const char *const home_dir = getenv("HOME");
+  int written = -1;
+  if (cache_dir != nullptr) {
+    written = snprintf(dest, len, "%s/termchat%s%s", cache_dir,
+                       name ? "/" : "", name ? name : "");
+  } else if (home_dir != nullptr) {
+    written = snprintf(dest, len, "%s/.cache/termchat%s%s", home_dir,
+                       name ? "/" : "", name ? name : "");
+  }
+
+  if (written < 0 || (size_t)written >= len) {
+    fprintf(stderr, "Could not find cache directory\n");
+    return ERR_UNRECOVERABLE;
+  }
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Creates the cache directory and its parent when they are missing
+ * @returns The status of the operation
+ */
+static size_t make_cache_dir() {
+  char path[MAX_BUFF_SIZE];
+  if (get_cache_path(path, sizeof(path), nullptr) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+
+  char *const slash = strrchr(path, '/');
+  *slash = '\0';
+  mkdir(path, 0700);
+  *slash = '/';
+  if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+    fprintf(stderr, "Could not create cache directory %s\n", path);
+    return ERR_UNRECOVERABLE;
+  }
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Opens a file inside the cache directory
+ * @param name Name of the file
+ * @returns The descriptor, or -1 on failure
+ */
+static int open_cache_file(const char *const name) {
+  char path[MAX_BUFF_SIZE];
+  if (get_cache_path(path, sizeof(path), name) == ERR_UNRECOVERABLE) {
+    return -1;
+  }
+
+  const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open cache file %s\n", path);
+  }
+  return fd;
+}
+
+/**
+ * @brief Drops every entry and truncates the data file. The index must be
+ * locked exclusively.
+ * @param cache Cache to recycle
+ */
+static void recycle(cache_t *const cache) {
+  cache_index_t *const index = cache->index;
+  memset(index->entries, 0, sizeof(index->entries));
+  index->count = 0;
+  index->data_length = 0;
+  if (ftruncate(cache->data_fd, 0) != 0) {
+    fprintf(stderr, "Cache data could not be truncated\n");
+  }
+  index->version = CACHE_VERSION;
+  index->magic = CACHE_MAGIC;
+}
+
+size_t cache_open(cache_t *const cache, const int64_t ttl_s,
+                  const int64_t max_mb) {
+  *cache = (cache_t){
+      .index_fd = -1,
+      .data_fd = -1,
+      .lock_fd = -1,
+      .ttl_s = ttl_s,
+      .max_bytes = max_mb > 0 ? (uint64_t)max_mb * BYTES_PER_MB : 0,
+  };
+
+  if (make_cache_dir() == ERR_UNRECOVERABLE ||
+      (cache->index_fd = open_cache_file("index")) < 0 ||
+      (cache->data_fd = open_cache_file("data")) < 0 ||
+      (cache->lock_fd = open_cache_file("inflight")) < 0) {
+    goto failure;
+  }
+
+  flock(cache->index_fd, LOCK_EX);
+  struct stat st = {};
+  const bool sized = fstat(cache->index_fd, &st) == 0 &&
+                     st.st_size == (off_t)sizeof(cache_index_t);
+  if (!sized && ftruncate(cache->index_fd, sizeof(cache_index_t)) != 0) {
+    flock(cache->index_fd, LOCK_UN);
+    fprintf(stderr, "Cache index could not be sized\n");
+    goto failure;
+  }
+
+  void *const map = mmap(nullptr, sizeof(cache_index_t), PROT_READ | PROT_WRITE,
+                         MAP_SHARED, cache->index_fd, 0);
+  if (map == MAP_FAILED) {
+    flock(cache->index_fd, LOCK_UN);
+    fprintf(stderr, "Cache index could not be mapped\n");
+    goto failure;
+  }
+  cache->index = map;
+
+  if (cache->index->magic != CACHE_MAGIC ||
+      cache->index->version != CACHE_VERSION) {
+    recycle(cache);
+  }
+  flock(cache->index_fd, LOCK_UN);
+  return ERR_RECOVERABLE;
+
+failure:
+  cache_close(cache);
+  return ERR_UNRECOVERABLE;
+}
+
+void cache_close(cache_t *const cache) {
+  if (cache->index != nullptr) {
+    munmap(cache->index, sizeof(cache_index_t));
+    cache->index = nullptr;
+  }
+
+  const int fds[] = {cache->index_fd, cache->data_fd, cache->lock_fd};
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+  cache->index_fd = cache->data_fd = cache->lock_fd = -1;
+}
+
+/**
+ * @brief Finds the slot holding a key, or the empty slot it would go into
+ * @param index Index to search
+ * @param key Key to find
+ * @returns The slot, or null if the index is full
+ */
+static cache_entry_t *find_slot(cache_index_t *const index,
+                                const uint64_t key) {
+  for (size_t i = 0; i < CACHE_SLOTS; i++) {
+    cache_entry_t *const entry = &index->entries[(key + i) % CACHE_SLOTS];
+    if (entry->key == key || entry->key == 0) {
+      return entry;
+    }
+  }
+  return nullptr;
+}
+
+bool cache_get(cache_t *const cache, const uint64_t key,
+               buffer_t *const output) {
+  if (cache->index == nullptr) {
+    return false;
+  }
+
+  flock(cache->index_fd, LOCK_SH);
+  bool hit = false;
+  const cache_entry_t *const entry = find_slot(cache->index, key);
+  if (entry == nullptr || entry->key != key ||
+      entry->offset + entry->length > cache->index->data_length ||
+      time(nullptr) - entry->created > cache->ttl_s) {
+    goto cleanup;
+  }
+
+  buffer_clear(output);
+  if (buffer_reserve(output, entry->length) == ERR_UNRECOVERABLE) {
+    goto cleanup;
+  }
+
+  while (output->length < entry->length) {
+    const ssize_t read = pread(cache->data_fd, output->data + output->length,
+                               entry->length - output->length,
+                               entry->offset + output->length);
+    if (read <= 0) {
+      if (read < 0 && errno == EINTR) {
+        continue;
+      }
+      buffer_clear(output);
+      goto cleanup;
+    }
+    output->length += read;
+  }
+  output->data[output->length] = '\0';
+  hit = true;
+
+cleanup:
+  flock(cache->index_fd, LOCK_UN);
+  return hit;
+}
+
+size_t cache_put(cache_t *const cache, const uint64_t key,
+                 const char *const data, const size_t length) {
+  if (cache->index == nullptr || length > cache->max_bytes) {
+    return ERR_RECOVERABLE;
+  }
+
+  size_t status = ERR_RECOVERABLE;
+  flock(cache->index_fd, LOCK_EX);
+  cache_index_t *const index = cache->index;
+  if (index->data_length + length > cache->max_bytes ||
+      index->count >= CACHE_MAX_ENTRIES) {
+    recycle(cache);
+  }
+
+  size_t written = 0;
+  while (written < length) {
+    const ssize_t result = pwrite(cache->data_fd, data + written,
+                                  length - written,
+                                  index->data_length + written);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Response could not be written to the cache\n");
+      status = ERR_UNRECOVERABLE;
+      goto cleanup;
+    }
+    written += result;
+  }
+
+  cache_entry_t *const entry = find_slot(index, key);
+  if (entry == nullptr) {
+    goto cleanup;
+  }
+
+  // Readers only trust the entry once the data it points at is in place
+  index->count += entry->key == 0;
+  entry->offset = index->data_length;
+  entry->length = length;
+  entry->created = time(nullptr);
+  entry->key = key;
+  index->data_length += length;
+
+cleanup:
+  flock(cache->index_fd, LOCK_UN);
+  return status;
+}
+
+/**
+ * @brief Applies an open file description lock to the byte of a key
+ * @param cache Cache owning the lock file
+ * @param key Key to lock
+ * @param type Type of the lock
+ * @param command Locking command
+ * @returns True on success
+ */
+static bool lock_key(cache_t *const cache, const uint64_t key,
+                     const short type, const int command) {
+  if (cache->lock_fd < 0) {
+    return false;
+  }
+
+  struct flock lock = {
+      .l_type = type,
+      .l_whence = SEEK_SET,
+      .l_start = key % CACHE_LOCK_RANGE,
+      .l_len = 1,
+  };
+  while (fcntl(cache->lock_fd, command, &lock) != 0) {
+    if (errno != EINTR) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool cache_lock(cache_t *const cache, const uint64_t key, const bool wait) {
+  return lock_key(cache, key, F_WRLCK, wait ? F_OFD_SETLKW : F_OFD_SETLK);
+}
+
+void cache_unlock(cache_t *const cache, const uint64_t key) {
+  lock_key(cache, key, F_UNLCK, F_OFD_SETLK);
+}
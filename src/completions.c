@@ -1,117 +1,623 @@
+#define _GNU_SOURCE
 #include "completions.h"
+#include "cache.h"
+#include "config.h"
+#include "context.h"
+#include "escape.h"
 #include "globdef.h"
+#include "jsonscan.h"
+#include "ratelimit.h"
+#include "reactor.h"
+#include "request.h"
+#include "session.h"
+#include "sse.h"
+#include "tokenizer.h"
 #include <curl/curl.h>
 #include <curl/easy.h>
-#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-static constexpr uint8_t ENDPOINT_COMPLETIONS[] =
-    "https://api.openai.com/v1/chat/completions";
-static constexpr uint8_t MAX_CONTEXT_ARRAY_SIZE = 255;
-static char context[MAX_CONTEXT_ARRAY_SIZE][MAX_BUFF_SIZE];
-static uint16_t context_size = 0;
-static size_t s_buff = 0;
-static volatile bool g_request_pending = false;
+static constexpr char STREAM_DONE[] = "[DONE]";
+static constexpr uint32_t SPINNER_INTERVAL_MS = 1000;
+static constexpr char BODY_SUFFIX[] = "]}";
+static constexpr char BODY_STREAM_SUFFIX[] =
+    "],\"stream\":true,\"stream_options\":{\"include_usage\":true}}";
+// Every message is framed by a few tokens, and the reply by a few more
+static constexpr size_t TOKENS_PER_MESSAGE = 4;
+static constexpr size_t TOKENS_PER_REPLY = 3;
+// Used when no ranks file is available
+static constexpr size_t BYTES_PER_TOKEN = 4;
+static constexpr char RESOURCE_PREFIX[] = "Resource:";
+static constexpr size_t RESOURCE_ELIDE_BYTES = 512;
+static constexpr char ELIDED_RESOURCE[] =
+    ",{\"role\":\"developer\",\"content\":\"Resource: (output elided)\"}";
+static constexpr size_t ELIDED_RESOURCE_TOKENS = 6;
+static context_t g_context = {};
+static buffer_t g_body_prefix = {};
+static request_body_t g_body = {};
+// Compressed copy of the body and the single segment uploading it
+static buffer_t g_gzip = {};
+static request_body_t g_gzip_body = {};
+static size_t g_response_hint = 0;
+static constexpr long KEEPALIVE_IDLE_SECS = 30;
+static constexpr long KEEPALIVE_INTERVAL_SECS = 15;
+// Servers commonly drop idle connections after about a minute
+static constexpr int PREWARM_INTERVAL_MS = 25000;
+// Warm-ups in a row without any input before warming stops until the next
+// prompt
+static constexpr int PREWARM_MAX_IDLE = 4;
+static constexpr int64_t RETRY_MAX_MS = 30000;
+static constexpr int64_t RETRY_AFTER_MAX_MS = 120000;
+static constexpr long HTTP_TOO_MANY_REQUESTS = 429;
+static constexpr long HTTP_UNSUPPORTED_MEDIA_TYPE = 415;
+// First-byte times the hedge deadline is taken from, and how many must be
+// known before they are trusted over `hedge_min_ms`
+static constexpr size_t TTFB_SAMPLES = 64;
+static constexpr size_t TTFB_MIN_SAMPLES = 8;
+static bool g_response_started = false;
+static bool g_connection_reused = false;
+static reactor_t g_reactor;
+static CURLSH *g_share = nullptr;
+static CURL *g_curl = nullptr;
+static CURL *g_warm = nullptr;
+static bool g_input_ready = false;
+// Input consumed while requests run, such as keystrokes typed ahead
+static int g_watch_fd = -1;
+static completion_input_cb_t g_watch_cb = nullptr;
+static void *g_watch_data = nullptr;
+static cache_t g_cache = {.index_fd = -1, .data_fd = -1, .lock_fd = -1};
+static ratelimit_pool_t g_pool = {};
+static bool g_cache_failed = false;
+static bool g_cache_hit = false;
+static session_t g_session = {.fd = -1};
+static tokenizer_t g_tokenizer = {};
+static bool g_tokenizer_tried = false;
+static completion_usage_t g_usage = {};
+static completion_usage_t g_usage_total = {};
+static size_t g_window_start = 0;
+static completion_stats_t g_stats = {};
+// Fields of the last response received by `get_prompt_response`
+static response_fields_t g_response = {};
+static int64_t g_first_byte_us = 0;
 
-typedef struct {
-  CURL *curl;
+typedef size_t (*write_cb_t)(void *const ptr, size_t size, size_t nmemb,
+                            void *const output);
+typedef void (*reset_cb_t)(void *const output);
+
+typedef struct request_info request_info_t;
+
+struct request_info {
+  reactor_transfer_t transfer;
   CURLcode code;
-} request_info_t;
+  write_cb_t writer;
+  void *data;
+  request_info_t *other;
+};
 
 typedef struct {
-  size_t length;
-  char string[MAX_BUFF_SIZE];
-} string_t;
+  request_info_t *primary;
+  request_info_t *hedge;
+  const request_body_t *upload;
+  request_body_t body;
+} hedge_state_t;
 
-/**
- * @brief Creates a string on the stack containing length and the pointer
- * @param srcDest Result where the string will be saved
- * @param string String input to create
- */
-static void create_string(string_t *const srcDest, const char *const string) {
-  const size_t length = strlen(string);
-  memcpy(srcDest->string, string, length);
-  srcDest->string[length] = '\0';
-  srcDest->length = length;
-}
+static request_info_t *g_winner = nullptr;
+static int64_t g_ttfb_samples[TTFB_SAMPLES] = {};
+static size_t g_ttfb_count = 0;
+
+typedef struct {
+  size_t bytes;
+  size_t tokens;
+} window_cost_t;
+
+// State of the conversation before the message of the pending turn
+typedef struct {
+  size_t messages;
+  size_t window_start;
+  session_t session;
+  bool pending;
+} turn_mark_t;
+
+static turn_mark_t g_turn = {};
+
+typedef struct {
+  sse_parser_t parser;
+  completion_delta_cb_t on_delta;
+  void *data;
+  buffer_t *output;
+  // Unescaped content of the event being rendered
+  buffer_t fragment;
+  // Body of a reply that is not a stream, such as an error
+  buffer_t raw;
+  bool done;
+  // Whether the endpoint reported an error instead of an answer
+  bool failed;
+} stream_state_t;
+
+// The buffers of the parser keep their storage between streamed turns
+static stream_state_t g_stream = {};
 
 /**
- * @brief Gets the correct role string based on the type
- * @param role Numeric representation of the role type
- * @param dest Where the string will be stored
+ * @brief Writes the start of a request body: the model, the token limit and
+ * the opening of the `messages` array holding the instruction
+ * @param dest Buffer the header is appended to
+ * @param config Configuration holding the model and the instruction
  * @returns The status of the operation
  */
-static size_t get_role_type(const role_type_t role, char *const dest) {
-  string_t string = {};
-  switch (role) {
-  default:
+size_t completions_write_header(buffer_t *const dest,
+                                const termchat_config_t *const config) {
+  if (buffer_printf(dest, "{\"model\":\"%s\",", config->model) ==
+      ERR_UNRECOVERABLE) {
+    fprintf(stderr, "Request header could not be built\n");
+    return ERR_UNRECOVERABLE;
+  }
+
+  if (config->max_tokens > 0 &&
+      buffer_printf(dest, "\"max_completion_tokens\":%lld,",
+                    (long long)config->max_tokens) == ERR_UNRECOVERABLE) {
+    fprintf(stderr, "Request header could not be built\n");
+    return ERR_UNRECOVERABLE;
+  }
+
+  if (buffer_printf(dest,
+                    "\"messages\":[{\"role\":\"%s\",\"content\":\"%s\"}",
+                    config->role, config->instruction) == ERR_UNRECOVERABLE) {
+    fprintf(stderr, "Request header could not be built\n");
     return ERR_UNRECOVERABLE;
-  case role_type_user:
-    create_string(&string, "user");
-    break;
-  case role_type_assistant:
-    create_string(&string, "assistant");
-    break;
-  case role_type_developer:
-    create_string(&string, "developer");
   }
-  memcpy(dest, string.string, string.length);
   return ERR_RECOVERABLE;
 }
 
 /**
- * @brief Get the entire chat context from the current session
- * @param dest Pointer where the context will be saved to
+ * @brief Loads the ranks file of the model the first time tokens are counted.
+ * Without the `tokenizer` key the file is looked up as
+ * `$XDG_DATA_HOME/termchat/<encoding>.tiktoken`.
+ *
+ * @param config Configuration naming the model
+ * @returns The tokenizer, or null if no ranks file could be loaded
+ */
+static const tokenizer_t *get_tokenizer(const termchat_config_t *const config) {
+  if (!g_tokenizer_tried) {
+    g_tokenizer_tried = true;
+    char path[MAX_BUFF_SIZE];
+    const char *const data_dir = getenv("XDG_DATA_HOME");
+    const char *const home_dir = getenv("HOME");
+    const char *const encoding = tokenizer_encoding(config->model);
+    if (config->tokenizer != nullptr) {
+      snprintf(path, sizeof(path), "%s", config->tokenizer);
+    } else if (data_dir != nullptr) {
+      snprintf(path, sizeof(path), "%s/termchat/%s.tiktoken", data_dir,
+               encoding);
+    } else if (home_dir != nullptr) {
+      snprintf(path, sizeof(path), "%s/.local/share/termchat/%s.tiktoken",
+               home_dir, encoding);
+    } else {
+      return nullptr;
+    }
+    tokenizer_load(&g_tokenizer, path, encoding);
+  }
+  return g_tokenizer.count > 0 ? &g_tokenizer : nullptr;
+}
+
+/**
+ * @brief Counts the tokens of the instruction once
+ * @param config Configuration holding the instruction
+ * @param tokenizer Loaded tokenizer, or null to estimate from the length
+ * @returns The amount of tokens
+ */
+static size_t instruction_tokens(const termchat_config_t *const config,
+                                 const tokenizer_t *const tokenizer) {
+  const size_t length = strlen(config->instruction);
+  if (tokenizer == nullptr) {
+    return length / BYTES_PER_TOKEN;
+  }
+
+  static size_t instructionTokens = CONTEXT_TOKENS_UNKNOWN;
+  if (instructionTokens == CONTEXT_TOKENS_UNKNOWN) {
+    // The instruction keeps its JSON escapes inside the configuration
+    buffer_t instruction = {};
+    if (buffer_reserve(&instruction, length) == ERR_UNRECOVERABLE) {
+      return length / BYTES_PER_TOKEN;
+    }
+    instruction.length =
+        json_unescape(instruction.data, config->instruction, length);
+    instructionTokens =
+        tokenizer_count(tokenizer, instruction.data, instruction.length);
+    buffer_free(&instruction);
+  }
+  return instructionTokens;
+}
+
+/**
+ * @brief Gets the size a message adds to the request, caching its token
+ * count
+ * @param tokenizer Loaded tokenizer, or null to estimate from the length
+ * @param index Index of the message
+ * @param elided Whether the message is replaced by a placeholder
+ * @returns The bytes and tokens of the message
+ */
+static window_cost_t message_cost(const tokenizer_t *const tokenizer,
+                                  const size_t index, const bool elided) {
+  context_message_t *const message = &g_context.messages[index];
+  if (elided) {
+    return (window_cost_t){
+        .bytes = sizeof(ELIDED_RESOURCE) - 1,
+        .tokens = TOKENS_PER_MESSAGE + ELIDED_RESOURCE_TOKENS,
+    };
+  }
+
+  if (tokenizer == nullptr) {
+    return (window_cost_t){
+        .bytes = message->json_length,
+        .tokens = TOKENS_PER_MESSAGE + message->length / BYTES_PER_TOKEN,
+    };
+  }
+
+  if (message->tokens == CONTEXT_TOKENS_UNKNOWN) {
+    message->tokens = tokenizer_count(
+        tokenizer, context_content(&g_context, index), message->length);
+  }
+  return (window_cost_t){
+      .bytes = message->json_length,
+      .tokens = TOKENS_PER_MESSAGE + message->tokens,
+  };
+}
+
+/**
+ * @brief Whether a request of the given size fits the configured budget
+ * @param config Configuration holding the budget
+ * @param cost Size of the request
+ * @returns True if neither limit is exceeded
+ */
+static bool window_fits(const termchat_config_t *const config,
+                        const window_cost_t cost) {
+  return (config->context_max_bytes <= 0 ||
+          cost.bytes <= (size_t)config->context_max_bytes) &&
+         (config->context_max_tokens <= 0 ||
+          cost.tokens <= (size_t)config->context_max_tokens);
+}
+
+/**
+ * @brief Slides the window of messages sent with each request until the
+ * request fits the budget. Oversized command outputs outside the most recent
+ * turns are elided first, then the oldest turns are dropped. The most recent
+ * turns are always kept, even if they alone exceed the budget.
+ *
+ * @param config Configuration holding the budget
+ * @param fixedBytes Bytes of the request outside the messages
+ */
+static void slide_window(const termchat_config_t *const config,
+                         const size_t fixedBytes) {
+  if (config->context_max_bytes <= 0 && config->context_max_tokens <= 0) {
+    return;
+  }
+
+  const tokenizer_t *const tokenizer =
+      config->context_max_tokens > 0 ? get_tokenizer(config) : nullptr;
+  window_cost_t total = {
+      .bytes = fixedBytes,
+      .tokens = TOKENS_PER_REPLY + TOKENS_PER_MESSAGE +
+                instruction_tokens(config, tokenizer),
+  };
+  for (size_t i = g_window_start; i < g_context.count; i++) {
+    const window_cost_t cost =
+        message_cost(tokenizer, i, g_context.messages[i].elided);
+    total.bytes += cost.bytes;
+    total.tokens += cost.tokens;
+  }
+  if (window_fits(config, total)) {
+    return;
+  }
+
+  // The window may never start after the most recent turns, and always
+  // holds the pending message
+  const int64_t keepTurns =
+      config->context_keep_turns > 0 ? config->context_keep_turns : 1;
+  size_t protectedStart = g_context.count;
+  for (int64_t turns = 0;
+       protectedStart > g_window_start && turns < keepTurns;) {
+    protectedStart--;
+    turns += g_context.messages[protectedStart].role == role_type_user;
+  }
+
+  for (size_t i = g_window_start;
+       i < protectedStart && !window_fits(config, total); i++) {
+    context_message_t *const message = &g_context.messages[i];
+    const char *const content = context_content(&g_context, i);
+    if (message->elided || message->role != role_type_developer ||
+        message->length <= RESOURCE_ELIDE_BYTES ||
+        strncmp(content, RESOURCE_PREFIX, sizeof(RESOURCE_PREFIX) - 1) != 0) {
+      continue;
+    }
+
+    const window_cost_t full = message_cost(tokenizer, i, false);
+    const window_cost_t elided = message_cost(tokenizer, i, true);
+    total.bytes -= full.bytes - elided.bytes;
+    total.tokens -= full.tokens - elided.tokens;
+    message->elided = true;
+  }
+
+  while (g_window_start < protectedStart && !window_fits(config, total)) {
+    // Whole turns are dropped, so the window always opens with a user message
+    do {
+      const window_cost_t cost = message_cost(
+          tokenizer, g_window_start, g_context.messages[g_window_start].elided);
+      total.bytes -= cost.bytes;
+      total.tokens -= cost.tokens;
+      g_window_start++;
+    } while (g_window_start < protectedStart &&
+             g_context.messages[g_window_start].role != role_type_user);
+  }
+}
+
+/**
+ * @brief Adds the messages of the window to the request body. Neighbouring
+ * messages are uploaded as one segment straight from the serialized history.
  * @returns The status of the operation
  */
-static size_t get_context(uint8_t *const dest) {
-  size_t start = 0;
-  for (uint16_t i = 0; i < context_size; i++) {
-    char userContext[MAX_BUFF_SIZE];
-    if (snprintf(userContext, MAX_BUFF_SIZE, "%s", context[i]) < 0) {
-      fprintf(stderr, "Failed to copy context into local array\n");
-      return ERR_UNRECOVERABLE;
+static size_t add_window() {
+  size_t runStart = 0, runEnd = 0;
+  for (size_t i = g_window_start; i <= g_context.count; i++) {
+    const context_message_t *const message =
+        i < g_context.count ? &g_context.messages[i] : nullptr;
+    if (message != nullptr && !message->elided &&
+        (runEnd == runStart || message->json_offset == runEnd)) {
+      runStart = runEnd == runStart ? message->json_offset : runStart;
+      runEnd = message->json_offset + message->json_length;
+      continue;
     }
 
-    char temp[MAX_BUFF_SIZE + 1];
-    if (snprintf(temp, MAX_BUFF_SIZE + 1, "%s,", userContext) < 0) {
-      fprintf(stderr, "User context could not be written into temp variable\n");
+    if (runEnd > runStart &&
+        request_body_add(&g_body, g_context.json.data + runStart,
+                         runEnd - runStart) == ERR_UNRECOVERABLE) {
       return ERR_UNRECOVERABLE;
     }
+    runStart = runEnd = 0;
 
-    const size_t contextLength = strlen(context[i]) + 1;
-    if (contextLength >= MAX_BUFF_SIZE) {
-      fprintf(stderr, "Context was bigger than maximum allowed\n");
-      return ERR_UNRECOVERABLE;
+    if (message == nullptr) {
+      break;
     }
+    if (message->elided) {
+      if (request_body_add(&g_body, ELIDED_RESOURCE,
+                           sizeof(ELIDED_RESOURCE) - 1) == ERR_UNRECOVERABLE) {
+        return ERR_UNRECOVERABLE;
+      }
+    } else {
+      runStart = message->json_offset;
+      runEnd = message->json_offset + message->json_length;
+    }
+  }
+  return ERR_RECOVERABLE;
+}
 
-    memcpy(&dest[start], temp, contextLength);
-    start += contextLength;
+/**
+ * @brief Lays out the request body as a list of segments. Only the short
+ * header holding the model and the instruction is formatted per turn; the
+ * messages are uploaded straight from the serialized history of the context.
+ *
+ * @param config Configuration holding the model and the instruction
+ * @param stream Whether the response should be sent as server-sent events
+ * @returns The status of the operation
+ */
+static size_t build_body(const termchat_config_t *const config,
+                         const bool stream) {
+  buffer_clear(&g_body_prefix);
+  if (completions_write_header(&g_body_prefix, config) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+
+  const char *const suffix = stream ? BODY_STREAM_SUFFIX : BODY_SUFFIX;
+  slide_window(config, g_body_prefix.length + strlen(suffix));
+
+  request_body_reset(&g_body);
+  if (request_body_add(&g_body, g_body_prefix.data, g_body_prefix.length) ==
+          ERR_UNRECOVERABLE ||
+      add_window() == ERR_UNRECOVERABLE ||
+      request_body_add(&g_body, suffix, strlen(suffix)) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
   }
-  dest[start - 1] = '\0';
   return ERR_RECOVERABLE;
 }
 
+/**
+ * @brief Reads the monotonic clock
+ * @returns Microseconds since an arbitrary point in the past
+ */
+static int64_t now_us() {
+  struct timespec now = {};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * @brief Splits the cumulative timings of the last transfer into the phases
+ * of the request
+ * @param curl Handle of the finished transfer
+ * @param started Moment the transfer was handed to the reactor
+ */
+static void read_transfer_stats(CURL *const curl, const int64_t started) {
+  curl_off_t lookup = 0, connect = 0, tls = 0, start = 0, total = 0,
+             uploaded = 0, downloaded = 0;
+  curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &lookup);
+  curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+  curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+  curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+  // Older libcurl versions stamp the start of the transfer when a POST body
+  // starts uploading, so the first byte of the body is timed here instead
+  start = g_first_byte_us > 0 ? g_first_byte_us - started : total;
+  curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &uploaded);
+  curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &downloaded);
+
+  // Plain HTTP and reused connections skip the handshake, which leaves its
+  // timestamp at zero
+  const curl_off_t connected = tls > connect ? tls : connect;
+  g_stats.dns_us = lookup;
+  g_stats.connect_us = connect > lookup ? connect - lookup : 0;
+  g_stats.tls_us = tls > connect ? tls - connect : 0;
+  g_stats.wait_us = start > connected ? start - connected : 0;
+  g_stats.transfer_us = total > start ? total - start : 0;
+  g_stats.upload_bytes = uploaded;
+  g_stats.download_bytes = downloaded;
+}
+
 /**
  * @brief Callback function that writes the response from the HTTP request into
- * the output pointer
+ * the growable output buffer. The first chunk reserves the announced
+ * Content-Length so that a large response is not grown step by step.
  *
  * @param ptr
  * @param size
  * @param nmemb
- * @param ouput Buffer to save the http context to
+ * @param ouput Buffer the body is written to
  */
 static size_t write_func(void *const ptr, size_t size, size_t nmemb,
                          void *const output) {
   const size_t totalSize = size * nmemb;
-  char *outputPtr = (char *)output;
-  memcpy(&outputPtr[s_buff], ptr, s_buff + totalSize);
-  s_buff += totalSize;
+  buffer_t *const body = (buffer_t *)output;
+  if (g_first_byte_us == 0) {
+    g_first_byte_us = now_us();
+  }
+
+  if (body->length == 0) {
+    curl_off_t contentLength = -1;
+    curl_easy_getinfo(g_winner->transfer.curl,
+                      CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &contentLength);
+    if (contentLength > 0 &&
+        buffer_reserve(body, contentLength) == ERR_UNRECOVERABLE) {
+      return 0;
+    }
+  }
+
+  if (buffer_append(body, ptr, totalSize) == ERR_UNRECOVERABLE) {
+    return 0;
+  }
   return totalSize;
 }
 
+/**
+ * @brief Reads the fields of a response in a single pass, recording the
+ * token usage it reports
+ * @param response Body of the response, or a single streamed event
+ * @param length Length of the response
+ * @param fields Receives the fields of the response
+ * @returns True if the response is well-formed
+ */
+static bool read_response(const char *const response, const size_t length,
+                          response_fields_t *const fields) {
+  if (!response_parse(response, length, fields)) {
+    return false;
+  }
+  if (fields->usage.reported) {
+    g_usage = fields->usage;
+  }
+  return true;
+}
+
+/**
+ * @brief Handles a single server-sent event of a streamed completion. Every
+ * event carries a `choices[].delta.content` fragment which is unescaped,
+ * rendered right away and appended to the assembled message.
+ *
+ * @param data Payload of the event
+ * @param length Length of the payload
+ * @param user State of the stream being received
+ */
+static void on_stream_event(const char *const data, const size_t length,
+                            void *const user) {
+  stream_state_t *const state = (stream_state_t *)user;
+  if (state->done) {
+    return;
+  }
+
+  if (length == sizeof(STREAM_DONE) - 1 &&
+      memcmp(data, STREAM_DONE, length) == 0) {
+    state->done = true;
+    return;
+  }
+
+  response_fields_t fields;
+  if (!read_response(data, length, &fields)) {
+    return;
+  }
+  if (fields.error != nullptr) {
+    fprintf(stderr, "The API answered with an error: %.*s\n",
+            (int)fields.error_length, fields.error);
+    state->failed = true;
+    return;
+  }
+  // Role announcements and usage reports carry no content
+  if (fields.content_length == 0) {
+    return;
+  }
+
+  if (buffer_reserve(&state->fragment, fields.content_length) ==
+      ERR_UNRECOVERABLE) {
+    return;
+  }
+  char *const fragment = state->fragment.data;
+  const size_t fragmentLength =
+      json_unescape(fragment, fields.content, fields.content_length);
+  if (fragmentLength == 0) {
+    return;
+  }
+
+  if (!g_response_started) {
+    g_response_started = true;
+    printf("\n");
+  }
+  const int64_t started = now_us();
+  state->on_delta(fragment, fragmentLength, state->data);
+  g_stats.render_us += now_us() - started;
+
+  if (buffer_append(state->output, fragment, fragmentLength) ==
+      ERR_UNRECOVERABLE) {
+    fprintf(stderr, "Streamed fragment could not be kept\n");
+  }
+}
+
+/**
+ * @brief Callback function that feeds the streamed HTTP response into the SSE
+ * parser as it arrives
+ *
+ * @param ptr
+ * @param size
+ * @param nmemb
+ * @param state State of the stream being received
+ */
+static size_t write_stream_func(void *const ptr, size_t size, size_t nmemb,
+                                void *const state) {
+  const size_t totalSize = size * nmemb;
+  stream_state_t *const stream = (stream_state_t *)state;
+  const int64_t started = now_us();
+  const int64_t rendered = g_stats.render_us;
+  if (g_first_byte_us == 0) {
+    g_first_byte_us = started;
+  }
+
+  // Failed requests are answered with a plain JSON body instead of events
+  long httpStatus = 0;
+  curl_easy_getinfo(g_winner->transfer.curl, CURLINFO_RESPONSE_CODE,
+                    &httpStatus);
+  if (httpStatus >= 400) {
+    return buffer_append(&stream->raw, ptr, totalSize) == ERR_UNRECOVERABLE
+               ? 0
+               : totalSize;
+  }
+
+  const size_t status =
+      sse_feed(&stream->parser, (const char *)ptr, totalSize);
+  // Fragments are rendered from inside the parser and counted on their own
+  g_stats.parse_us += now_us() - started - (g_stats.render_us - rendered);
+  return status == ERR_UNRECOVERABLE ? 0 : totalSize;
+}
+
 /**
  * @brief Adds context based on the provided input.
  * @param input The input string to process.
@@ -119,213 +625,1118 @@ static size_t write_func(void *const ptr, size_t size, size_t nmemb,
  * @return A static constant integer representing the result of the operation.
  */
 size_t add_context(const char *const input, role_type_t role_type) {
-  if (context_size >= MAX_CONTEXT_ARRAY_SIZE) {
-    fprintf(stderr, "Context window limit has been exceeded\n");
+  const size_t length = strlen(input);
+  if (context_push(&g_context, role_type, input, length) ==
+      ERR_UNRECOVERABLE) {
+    fprintf(stderr, "Input could not be added to context\n");
     return ERR_UNRECOVERABLE;
   }
+  // An answer completes the turn, it may no longer be discarded
+  g_turn.pending = g_turn.pending && role_type != role_type_assistant;
+  return session_append(&g_session, role_type, input, length);
+}
 
-  char role[MAX_BUFF_SIZE] = {};
-  if (get_role_type(role_type, role) == ERR_UNRECOVERABLE) {
-    fprintf(stderr, "Role failed to resolve\n");
-    return ERR_UNRECOVERABLE;
-  }
+/**
+ * @brief Adds a message replayed from the session log to the context
+ * @param role Role of the message
+ * @param content Content of the message
+ * @param length Length of the content
+ * @param data Unused
+ * @returns The status of the operation
+ */
+static size_t on_session_message(const role_type_t role,
+                                 const char *const content,
+                                 const size_t length, void *const) {
+  return context_push(&g_context, role, content, length);
+}
 
-  char temp[MAX_BUFF_SIZE] = {};
-  const char template[] = "{\"role\":\"%s\",\"content\":\"%s\"}";
-  if (snprintf(temp, MAX_BUFF_SIZE, template, role, input) < 0) {
-    fprintf(stderr, "Input could not be added to context\n");
+/**
+ * @brief Opens a named session, restoring its messages into the context.
+ * Every message added afterwards is appended to its log.
+ * @param name Name of the session
+ * @param restored Receives the amount of restored messages
+ * @returns The status of the operation
+ */
+size_t completions_open_session(const char *const name,
+                                size_t *const restored) {
+  if (session_open(&g_session, name, on_session_message, nullptr) ==
+      ERR_UNRECOVERABLE) {
     return ERR_UNRECOVERABLE;
   }
-
-  memcpy(context[context_size], temp, MAX_BUFF_SIZE);
-  context[context_size++][MAX_BUFF_SIZE - 1] = '\0';
+  *restored = g_session.count;
   return ERR_RECOVERABLE;
 }
 
 /**
- * @brief Get the timestamp of the current date
- * @returns The timestamp in seconds, or -1 on error
+ * @brief Starts a new conversation. The messages of the context and the
+ * session total are dropped and the open session is closed, while the
+ * connection, the cache and the key pool stay.
  */
-static ssize_t date_now() { return (unsigned long)time(nullptr); }
+void completions_reset_context() {
+  g_turn.pending = false;
+  session_close(&g_session);
+  context_free(&g_context);
+  g_window_start = 0;
+  g_usage_total = (completion_usage_t){};
+}
 
 /**
- * @brief Thread that will take care of processing the Rest API request
- * @param src The arguments of the function
+ * @brief Drops the message of a turn that got no answer from the context and
+ * the session log, so the next turn does not follow another user message
+ * @returns The status of the operation
  */
-static void *on_request_processing(void *src) {
-  request_info_t *info = (request_info_t *)src;
-  if ((info->code = curl_easy_perform(info->curl)) != CURLE_OK) {
-    fprintf(stderr, "Request failed from another thread\n");
+size_t completions_discard_turn() {
+  if (!g_turn.pending) {
+    return ERR_RECOVERABLE;
   }
-  g_request_pending = false;
-  return nullptr;
+  g_turn.pending = false;
+  context_truncate(&g_context, g_turn.messages);
+  g_window_start = g_turn.window_start;
+  return session_rewind(&g_session, &g_turn.session);
 }
 
 /**
- * @brief Makes a call to the OpenAI completions API and receives the response
- * of the LLM. The ouput is saved to the argument of the same name and contains
- * the raw text context of the reply.
- *
- * @param api_key OpenAI generated api key
- * @param model GPT model to use
- * @param role Role of the LLM: 'system' | 'user' | 'developer' | 'tool' |
- * 'assistant'
- * @param instruction instruction on what the LLM should do
- * @param input user input
- * @param output output buffer to be written to
- * @param outputSize size of the buffer
- * @return Whether the function was successful
+ * @brief Called by the reactor once the request finished
+ * @param transfer Transfer of the request
+ * @param code Result of the request
  */
-size_t get_prompt_response(const char *const api_key, const char *const model,
-                           const char *const role,
-                           const char *const instruction,
-                           const char *const input, char *const output) {
-  uint8_t status = ERR_RECOVERABLE;
-  struct curl_slist *pHeaders = nullptr;
-  CURL *pCurl = nullptr;
+static void on_request_done(reactor_transfer_t *const transfer,
+                            const CURLcode code) {
+  request_info_t *const info = (request_info_t *)transfer;
+  info->code = code;
+  // The attempt that answered first wins, the other one is cancelled
+  if (info == g_winner && info->other != nullptr) {
+    reactor_remove(&g_reactor, &info->other->transfer);
+  }
 
-  if ((pCurl = curl_easy_init()) == nullptr) {
-    fprintf(stderr, "Could not initialize libcurl\n");
-    status = ERR_UNRECOVERABLE;
-    goto cleanup;
+  const bool lost = g_winner != nullptr && g_winner != info;
+  if (code != CURLE_OK && !lost) {
+    fprintf(stderr, "Request failed: %s\n", curl_easy_strerror(code));
   }
+}
 
-  if (add_context(input, true) == ERR_UNRECOVERABLE) {
-    fprintf(stderr, "Could not add context to window\n");
-    status = ERR_UNRECOVERABLE;
-    goto cleanup;
+/**
+ * @brief Hands the body of an attempt to the writer of the request. The first
+ * attempt that receives bytes wins, the bytes of any other attempt abort it.
+ * @param ptr Received bytes
+ * @param size Size of a single element
+ * @param nmemb Amount of elements
+ * @param data Attempt receiving the bytes
+ * @returns The amount of bytes consumed
+ */
+static size_t write_attempt(void *const ptr, size_t size, size_t nmemb,
+                            void *const data) {
+  request_info_t *const info = (request_info_t *)data;
+  if (g_winner == nullptr) {
+    g_winner = info;
+  }
+  if (g_winner != info) {
+    return 0;
   }
+  return info->writer(ptr, size, nmemb, info->data);
+}
 
-  uint8_t chat_ctx[MAX_USR_SIZE];
-  if (get_context(chat_ctx) == ERR_UNRECOVERABLE) {
-    fprintf(stderr, "Error reading entire chat context\n");
-    status = ERR_UNRECOVERABLE;
-    goto cleanup;
+/**
+ * @brief Prints a dot every tick until the first bytes of the response were
+ * rendered
+ * @param data Unused
+ */
+static void on_spinner_tick(void *const) {
+  if (g_response_started) {
+    return;
+  }
+  printf(".");
+  if (fflush(stdout) != 0) {
+    fprintf(stderr, "Failed to write unwritten bytes to stdout\n");
   }
+}
+
+/**
+ * @brief Attaches a handle to the shared caches and enables HTTP/2 and TCP
+ * keep-alive on it
+ * @param curl Handle to configure
+ */
+static void apply_defaults(CURL *const curl) {
+  curl_easy_setopt(curl, CURLOPT_SHARE, g_share);
+  curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPIDLE, KEEPALIVE_IDLE_SECS);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPINTVL, KEEPALIVE_INTERVAL_SECS);
+  // An empty list advertises every encoding libcurl can decode
+  curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+}
 
-  curl_easy_setopt(pCurl, CURLOPT_URL, ENDPOINT_COMPLETIONS);
+/**
+ * @brief Points a handle at the configured endpoint and applies the timeouts
+ * @param curl Handle to configure
+ * @param config Configuration holding the endpoint and the timeouts
+ */
+static void apply_endpoint(CURL *const curl,
+                           const termchat_config_t *const config) {
+  curl_easy_setopt(curl, CURLOPT_URL, config->endpoint);
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS,
+                   (long)config->connect_timeout_ms);
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)config->timeout_ms);
+}
 
-  pHeaders = curl_slist_append(pHeaders, "Content-Type: application/json");
-  if (pHeaders == nullptr) {
-    fprintf(stderr, "Content-Type was not set correctly\n");
-    status = ERR_UNRECOVERABLE;
-    goto cleanup;
+/**
+ * @brief Creates an additional handle sharing the caches of the session, for
+ * transfers running next to each other on the reactor
+ * @param config Configuration holding the endpoint and the timeouts
+ * @returns The new handle, or null on failure
+ */
+CURL *completions_new_handle(const termchat_config_t *const config) {
+  CURL *const curl = curl_easy_init();
+  if (curl == nullptr) {
+    fprintf(stderr, "Could not initialize libcurl\n");
+    return nullptr;
   }
 
+  apply_defaults(curl);
+  apply_endpoint(curl, config);
+  // Prefer multiplexing over an existing HTTP/2 connection to opening more
+  curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+  return curl;
+}
+
+/**
+ * @brief Builds the headers every completions request sent with a key carries
+ * @param api_key Key sent in the authorization header
+ * @param gzip Whether the body is announced as gzip compressed
+ * @returns The list of headers, or null on failure
+ */
+static struct curl_slist *build_headers(const char *const api_key,
+                                        const bool gzip) {
   char authorization[MAX_BUFF_SIZE];
   if (snprintf(authorization, sizeof(authorization), "Authorization: Bearer %s",
                api_key) < 0) {
     fprintf(stderr, "API Key could not be added to authorization header\n");
-    status = ERR_UNRECOVERABLE;
-    goto cleanup;
+    return nullptr;
   }
 
-  pHeaders = curl_slist_append(pHeaders, authorization);
-  if (pHeaders == nullptr) {
-    fprintf(stderr, "Could not add authorization header to http request\n");
-    status = ERR_UNRECOVERABLE;
-    goto cleanup;
+  struct curl_slist *headers = nullptr;
+  const char *const lines[] = {
+      "Content-Type: application/json",
+      // Large bodies would otherwise wait for a 100-continue round trip
+      "Expect:",
+      authorization,
+      "Content-Encoding: gzip",
+  };
+  const size_t count = sizeof(lines) / sizeof(lines[0]) - (gzip ? 0 : 1);
+  for (size_t i = 0; i < count; i++) {
+    struct curl_slist *const next = curl_slist_append(headers, lines[i]);
+    if (next == nullptr) {
+      fprintf(stderr, "Could not add header to http request\n");
+      curl_slist_free_all(headers);
+      return nullptr;
+    }
+    headers = next;
   }
+  return headers;
+}
 
-  CURLcode curlStatus = CURLE_OK;
-  if ((curlStatus = curl_easy_setopt(pCurl, CURLOPT_HTTPHEADER, pHeaders)) !=
-      CURLE_OK) {
-    fprintf(stderr, "Could not set HTTP Header\n");
-    status = ERR_UNRECOVERABLE;
-    goto cleanup;
+/**
+ * @brief Sets up the pool of keys the first time a request is sent, with the
+ * headers of every key built once
+ * @param config Configuration holding the keys and their endpoints
+ * @returns The pool, or null on failure
+ */
+ratelimit_pool_t *completions_pool(const termchat_config_t *const config) {
+  if (g_pool.keys != nullptr) {
+    return &g_pool;
   }
 
-  if ((curlStatus = curl_easy_setopt(pCurl, CURLOPT_WRITEFUNCTION,
-                                     write_func)) != CURLE_OK) {
-    fprintf(stderr, "Could not set function callback\n");
-    status = ERR_UNRECOVERABLE;
-    goto cleanup;
+  if (ratelimit_open(&g_pool, config) == ERR_UNRECOVERABLE) {
+    return nullptr;
   }
+  for (size_t i = 0; i < g_pool.count; i++) {
+    ratelimit_key_t *const key = &g_pool.keys[i];
+    if ((key->headers = build_headers(key->api_key, false)) == nullptr ||
+        (config->compress &&
+         (key->gzip_headers = build_headers(key->api_key, true)) ==
+             nullptr)) {
+      ratelimit_close(&g_pool);
+      return nullptr;
+    }
+  }
+  return &g_pool;
+}
 
-  if ((curlStatus = curl_easy_setopt(pCurl, CURLOPT_WRITEDATA, output)) !=
-      CURLE_OK) {
-    fprintf(stderr, "Could not set write buffer to write data to\n");
-    status = ERR_UNRECOVERABLE;
-    goto cleanup;
+/**
+ * @brief Estimates the tokens a request counts against the rate limit of its
+ * key: the prompt and the completion it may generate
+ * @param config Configuration holding the token limit of the completion
+ * @param body_length Length of the request body
+ * @returns The estimated tokens
+ */
+double completions_estimate_tokens(const termchat_config_t *const config,
+                                   const size_t body_length) {
+  return (double)(body_length / BYTES_PER_TOKEN) +
+         (double)(config->max_tokens > 0 ? config->max_tokens : 0);
+}
+
+/**
+ * @brief Takes a key out of the pool for a request, waiting while every key
+ * is exhausted
+ * @param pool Pool to take from
+ * @param tokens Estimated tokens of the request
+ * @returns The key
+ */
+static ratelimit_key_t *acquire_key(ratelimit_pool_t *const pool,
+                                    const double tokens) {
+  int64_t wait = 0;
+  ratelimit_key_t *key = nullptr;
+  while ((key = ratelimit_pick(pool, tokens, &wait)) == nullptr) {
+    fprintf(stderr, "Rate limit reached on every key, waiting %.1f s\n",
+            wait / 1e3);
+    const struct timespec pause = {
+        .tv_sec = wait / 1000,
+        .tv_nsec = (wait % 1000) * 1000000,
+    };
+    nanosleep(&pause, nullptr);
   }
+  return key;
+}
 
-  char data[MAX_BUFF_SIZE] = {};
-  if (snprintf(data, MAX_BUFF_SIZE,
-               "{ \"model\": \"%s\", \"messages\": [{ \"role\": \"%s\", "
-               "\"content\": \"%s\" }, %s] }",
-               model, role, instruction, chat_ctx) < 0) {
-    fprintf(stderr, "Data buffer could not be built correctly\n");
+/**
+ * @brief Points a handle at a key of the pool, with the rate-limit headers of
+ * its responses read into the buckets of the key
+ * @param curl Handle to configure
+ * @param key Key the request is sent with
+ */
+void completions_use_key(CURL *const curl, ratelimit_key_t *const key) {
+  curl_easy_setopt(curl, CURLOPT_URL, key->endpoint);
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, key->headers);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, ratelimit_header_cb);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, key);
+}
+
+/**
+ * @brief Opens the response cache the first time it is needed
+ * @param config Configuration enabling the cache
+ * @returns The cache, or null if it is disabled or could not be opened
+ */
+cache_t *completions_cache(const termchat_config_t *const config) {
+  if (!config->cache || g_cache_failed) {
+    return nullptr;
+  }
+
+  if (g_cache.index == nullptr &&
+      cache_open(&g_cache, config->cache_ttl_s, config->cache_max_mb) ==
+          ERR_UNRECOVERABLE) {
+    // Requests still work without the cache
+    fprintf(stderr, "Response cache is disabled for this session\n");
+    g_cache_failed = true;
+    return nullptr;
+  }
+  return &g_cache;
+}
+
+/**
+ * @brief Gets the reactor driving every transfer of the session
+ * @returns The reactor
+ */
+reactor_t *completions_reactor() { return &g_reactor; }
+
+/**
+ * @brief Prepares the long-lived client of the session. The reactor keeps the
+ * connection pool alive between turns while the share object caches DNS
+ * lookups, TLS sessions and connections, so only the first turn pays for the
+ * handshake.
+ *
+ * @returns The status of the operation
+ */
+size_t completions_init() {
+  if (curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+    fprintf(stderr, "Could not initialize libcurl\n");
+    return ERR_UNRECOVERABLE;
+  }
+
+  // Seeds the jitter of the retry delays, concurrent sessions must not retry
+  // in lockstep
+  srand((unsigned)(now_us() ^ getpid()));
+
+  if ((g_share = curl_share_init()) == nullptr) {
+    fprintf(stderr, "Could not initialize libcurl share handle\n");
+    goto failure;
+  }
+
+  curl_share_setopt(g_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(g_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  curl_share_setopt(g_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+  if ((g_curl = curl_easy_init()) == nullptr) {
+    fprintf(stderr, "Could not initialize libcurl\n");
+    goto failure;
+  }
+
+  apply_defaults(g_curl);
+  curl_easy_setopt(g_curl, CURLOPT_POST, 1L);
+  curl_easy_setopt(g_curl, CURLOPT_READFUNCTION, request_body_read);
+  curl_easy_setopt(g_curl, CURLOPT_READDATA, &g_body);
+  curl_easy_setopt(g_curl, CURLOPT_SEEKFUNCTION, request_body_seek);
+  curl_easy_setopt(g_curl, CURLOPT_SEEKDATA, &g_body);
+
+  if (reactor_init(&g_reactor) == ERR_UNRECOVERABLE) {
+    fprintf(stderr, "Failed to create the request reactor\n");
+    goto failure;
+  }
+  return ERR_RECOVERABLE;
+
+failure:
+  completions_cleanup();
+  return ERR_UNRECOVERABLE;
+}
+
+/**
+ * @brief Releases the long-lived client of the session
+ */
+void completions_cleanup() {
+  if (g_curl != nullptr) {
+    curl_easy_cleanup(g_curl);
+    g_curl = nullptr;
+  }
+  if (g_warm != nullptr) {
+    curl_easy_cleanup(g_warm);
+    g_warm = nullptr;
+  }
+
+  reactor_cleanup(&g_reactor);
+
+  if (g_share != nullptr) {
+    curl_share_cleanup(g_share);
+    g_share = nullptr;
+  }
+  curl_global_cleanup();
+  context_free(&g_context);
+  buffer_free(&g_body_prefix);
+  request_body_free(&g_body);
+  buffer_free(&g_gzip);
+  request_body_free(&g_gzip_body);
+  cache_close(&g_cache);
+  ratelimit_close(&g_pool);
+  session_close(&g_session);
+  tokenizer_free(&g_tokenizer);
+  sse_free(&g_stream.parser);
+  buffer_free(&g_stream.fragment);
+  buffer_free(&g_stream.raw);
+}
+
+/**
+ * @brief Adds the usage of the last turn to the session total
+ */
+static void account_usage() {
+  if (!g_usage.reported) {
+    return;
+  }
+  g_usage_total.prompt_tokens += g_usage.prompt_tokens;
+  g_usage_total.completion_tokens += g_usage.completion_tokens;
+  g_usage_total.cached_tokens += g_usage.cached_tokens;
+  g_usage_total.reported = true;
+}
+
+/**
+ * @brief Gets the token usage the API reported for the last turn
+ * @returns The usage, not reported if the answer came from the cache
+ */
+const completion_usage_t *completions_usage() { return &g_usage; }
+
+/**
+ * @brief Gets the fields of the last response `get_prompt_response` received
+ * @returns The fields, pointing into the output buffer of that call
+ */
+const response_fields_t *completions_response() { return &g_response; }
+
+/**
+ * @brief Gets the token usage of every turn of the session
+ * @returns The summed usage
+ */
+const completion_usage_t *completions_usage_total() { return &g_usage_total; }
+
+/**
+ * @brief Counts the tokens of the messages inside the window, which are the
+ * ones the last request held. The count of every stored message is cached,
+ * so only new messages are tokenized.
+ *
+ * @param config Configuration holding the instruction
+ * @returns The amount of tokens, or CONTEXT_TOKENS_UNKNOWN without a ranks
+ * file
+ */
+size_t completions_count_tokens(const termchat_config_t *const config) {
+  const tokenizer_t *const tokenizer = get_tokenizer(config);
+  if (tokenizer == nullptr) {
+    return CONTEXT_TOKENS_UNKNOWN;
+  }
+
+  size_t tokens = TOKENS_PER_REPLY + TOKENS_PER_MESSAGE +
+                  instruction_tokens(config, tokenizer);
+  for (size_t i = g_window_start; i < g_context.count; i++) {
+    tokens += message_cost(tokenizer, i, g_context.messages[i].elided).tokens;
+  }
+  return tokens;
+}
+
+/**
+ * @brief Hands input arriving while a request runs to the watcher
+ * @param fd Descriptor that became readable
+ * @param data Unused
+ */
+static void on_watched_input(const int fd, void *const) {
+  g_watch_cb(fd, g_watch_data);
+}
+
+/**
+ * @brief Consumes input of a descriptor whenever it arrives while a request
+ * runs or the connection is warmed up
+ * @param fd Descriptor to watch, -1 stops watching
+ * @param on_input Callback consuming the input
+ * @param data Pointer handed to the callback
+ */
+void completions_watch_input(const int fd, const completion_input_cb_t on_input,
+                             void *const data) {
+  g_watch_fd = fd;
+  g_watch_cb = on_input;
+  g_watch_data = data;
+  if (fd < 0) {
+    reactor_watch_input(&g_reactor, -1, nullptr, nullptr);
+  }
+}
+
+/**
+ * @brief Stops warming the connection once the user entered a prompt. A
+ * handshake that is still running is abandoned, the prompt then opens its own
+ * connection like it would have without the warm-up.
+ * @param fd Descriptor that became readable
+ * @param data Transfer warming the connection
+ */
+static void on_warm_input(const int fd, void *const data) {
+  // A watcher decides when the prompt is complete, the connection stays
+  // warm while it is being typed
+  if (fd == g_watch_fd && !g_watch_cb(fd, g_watch_data)) {
+    return;
+  }
+  g_input_ready = true;
+  reactor_watch_input(&g_reactor, -1, nullptr, nullptr);
+  reactor_remove(&g_reactor, (reactor_transfer_t *)data);
+}
+
+/**
+ * @brief Waits until a terminal has input, or until the watcher of the
+ * descriptor reports a complete prompt. A body-less request to the
+ * endpoint resolves its name and completes the TCP and TLS handshakes in the
+ * meantime, leaving the connection in the shared pool for the prompt. It is
+ * repeated while the user stays idle so the server does not close it, up to
+ * `PREWARM_MAX_IDLE` times without any input in between.
+ *
+ * @param config Configuration naming the endpoint
+ * @param fd Descriptor the next prompt is read from
+ * @returns The status of the operation
+ */
+size_t completions_await_input(const termchat_config_t *const config,
+                               const int fd) {
+  // Terminals hand out one line per read, so no typed line can be waiting
+  // inside the buffer of stdio while the descriptor looks idle. A listening
+  // socket is never read through stdio at all.
+  struct stat st = {};
+  const bool listening = fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+  if (!config->prewarm || (!isatty(fd) && !listening)) {
+    return ERR_RECOVERABLE;
+  }
+
+  if (g_warm == nullptr) {
+    if ((g_warm = curl_easy_init()) == nullptr) {
+      return ERR_RECOVERABLE;
+    }
+    apply_defaults(g_warm);
+    apply_endpoint(g_warm, config);
+    curl_easy_setopt(g_warm, CURLOPT_NOBODY, 1L);
+  }
+
+  g_input_ready = false;
+  reactor_transfer_t transfer = {.curl = g_warm};
+  int idle = 0;
+  while (!g_input_ready && idle < PREWARM_MAX_IDLE) {
+    transfer = (reactor_transfer_t){.curl = g_warm};
+    if (reactor_add(&g_reactor, &transfer) == ERR_UNRECOVERABLE ||
+        reactor_watch_input(&g_reactor, fd, on_warm_input, &transfer) ==
+            ERR_UNRECOVERABLE) {
+      reactor_remove(&g_reactor, &transfer);
+      return ERR_UNRECOVERABLE;
+    }
+
+    // Failures are left for the prompt to report
+    const size_t status = reactor_run(&g_reactor);
+    reactor_watch_input(&g_reactor, -1, nullptr, nullptr);
+    reactor_remove(&g_reactor, &transfer);
+    if (status == ERR_UNRECOVERABLE) {
+      return ERR_UNRECOVERABLE;
+    }
+
+    // Keystrokes in between do not postpone the next warm-up, but they do
+    // count as activity
+    const int64_t rewarm = now_us() + PREWARM_INTERVAL_MS * 1000;
+    struct pollfd input = {.fd = fd, .events = POLLIN};
+    idle++;
+    while (!g_input_ready) {
+      const int64_t left = (rewarm - now_us()) / 1000;
+      const int ready = left > 0 ? poll(&input, 1, (int)left) : 0;
+      if (ready == 0) {
+        break;
+      }
+      if (ready < 0) {
+        if (errno != EINTR) {
+          fprintf(stderr, "Failed to wait for the next prompt\n");
+          return ERR_UNRECOVERABLE;
+        }
+        continue;
+      }
+      idle = 0;
+      on_warm_input(fd, &transfer);
+    }
+  }
+
+  // A terminal left alone stops connecting, the prompt then opens its own
+  // connection
+  struct pollfd input = {.fd = fd, .events = POLLIN};
+  while (!g_input_ready) {
+    const int ready = poll(&input, 1, -1);
+    if (ready < 0 && errno != EINTR) {
+      fprintf(stderr, "Failed to wait for the next prompt\n");
+      return ERR_UNRECOVERABLE;
+    }
+    if (ready > 0) {
+      on_warm_input(fd, &transfer);
+    }
+  }
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Whether the last request was sent over an already open connection
+ * @returns True if no new connection had to be established
+ */
+bool completions_connection_reused() { return g_connection_reused; }
+
+/**
+ * @brief Gets the time every phase of the last request took
+ * @returns The phases of the request
+ */
+const completion_stats_t *completions_stats() { return &g_stats; }
+
+/**
+ * @brief Compares two first-byte times for sorting
+ * @param a First time
+ * @param b Second time
+ * @returns Negative, zero or positive like `strcmp`
+ */
+static int compare_samples(const void *const a, const void *const b) {
+  const int64_t left = *(const int64_t *)a, right = *(const int64_t *)b;
+  return (left > right) - (left < right);
+}
+
+/**
+ * @brief Gets how long a request may wait for its first byte before a
+ * duplicate is sent
+ * @param config Configuration holding the percentile and its lower bound
+ * @returns The deadline in milliseconds, 0 if hedging is disabled
+ */
+static int64_t hedge_deadline_ms(const termchat_config_t *const config) {
+  if (config->hedge_percentile <= 0) {
+    return 0;
+  }
+
+  const int64_t floor = config->hedge_min_ms > 0 ? config->hedge_min_ms : 1;
+  const size_t count =
+      g_ttfb_count < TTFB_SAMPLES ? g_ttfb_count : TTFB_SAMPLES;
+  if (count < TTFB_MIN_SAMPLES) {
+    return floor;
+  }
+
+  int64_t sorted[TTFB_SAMPLES];
+  memcpy(sorted, g_ttfb_samples, count * sizeof(sorted[0]));
+  qsort(sorted, count, sizeof(sorted[0]), compare_samples);
+  const double percentile =
+      config->hedge_percentile < 100 ? config->hedge_percentile : 100;
+  size_t rank = (size_t)(percentile / 100.0 * count + 0.999999);
+  rank = rank == 0 ? 1 : (rank > count ? count : rank);
+  const int64_t deadline = sorted[rank - 1] / 1000;
+  return deadline > floor ? deadline : floor;
+}
+
+/**
+ * @brief Sends a duplicate of the request once it waited too long for its
+ * first byte, then keeps showing the spinner
+ * @param data State of the hedge
+ */
+static void on_hedge_tick(void *const data) {
+  hedge_state_t *const hedge = (hedge_state_t *)data;
+  reactor_set_ticker(&g_reactor, SPINNER_INTERVAL_MS, on_spinner_tick,
+                     nullptr);
+  on_spinner_tick(nullptr);
+  if (g_winner != nullptr || !hedge->primary->transfer.active) {
+    return;
+  }
+
+  CURL *const curl = curl_easy_duphandle(hedge->primary->transfer.curl);
+  if (curl == nullptr) {
+    return;
+  }
+
+  // The duplicate uploads the same segments with a cursor of its own, over
+  // a connection of its own in case the first one is stuck
+  hedge->body = *hedge->upload;
+  request_body_seek(&hedge->body, 0, SEEK_SET);
+  curl_easy_setopt(curl, CURLOPT_READDATA, &hedge->body);
+  curl_easy_setopt(curl, CURLOPT_SEEKDATA, &hedge->body);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, hedge->hedge);
+  curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1L);
+
+  *hedge->hedge = (request_info_t){
+      .transfer = {.curl = curl, .on_done = on_request_done},
+      .code = CURLE_OK,
+      .writer = hedge->primary->writer,
+      .data = hedge->primary->data,
+      .other = hedge->primary,
+  };
+  hedge->primary->other = hedge->hedge;
+  if (reactor_add(&g_reactor, &hedge->hedge->transfer) == ERR_UNRECOVERABLE) {
+    curl_easy_cleanup(curl);
+    hedge->hedge->transfer.curl = nullptr;
+    hedge->primary->other = nullptr;
+    return;
+  }
+  g_stats.hedged = true;
+}
+
+bool completions_is_retryable(const CURLcode code, const long httpStatus) {
+  switch (code) {
+  case CURLE_OK:
+    return httpStatus == HTTP_TOO_MANY_REQUESTS || httpStatus >= 500;
+  case CURLE_COULDNT_RESOLVE_HOST:
+  case CURLE_COULDNT_CONNECT:
+  case CURLE_OPERATION_TIMEDOUT:
+  case CURLE_SSL_CONNECT_ERROR:
+  case CURLE_SEND_ERROR:
+  case CURLE_RECV_ERROR:
+  case CURLE_GOT_NOTHING:
+  case CURLE_PARTIAL_FILE:
+  case CURLE_HTTP2:
+  case CURLE_HTTP2_STREAM:
+    return true;
+  default:
+    return false;
+  }
+}
+
+int64_t completions_retry_delay_ms(const termchat_config_t *const config,
+                                   CURL *const curl, const int64_t attempt) {
+  curl_off_t retryAfter = 0;
+  curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retryAfter);
+  if (retryAfter > 0) {
+    return retryAfter * 1000 < RETRY_AFTER_MAX_MS ? retryAfter * 1000
+                                                  : RETRY_AFTER_MAX_MS;
+  }
+
+  int64_t delay = config->retry_base_ms > 0 ? config->retry_base_ms : 1;
+  for (int64_t i = 0; i < attempt && delay < RETRY_MAX_MS; i++) {
+    delay *= 2;
+  }
+  delay = delay < RETRY_MAX_MS ? delay : RETRY_MAX_MS;
+  return delay / 2 + rand() % (delay / 2 + 1);
+}
+
+/**
+ * @brief Sends the chat context to the OpenAI completions API and waits until
+ * the whole response was received, showing a spinner in the meantime and
+ * retrying failed attempts. With `hedge_percentile` set, an attempt that
+ * waited too long for its first byte is raced against a duplicate.
+ *
+ * @param config Configuration of the session
+ * @param input user input
+ * @param stream Whether the response should be sent as server-sent events
+ * @param writer Callback receiving the body of the response
+ * @param reset Callback discarding what the writer received before a retry
+ * @param writeData Pointer handed to the callbacks
+ * @param cached Buffer the writer fills, served from and stored into the
+ * response cache. Null for responses that must not be cached.
+ * @return Whether the function was successful
+ */
+static size_t send_request(const termchat_config_t *const config,
+                           const char *const input, const bool stream,
+                           write_cb_t writer, reset_cb_t reset,
+                           void *const writeData, buffer_t *const cached) {
+  uint8_t status = ERR_RECOVERABLE;
+  CURL *const pCurl = g_curl;
+  cache_t *const cache = cached != nullptr ? completions_cache(config) : nullptr;
+  uint64_t cacheKey = 0;
+  bool cacheLocked = false;
+  g_cache_hit = false;
+  g_usage = (completion_usage_t){};
+  g_stats = (completion_stats_t){};
+
+  if (pCurl == nullptr) {
+    fprintf(stderr, "Client was not initialized\n");
+    return ERR_UNRECOVERABLE;
+  }
+
+  g_turn = (turn_mark_t){
+      .messages = g_context.count,
+      .window_start = g_window_start,
+      .session = g_session,
+      .pending = true,
+  };
+  if (add_context(input, role_type_user) == ERR_UNRECOVERABLE) {
+    fprintf(stderr, "Could not add context to window\n");
     status = ERR_UNRECOVERABLE;
     goto cleanup;
   }
 
-  if ((curlStatus = curl_easy_setopt(pCurl, CURLOPT_POSTFIELDS, data)) !=
-      CURLE_OK) {
-    fprintf(stderr, "Failed to add json data to the request\n");
+  apply_endpoint(pCurl, config);
+
+  ratelimit_pool_t *const pool = completions_pool(config);
+  if (pool == nullptr) {
     status = ERR_UNRECOVERABLE;
     goto cleanup;
   }
 
-  g_request_pending = true;
-  request_info_t info = {
-      .code = status,
-      .curl = pCurl,
-  };
-  pthread_t thread;
-  if (pthread_create(&thread, nullptr, on_request_processing, &info) != 0) {
-    fprintf(stderr, "Failed to create new thread\n");
+  CURLcode curlStatus = CURLE_OK;
+  if ((curlStatus = curl_easy_setopt(pCurl, CURLOPT_WRITEFUNCTION,
+                                     write_attempt)) != CURLE_OK) {
+    fprintf(stderr, "Could not set function callback\n");
     status = ERR_UNRECOVERABLE;
     goto cleanup;
   }
 
-  ssize_t timestamp = date_now();
-  if (timestamp < 0) {
-    fprintf(stderr, "Timestamp could not be fetched outside while\n");
+  const int64_t buildStarted = now_us();
+  if (build_body(config, stream) == ERR_UNRECOVERABLE) {
+    fprintf(stderr, "Data buffer could not be built correctly\n");
     status = ERR_UNRECOVERABLE;
     goto cleanup;
   }
+  g_stats.build_us = now_us() - buildStarted;
 
-  while (g_request_pending) {
-    const ssize_t currentTime = date_now();
-    if (currentTime < 0) {
-      fprintf(stderr, "Timestamp failed while request was pending\n");
-      status = ERR_UNRECOVERABLE;
+  if (cache != nullptr) {
+    cacheKey = cache_key(g_body.segments, g_body.count);
+    if ((g_cache_hit = cache_get(cache, cacheKey, cached))) {
+      // No connection was used, the hit is reported on its own
+      g_connection_reused = false;
+      g_stats.cached = true;
       goto cleanup;
     }
 
-    if (currentTime >= timestamp) {
-      printf(".");
-      if (fflush(stdout) != 0) {
-        fprintf(stderr, "Failed to write unwritten bytes to stdout\n");
+    // Another process sending the same body fills the cache for this one
+    cacheLocked = cache_lock(cache, cacheKey, true);
+    if ((g_cache_hit = cache_get(cache, cacheKey, cached))) {
+      g_connection_reused = false;
+      g_stats.cached = true;
+      goto cleanup;
+    }
+  }
+
+  bool compressed = false;
+  for (int64_t attempt = 0;; attempt++) {
+    request_info_t info = {
+        .transfer = {.curl = pCurl, .on_done = on_request_done},
+        .code = CURLE_OK,
+        .writer = writer,
+        .data = writeData,
+    };
+    request_info_t hedgeInfo = {};
+    curl_easy_setopt(pCurl, CURLOPT_WRITEDATA, &info);
+
+    // Every attempt goes to the key with the most headroom at that moment
+    ratelimit_key_t *const key =
+        acquire_key(pool, completions_estimate_tokens(config, g_body.total));
+    completions_use_key(pCurl, key);
+
+    // Small bodies are sent as they are, compressing them would not pay off
+    const bool gzip = key->gzip_headers != nullptr && !key->gzip_rejected &&
+                      g_body.total >= (size_t)config->compress_min_bytes;
+    if (gzip && !compressed) {
+      const int64_t compressStarted = now_us();
+      request_body_reset(&g_gzip_body);
+      if (request_body_gzip(&g_body, &g_gzip) == ERR_UNRECOVERABLE ||
+          request_body_add(&g_gzip_body, g_gzip.data, g_gzip.length) ==
+              ERR_UNRECOVERABLE) {
+        ratelimit_finish(key, 0, 0);
         status = ERR_UNRECOVERABLE;
         goto cleanup;
       }
-      timestamp = currentTime + 1;
+      g_stats.build_us += now_us() - compressStarted;
+      compressed = true;
+    }
+
+    request_body_t *const upload = gzip ? &g_gzip_body : &g_body;
+    request_body_seek(upload, 0, SEEK_SET);
+    curl_easy_setopt(pCurl, CURLOPT_READDATA, upload);
+    curl_easy_setopt(pCurl, CURLOPT_SEEKDATA, upload);
+    curl_easy_setopt(pCurl, CURLOPT_POSTFIELDSIZE_LARGE,
+                     (curl_off_t)upload->total);
+    if (gzip) {
+      curl_easy_setopt(pCurl, CURLOPT_HTTPHEADER, key->gzip_headers);
+    }
+    g_stats.compressed = gzip;
+    hedge_state_t hedge = {
+        .primary = &info,
+        .hedge = &hedgeInfo,
+        .upload = upload,
+    };
+
+    g_response_started = false;
+    g_first_byte_us = 0;
+    g_winner = nullptr;
+    g_usage = (completion_usage_t){};
+    const int64_t transferStarted = now_us();
+    if (reactor_add(&g_reactor, &info.transfer) == ERR_UNRECOVERABLE) {
+      status = ERR_UNRECOVERABLE;
+      goto cleanup;
+    }
+
+    on_spinner_tick(nullptr);
+    const int64_t hedgeDeadline = hedge_deadline_ms(config);
+    if (hedgeDeadline > 0) {
+      reactor_set_ticker(&g_reactor, hedgeDeadline, on_hedge_tick, &hedge);
+    } else {
+      reactor_set_ticker(&g_reactor, SPINNER_INTERVAL_MS, on_spinner_tick,
+                         nullptr);
+    }
+    if (g_watch_fd >= 0) {
+      reactor_watch_input(&g_reactor, g_watch_fd, on_watched_input, nullptr);
+    }
+    const size_t runStatus = reactor_run(&g_reactor);
+    reactor_watch_input(&g_reactor, -1, nullptr, nullptr);
+    reactor_set_ticker(&g_reactor, 0, nullptr, nullptr);
+    reactor_remove(&g_reactor, &info.transfer);
+    if (hedgeInfo.transfer.curl != nullptr) {
+      reactor_remove(&g_reactor, &hedgeInfo.transfer);
+    }
+
+    // Without a winner nothing was received, the last attempt to fail tells
+    request_info_t *const result =
+        g_winner != nullptr
+            ? g_winner
+            : (hedgeInfo.transfer.curl != nullptr ? &hedgeInfo : &info);
+    long httpStatus = 0;
+    curl_easy_getinfo(result->transfer.curl, CURLINFO_RESPONSE_CODE,
+                      &httpStatus);
+    const CURLcode code = result->code;
+    curl_off_t retryAfter = 0;
+    curl_easy_getinfo(result->transfer.curl, CURLINFO_RETRY_AFTER,
+                      &retryAfter);
+    ratelimit_finish(key, httpStatus, retryAfter);
+
+    // Endpoints and proxies refusing compressed bodies get plain ones from
+    // now on, without counting as a retry
+    if (gzip && runStatus == ERR_RECOVERABLE && code == CURLE_OK &&
+        httpStatus == HTTP_UNSUPPORTED_MEDIA_TYPE) {
+      fprintf(stderr, "Endpoint refused a compressed request, sending it "
+                      "uncompressed\n");
+      key->gzip_rejected = true;
+      if (hedgeInfo.transfer.curl != nullptr) {
+        curl_easy_cleanup(hedgeInfo.transfer.curl);
+      }
+      reset(writeData);
+      attempt--;
+      continue;
+    }
+
+    const bool retry = runStatus == ERR_RECOVERABLE && !g_response_started &&
+                       attempt < config->retries &&
+                       completions_is_retryable(code, httpStatus);
+    // A rejected key sits out, so another key of the pool is tried at once
+    int64_t delay = 0;
+    if (retry && !(httpStatus == HTTP_TOO_MANY_REQUESTS && pool->count > 1)) {
+      delay =
+          completions_retry_delay_ms(config, result->transfer.curl, attempt);
+    }
+
+    if (!g_response_started) {
+      printf("\n");
+    }
+
+    if (runStatus == ERR_RECOVERABLE && code == CURLE_OK) {
+      long newConnections = 0;
+      curl_easy_getinfo(result->transfer.curl, CURLINFO_NUM_CONNECTS,
+                        &newConnections);
+      g_connection_reused = g_stats.reused = newConnections == 0;
+      read_transfer_stats(result->transfer.curl, transferStarted);
+      if (g_first_byte_us > 0 && !retry) {
+        g_ttfb_samples[g_ttfb_count++ % TTFB_SAMPLES] =
+            g_first_byte_us - transferStarted;
+      }
+    }
+    if (hedgeInfo.transfer.curl != nullptr) {
+      curl_easy_cleanup(hedgeInfo.transfer.curl);
+    }
+
+    if (runStatus == ERR_UNRECOVERABLE) {
+      status = ERR_UNRECOVERABLE;
+      goto cleanup;
+    }
+
+    if (retry) {
+      if (delay == 0) {
+        fprintf(stderr,
+                "Request was rate limited, trying another key (%lld of "
+                "%lld)\n",
+                (long long)attempt + 1, (long long)config->retries);
+      } else if (code != CURLE_OK) {
+        fprintf(stderr, "Retrying in %.1f s (%lld of %lld)\n", delay / 1e3,
+                (long long)attempt + 1, (long long)config->retries);
+      } else {
+        fprintf(stderr,
+                "Request failed with HTTP status %ld, retrying in %.1f s "
+                "(%lld of %lld)\n",
+                httpStatus, delay / 1e3, (long long)attempt + 1,
+                (long long)config->retries);
+      }
+      fflush(stdout);
+      const struct timespec pause = {
+          .tv_sec = delay / 1000,
+          .tv_nsec = (delay % 1000) * 1000000,
+      };
+      nanosleep(&pause, nullptr);
+      reset(writeData);
+      g_stats.retries++;
+      continue;
+    }
+
+    if (code != CURLE_OK) {
+      fprintf(stderr, "Request failed or could not be sent to the endpoint\n");
+      status = ERR_UNRECOVERABLE;
+      goto cleanup;
     }
+
+    if (stream && httpStatus >= 400) {
+      fprintf(stderr, "Streamed request failed with HTTP status %ld\n",
+              httpStatus);
+      status = ERR_UNRECOVERABLE;
+      goto cleanup;
+    }
+
+    if (cache != nullptr && httpStatus == 200) {
+      cache_put(cache, cacheKey, cached->data, cached->length);
+    }
+    break;
   }
-  printf("\n");
 
-  if (info.code != CURLE_OK) {
-    fprintf(stderr, "Request failed or could not be sent to the endpoint\n");
-    status = ERR_UNRECOVERABLE;
-    goto cleanup;
+cleanup:
+  g_winner = nullptr;
+  if (cacheLocked) {
+    cache_unlock(cache, cacheKey);
   }
+  return status;
+}
 
-  output[s_buff] = '\0';
-  s_buff = 0;
+/**
+ * @brief Discards a partly received response before it is requested again
+ * @param output Buffer holding the response
+ */
+static void reset_response(void *const output) {
+  buffer_clear((buffer_t *)output);
+}
 
-cleanup:
-  if (pHeaders != nullptr) {
-    curl_slist_free_all(pHeaders);
+/**
+ * @brief Discards a partly received stream before it is requested again.
+ * Retries only happen before any fragment was rendered.
+ * @param output State of the stream
+ */
+static void reset_stream(void *const output) {
+  stream_state_t *const state = (stream_state_t *)output;
+  state->done = false;
+  state->failed = false;
+  buffer_clear(state->output);
+  buffer_clear(&state->raw);
+  sse_init(&state->parser, on_stream_event, state);
+}
+
+/**
+ * @brief Makes a call to the OpenAI completions API and receives the response
+ * of the LLM. The ouput is saved to the argument of the same name and contains
+ * the raw text context of the reply.
+ *
+ * @param config Configuration of the session
+ * @param input user input
+ * @param output Buffer receiving the raw response body, grown as needed
+ * @return Whether the function was successful
+ */
+size_t get_prompt_response(const termchat_config_t *const config,
+                           const char *const input, buffer_t *const output) {
+  buffer_clear(output);
+  // Previous answers are the best guess for the size of the next one
+  if (buffer_reserve(output, g_response_hint) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
   }
 
-  if (pCurl != nullptr) {
-    curl_easy_cleanup(pCurl);
+  const size_t status = send_request(config, input, false, write_func,
+                                     reset_response, output, output);
+  if (output->length > g_response_hint) {
+    g_response_hint = output->length;
   }
 
-  if (pthread_detach(thread) != 0) {
-    fprintf(stderr, "Thread could not be detached\n");
-    status = ERR_UNRECOVERABLE;
+  if (status == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
   }
-  return status;
+
+  // Answers served from the cache were not billed again
+  const completion_usage_t usage = g_usage;
+  if (!read_response(output->data, output->length, &g_response)) {
+    g_response = (response_fields_t){};
+  }
+  if (g_cache_hit) {
+    g_usage = usage;
+  } else {
+    account_usage();
+  }
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Makes a streaming call to the OpenAI completions API. Every content
+ * fragment is handed to the callback as soon as its event arrives, and the
+ * assembled message is saved to the output buffer once the stream ends.
+ *
+ * @param config Configuration of the session
+ * @param input user input
+ * @param on_delta Callback receiving every content fragment
+ * @param data Pointer handed to the callback
+ * @param output Buffer receiving the assembled message content
+ * @return Whether the function was successful
+ */
+size_t get_prompt_stream(const termchat_config_t *const config,
+                         const char *const input,
+                         const completion_delta_cb_t on_delta,
+                         void *const data, buffer_t *const output) {
+  g_stream.on_delta = on_delta;
+  g_stream.data = data;
+  g_stream.output = output;
+  if (buffer_reserve(output, g_response_hint) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+  reset_stream(&g_stream);
+
+  const size_t status = send_request(config, input, true, write_stream_func,
+                                     reset_stream, &g_stream, nullptr);
+  if (output->length > g_response_hint) {
+    g_response_hint = output->length;
+  }
+
+  response_fields_t fields;
+  if (g_stream.raw.length > 0 &&
+      read_response(g_stream.raw.data, g_stream.raw.length, &fields) &&
+      fields.error != nullptr) {
+    fprintf(stderr, "The API answered with an error: %.*s\n",
+            (int)fields.error_length, fields.error);
+  }
+  if (status == ERR_UNRECOVERABLE || g_stream.failed) {
+    return ERR_UNRECOVERABLE;
+  }
+  // A stream cut short before any content is no answer at all
+  if (!g_stream.done && output->length == 0) {
+    fprintf(stderr, "The stream ended without an answer\n");
+    return ERR_UNRECOVERABLE;
+  }
+
+  account_usage();
+  return ERR_RECOVERABLE;
 }
@@ -1,10 +1,103 @@
 #include "config.h"
 #include "globdef.h"
+#include "jsonscan.h"
+#include <fcntl.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 constexpr unsigned char RC_FILENAME[] = "termchatrc.json";
+constexpr char CONFIG_DEFAULT_ENDPOINT[] =
+    "https://api.openai.com/v1/chat/completions";
+constexpr int64_t CONFIG_DEFAULT_CACHE_TTL_S = 24 * 60 * 60;
+constexpr int64_t CONFIG_DEFAULT_CACHE_MAX_MB = 64;
+constexpr int64_t CONFIG_DEFAULT_KEEP_TURNS = 4;
+constexpr int64_t CONFIG_DEFAULT_RETRIES = 3;
+constexpr int64_t CONFIG_DEFAULT_RETRY_BASE_MS = 500;
+constexpr int64_t CONFIG_DEFAULT_HEDGE_MIN_MS = 1000;
+constexpr int64_t CONFIG_DEFAULT_COMPRESS_MIN_BYTES = 4096;
+
+typedef enum : uint8_t {
+  config_type_string,
+  config_type_bool,
+  config_type_integer,
+  config_type_number,
+  config_type_pool
+} config_type_t;
+
+typedef struct {
+  const char *name;
+  config_type_t type;
+  size_t offset;
+  bool required;
+} config_key_t;
+
+static const config_key_t CONFIG_KEYS[] = {
+    {"openai", config_type_string, offsetof(termchat_config_t, api_key), true},
+    {"model", config_type_string, offsetof(termchat_config_t, model), true},
+    {"role", config_type_string, offsetof(termchat_config_t, role), true},
+    {"instruction", config_type_string,
+     offsetof(termchat_config_t, instruction), true},
+    {"endpoint", config_type_string, offsetof(termchat_config_t, endpoint),
+     false},
+    {"connect_timeout_ms", config_type_integer,
+     offsetof(termchat_config_t, connect_timeout_ms), false},
+    {"timeout_ms", config_type_integer,
+     offsetof(termchat_config_t, timeout_ms), false},
+    {"max_tokens", config_type_integer,
+     offsetof(termchat_config_t, max_tokens), false},
+    {"stream", config_type_bool, offsetof(termchat_config_t, stream), false},
+    {"cache", config_type_bool, offsetof(termchat_config_t, cache), false},
+    {"prewarm", config_type_bool, offsetof(termchat_config_t, prewarm), false},
+    {"exec_parallel", config_type_integer,
+     offsetof(termchat_config_t, exec_parallel), false},
+    {"retries", config_type_integer, offsetof(termchat_config_t, retries),
+     false},
+    {"retry_base_ms", config_type_integer,
+     offsetof(termchat_config_t, retry_base_ms), false},
+    {"hedge_percentile", config_type_number,
+     offsetof(termchat_config_t, hedge_percentile), false},
+    {"hedge_min_ms", config_type_integer,
+     offsetof(termchat_config_t, hedge_min_ms), false},
+    {"compress", config_type_bool, offsetof(termchat_config_t, compress),
+     false},
+    {"compress_min_bytes", config_type_integer,
+     offsetof(termchat_config_t, compress_min_bytes), false},
+    {"cache_ttl_s", config_type_integer,
+     offsetof(termchat_config_t, cache_ttl_s), false},
+    {"cache_max_mb", config_type_integer,
+     offsetof(termchat_config_t, cache_max_mb), false},
+    {"tokenizer", config_type_string, offsetof(termchat_config_t, tokenizer),
+     false},
+    {"input_cost", config_type_number, offsetof(termchat_config_t, input_cost),
+     false},
+    {"cached_input_cost", config_type_number,
+     offsetof(termchat_config_t, cached_input_cost), false},
+    {"output_cost", config_type_number,
+     offsetof(termchat_config_t, output_cost), false},
+    {"context_max_bytes", config_type_integer,
+     offsetof(termchat_config_t, context_max_bytes), false},
+    {"context_max_tokens", config_type_integer,
+     offsetof(termchat_config_t, context_max_tokens), false},
+    {"context_keep_turns", config_type_integer,
+     offsetof(termchat_config_t, context_keep_turns), false},
+    {"pool", config_type_pool, 0, false},
+};
+constexpr size_t CONFIG_KEY_COUNT = sizeof(CONFIG_KEYS) / sizeof(CONFIG_KEYS[0]);
+
+// Members of every entry of the `pool` array, an entry without an endpoint
+// uses the configured one
+static const config_key_t UPSTREAM_KEYS[] = {
+    {"openai", config_type_string, offsetof(termchat_upstream_t, api_key),
+     true},
+    {"endpoint", config_type_string, offsetof(termchat_upstream_t, endpoint),
+     false},
+};
+constexpr size_t UPSTREAM_KEY_COUNT =
+    sizeof(UPSTREAM_KEYS) / sizeof(UPSTREAM_KEYS[0]);
 
 /**
  * @brief Gets the path where the configuration file for the program lives. The
@@ -47,55 +140,241 @@ int get_rc_exists() {
   return access(filepath, F_OK) != 0;
 }
 
+static const char *on_pool_element(const char *const value,
+                                   const char *const end, void *const data);
+
+/**
+ * @brief Stores a single value into the field its key describes
+ * @param target Structure holding the field, the configuration or an entry
+ * of its pool
+ * @param key Description of the key being parsed
+ * @param cursor Start of the value
+ * @param end End of the document
+ * @returns Position right after the value, or null on error
+ */
+static const char *parse_value(void *const target,
+                               const config_key_t *const key,
+                               const char *const cursor,
+                               const char *const end) {
+  void *const field = (char *)target + key->offset;
+  switch (key->type) {
+  case config_type_string: {
+    const char *const close =
+        *cursor == '"' ? json_scan_string(cursor, end) : nullptr;
+    if (close == nullptr) {
+      fprintf(stderr, "Config key \"%s\" must be a string\n", key->name);
+      return nullptr;
+    }
+    // The document lives in the storage owned by the configuration, so the
+    // value is terminated in place
+    *(char *)close = '\0';
+    *(char **)field = (char *)cursor + 1;
+    return close + 1;
+  }
+  case config_type_bool:
+    if (end - cursor >= 4 && memcmp(cursor, "true", 4) == 0) {
+      *(bool *)field = true;
+      return cursor + 4;
+    }
+    if (end - cursor >= 5 && memcmp(cursor, "false", 5) == 0) {
+      *(bool *)field = false;
+      return cursor + 5;
+    }
+    fprintf(stderr, "Config key \"%s\" must be a boolean\n", key->name);
+    return nullptr;
+  case config_type_integer: {
+    char *next = nullptr;
+    const long long value = strtoll(cursor, &next, 10);
+    if (next == cursor) {
+      fprintf(stderr, "Config key \"%s\" must be a number\n", key->name);
+      return nullptr;
+    }
+    *(int64_t *)field = value;
+    return next;
+  }
+  case config_type_number: {
+    char *next = nullptr;
+    const double value = strtod(cursor, &next);
+    if (next == cursor) {
+      fprintf(stderr, "Config key \"%s\" must be a number\n", key->name);
+      return nullptr;
+    }
+    *(double *)field = value;
+    return next;
+  }
+  case config_type_pool: {
+    const char *const after =
+        json_array_each(cursor, end, on_pool_element, target);
+    if (after == nullptr) {
+      fprintf(stderr, "Config key \"%s\" must be an array of objects\n",
+              key->name);
+    }
+    return after;
+  }
+  }
+  return nullptr;
+}
+
 /**
- * @brief Opens and reads the entire content of the `termchatrc` file into a
- * buffer.
+ * @brief Fills a member of a pool entry, skipping the values of unknown ones
+ * @param name Name of the member
+ * @param length Length of the name
+ * @param value Start of the value
+ * @param end End of the document
+ * @param data Pool entry to fill
+ * @returns Position right after the value, or null on error
+ */
+static const char *on_upstream_member(const char *const name,
+                                      const size_t length,
+                                      const char *const value,
+                                      const char *const end,
+                                      void *const data) {
+  for (size_t i = 0; i < UPSTREAM_KEY_COUNT; i++) {
+    if (strlen(UPSTREAM_KEYS[i].name) == length &&
+        memcmp(UPSTREAM_KEYS[i].name, name, length) == 0) {
+      return parse_value(data, &UPSTREAM_KEYS[i], value, end);
+    }
+  }
+  return json_skip_value(value, end);
+}
+
+/**
+ * @brief Appends an entry of the `pool` array to the configuration
+ * @param value Start of the entry
+ * @param end End of the document
+ * @param data Configuration to fill
+ * @returns Position right after the entry, or null on error
+ */
+static const char *on_pool_element(const char *const value,
+                                   const char *const end, void *const data) {
+  termchat_config_t *const config = (termchat_config_t *)data;
+  termchat_upstream_t *const pool = realloc(
+      config->pool, (config->pool_count + 1) * sizeof(termchat_upstream_t));
+  if (pool == nullptr) {
+    fprintf(stderr, "Failed to allocate memory for the key pool\n");
+    return nullptr;
+  }
+  config->pool = pool;
+
+  termchat_upstream_t *const upstream = &pool[config->pool_count];
+  *upstream = (termchat_upstream_t){};
+  const char *const after =
+      json_object_each(value, end, on_upstream_member, upstream);
+  if (after == nullptr) {
+    return nullptr;
+  }
+  if (upstream->api_key == nullptr) {
+    fprintf(stderr, "Every entry of \"pool\" needs an \"openai\" key\n");
+    return nullptr;
+  }
+  config->pool_count++;
+  return after;
+}
+
+/**
+ * @brief Fills the field of a known key, skipping the values of unknown ones
+ * @param name Name of the key
+ * @param length Length of the name
+ * @param value Start of the value
+ * @param end End of the document
+ * @param data Configuration to fill
+ * @returns Position right after the value, or null on error
+ */
+static const char *on_config_member(const char *const name,
+                                    const size_t length,
+                                    const char *const value,
+                                    const char *const end, void *const data) {
+  for (size_t i = 0; i < CONFIG_KEY_COUNT; i++) {
+    if (strlen(CONFIG_KEYS[i].name) == length &&
+        memcmp(CONFIG_KEYS[i].name, name, length) == 0) {
+      return parse_value((termchat_config_t *)data, &CONFIG_KEYS[i], value,
+                         end);
+    }
+  }
+  return json_skip_value(value, end);
+}
+
+/**
+ * @brief Opens and reads the entire content of the `termchatrc` file with a
+ * single read and parses it into the typed configuration.
  *
- * @param output A character array to store the resulting path.
- * @param len The length of the output buffer.
+ * @param filename Path of the configuration file.
+ * @param config Configuration to fill.
  * @return 0 on success, or a non-zero error code on failure.
  */
-int get_rc_contents(const char *const filename, char *const buffer,
-                    unsigned long bufferLength) {
-  FILE *file = fopen(filename, "rb");
-  if (file == NULL) {
+int config_load(const char *const filename, termchat_config_t *const config) {
+  *config = (termchat_config_t){
+      .endpoint = (char *)CONFIG_DEFAULT_ENDPOINT,
+      .prewarm = true,
+      .retries = CONFIG_DEFAULT_RETRIES,
+      .retry_base_ms = CONFIG_DEFAULT_RETRY_BASE_MS,
+      .hedge_min_ms = CONFIG_DEFAULT_HEDGE_MIN_MS,
+      .compress_min_bytes = CONFIG_DEFAULT_COMPRESS_MIN_BYTES,
+      .cache_ttl_s = CONFIG_DEFAULT_CACHE_TTL_S,
+      .cache_max_mb = CONFIG_DEFAULT_CACHE_MAX_MB,
+      .context_keep_turns = CONFIG_DEFAULT_KEEP_TURNS,
+  };
+
+  const int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
     fprintf(stderr, "Failed to open file for reading\n");
     return ERR_UNRECOVERABLE;
   }
 
-  if (fseek(file, 0, SEEK_END) != 0) {
-    fclose(file);
-    fprintf(stderr, "Failed to read file to end\n");
+  struct stat st = {};
+  if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+    close(fd);
+    fprintf(stderr, "Failed to get the size of the file\n");
     return ERR_UNRECOVERABLE;
   }
 
-  const long length = ftell(file);
-  if (length <= -1) {
-    fclose(file);
-    fprintf(stderr, "Failed to get current position of the stream\n");
+  const size_t length = st.st_size;
+  if ((config->storage = malloc(length + 1)) == nullptr) {
+    close(fd);
+    fprintf(stderr, "Failed to allocate memory for the file contents\n");
     return ERR_UNRECOVERABLE;
   }
 
-  if (fseek(file, 0, SEEK_SET) != 0) {
-    fclose(file);
-    fprintf(stderr, "Failed to set seek\n");
+  const ssize_t read_length = read(fd, config->storage, length);
+  close(fd);
+  if (read_length != (ssize_t)length) {
+    config_free(config);
+    fprintf(stderr, "Failed to read contents into memory\n");
     return ERR_UNRECOVERABLE;
   }
+  config->storage[length] = '\0';
 
-  const unsigned long fileLength = fread(buffer, 1, length, file);
-  if (fileLength <= 0) {
-    fclose(file);
-    fprintf(stderr, "Failed to read contents into memory\n");
+  if (json_object_each(config->storage, &config->storage[length],
+                       on_config_member, config) == nullptr) {
+    fprintf(stderr, "Config file must contain a valid JSON object\n");
+    config_free(config);
     return ERR_UNRECOVERABLE;
   }
 
-  if (fileLength > bufferLength) {
-    fclose(file);
-    fprintf(stderr, "Buffer is too small to hold file contents\n");
-    return ERR_UNRECOVERABLE;
+  for (size_t i = 0; i < CONFIG_KEY_COUNT; i++) {
+    const config_key_t *const key = &CONFIG_KEYS[i];
+    if (key->required && *(char **)((char *)config + key->offset) == nullptr) {
+      fprintf(stderr, "Config key \"%s\" is missing\n", key->name);
+      config_free(config);
+      return ERR_UNRECOVERABLE;
+    }
   }
 
-  fclose(file);
-  buffer[length] = '\0';
+  // The endpoint may follow the pool in the document
+  for (size_t i = 0; i < config->pool_count; i++) {
+    if (config->pool[i].endpoint == nullptr) {
+      config->pool[i].endpoint = config->endpoint;
+    }
+  }
   return ERR_RECOVERABLE;
 }
+
+/**
+ * @brief Releases the storage of a loaded configuration
+ * @param config Configuration to release
+ */
+void config_free(termchat_config_t *const config) {
+  free(config->pool);
+  free(config->storage);
+  *config = (termchat_config_t){};
+}
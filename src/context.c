@@ -0,0 +1,125 @@
+#include "context.h"
+#include "buffer.h"
+#include "escape.h"
+#include "globdef.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+constexpr size_t CONTEXT_MIN_MESSAGES = 16;
+constexpr char JSON_ROLE[] = ",{\"role\":\"";
+constexpr char JSON_CONTENT[] = "\",\"content\":\"";
+constexpr char JSON_END[] = "\"}";
+
+/**
+ * @brief Serializes a message as an element of the `messages` array, preceded
+ * by the comma separating it from the previous element. The content is
+ * escaped, so any text is safe to send.
+ * @param dest Buffer the element is appended to
+ * @param role Role of the author of the message
+ * @param content Content of the message
+ * @param length Length of the content
+ * @returns The status of the operation
+ */
+static size_t serialize_message(buffer_t *const dest, const role_type_t role,
+                                const char *const content,
+                                const size_t length) {
+  const char *const name = context_role_name(role);
+  if (buffer_append(dest, JSON_ROLE, sizeof(JSON_ROLE) - 1) ==
+          ERR_UNRECOVERABLE ||
+      buffer_append(dest, name, strlen(name)) == ERR_UNRECOVERABLE ||
+      buffer_append(dest, JSON_CONTENT, sizeof(JSON_CONTENT) - 1) ==
+          ERR_UNRECOVERABLE ||
+      json_escape(dest, content, length) == ERR_UNRECOVERABLE ||
+      buffer_append(dest, JSON_END, sizeof(JSON_END) - 1) ==
+          ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+  return ERR_RECOVERABLE;
+}
+
+size_t context_push(context_t *const context, const role_type_t role,
+                    const char *const content, const size_t length) {
+  if (context_role_name(role) == nullptr) {
+    fprintf(stderr, "Role failed to resolve\n");
+    return ERR_UNRECOVERABLE;
+  }
+
+  if (context->count == context->capacity) {
+    const size_t capacity =
+        context->capacity > 0 ? context->capacity * 2 : CONTEXT_MIN_MESSAGES;
+    context_message_t *const messages =
+        realloc(context->messages, capacity * sizeof(context_message_t));
+    if (messages == nullptr) {
+      fprintf(stderr, "Message index could not grow\n");
+      return ERR_UNRECOVERABLE;
+    }
+    context->messages = messages;
+    context->capacity = capacity;
+  }
+
+  const size_t offset = context->arena.length;
+  // Every content keeps its terminating null byte inside the arena
+  if (buffer_append(&context->arena, content, length) == ERR_UNRECOVERABLE ||
+      buffer_append(&context->arena, "", 1) == ERR_UNRECOVERABLE) {
+    context->arena.length = offset;
+    fprintf(stderr, "Message could not be stored\n");
+    return ERR_UNRECOVERABLE;
+  }
+
+  const size_t json_offset = context->json.length;
+  if (serialize_message(&context->json, role, content, length) ==
+      ERR_UNRECOVERABLE) {
+    context->arena.length = offset;
+    context->json.length = json_offset;
+    fprintf(stderr, "Message could not be serialized\n");
+    return ERR_UNRECOVERABLE;
+  }
+
+  context->messages[context->count++] = (context_message_t){
+      .role = role,
+      .offset = offset,
+      .length = length,
+      .json_offset = json_offset,
+      .json_length = context->json.length - json_offset,
+      .tokens = CONTEXT_TOKENS_UNKNOWN,
+  };
+  return ERR_RECOVERABLE;
+}
+
+const char *context_content(const context_t *const context,
+                            const size_t index) {
+  return &context->arena.data[context->messages[index].offset];
+}
+
+const char *context_role_name(const role_type_t role) {
+  switch (role) {
+  default:
+    return nullptr;
+  case role_type_user:
+    return "user";
+  case role_type_assistant:
+    return "assistant";
+  case role_type_developer:
+    return "developer";
+  }
+}
+
+void context_truncate(context_t *const context, const size_t count) {
+  if (count >= context->count) {
+    return;
+  }
+  const context_message_t *const first = &context->messages[count];
+  context->arena.length = first->offset;
+  context->arena.data[first->offset] = '\0';
+  context->json.length = first->json_offset;
+  context->json.data[first->json_offset] = '\0';
+  context->count = count;
+}
+
+void context_free(context_t *const context) {
+  buffer_free(&context->arena);
+  buffer_free(&context->json);
+  free(context->messages);
+  *context = (context_t){};
+}
@@ -0,0 +1,518 @@
+#define _GNU_SOURCE
+#include "daemon.h"
+#include "buffer.h"
+#include "completions.h"
+#include "config.h"
+#include "globdef.h"
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// stdin, stdout and stderr of the client travel with the request
+constexpr size_t DAEMON_FDS = 3;
+constexpr size_t DAEMON_MAX_REQUEST = 1 << 20;
+constexpr int DAEMON_BACKLOG = 16;
+// Clients are served one at a time, a stalled one may not hold up the rest
+constexpr time_t DAEMON_RECEIVE_TIMEOUT_SECS = 5;
+// Answer of a daemon that leaves the request to the client, nothing ran
+constexpr uint8_t DAEMON_REJECTED = 0xFF;
+
+typedef struct {
+  // Bytes of the configuration path, the working directory and the
+  // arguments that follow
+  uint32_t length;
+  uint32_t argc;
+} daemon_header_t;
+
+static char g_socket_path[sizeof(((struct sockaddr_un *)0)->sun_path)] = {};
+// Configuration the daemon answers with
+static char g_rc_path[PATH_MAX] = {};
+
+/**
+ * @brief Resolves the path of the configuration file, so callers that reach
+ * the same file through different paths still match
+ * @param dest Destination of the path, at least `PATH_MAX` bytes long
+ * @returns The status of the operation
+ */
+static size_t get_resolved_rc_path(char *const dest) {
+  char path[PATH_MAX];
+  if (get_rc_path(path, sizeof(path)) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+  if (realpath(path, dest) == nullptr) {
+    snprintf(dest, PATH_MAX, "%s", path);
+  }
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Creates the private directory holding the socket when there is no
+ * runtime directory. Anyone may create entries in /tmp, so a directory that
+ * is not a real directory of this user, closed to everyone else, is refused.
+ * @param dest Receives the path of the directory
+ * @param len Size of the destination
+ * @returns The status of the operation
+ */
+static size_t get_private_dir(char *const dest, const size_t len) {
+  const int written =
+      snprintf(dest, len, "/tmp/termchat-%u", (unsigned)getuid());
+  if (written < 0 || (size_t)written >= len) {
+    return ERR_UNRECOVERABLE;
+  }
+  if (mkdir(dest, 0700) != 0 && errno != EEXIST) {
+    return ERR_UNRECOVERABLE;
+  }
+
+  struct stat st = {};
+  if (lstat(dest, &st) != 0 || !S_ISDIR(st.st_mode) ||
+      st.st_uid != getuid() || (st.st_mode & 0077) != 0) {
+    return ERR_UNRECOVERABLE;
+  }
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Builds the address of the socket
+ * @param address Receives the address
+ * @returns The status of the operation
+ */
+static size_t get_socket_address(struct sockaddr_un *const address) {
+  *address = (struct sockaddr_un){.sun_family = AF_UNIX};
+  char private_dir[sizeof(address->sun_path)];
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  if (dir == nullptr) {
+    if (get_private_dir(private_dir, sizeof(private_dir)) ==
+        ERR_UNRECOVERABLE) {
+      return ERR_UNRECOVERABLE;
+    }
+    dir = private_dir;
+  }
+
+  const int written = snprintf(address->sun_path, sizeof(address->sun_path),
+                               "%s/termchat.sock", dir);
+  if (written < 0 || (size_t)written >= sizeof(address->sun_path)) {
+    return ERR_UNRECOVERABLE;
+  }
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Checks that the other end of a connection runs as this user
+ * @param fd Connected descriptor
+ * @returns Whether the peer has the same user id
+ */
+static bool is_own_peer(const int fd) {
+  struct ucred peer = {};
+  socklen_t peerLength = sizeof(peer);
+  return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &peerLength) == 0 &&
+         peer.uid == getuid();
+}
+
+/**
+ * @brief Connects to the socket of the daemon. A listener run by another
+ * user would receive the terminal of the caller, so it counts as no daemon.
+ * @param address Address of the socket
+ * @returns The connected descriptor, -1 if no daemon of this user listens
+ */
+static int connect_socket(const struct sockaddr_un *const address) {
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (const struct sockaddr *)address, sizeof(*address)) != 0 ||
+      !is_own_peer(fd)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * @brief Writes a whole chunk to a descriptor, continuing after partial writes
+ * @param fd Descriptor to write to
+ * @param src Bytes to write
+ * @param length Amount of bytes
+ * @returns The status of the operation
+ */
+static size_t write_all(const int fd, const char *src, size_t length) {
+  while (length > 0) {
+    const ssize_t written = write(fd, src, length);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return ERR_UNRECOVERABLE;
+    }
+    src += written;
+    length -= written;
+  }
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Reads exactly the requested amount of bytes from a descriptor
+ * @param fd Descriptor to read from
+ * @param dest Destination of the bytes
+ * @param length Amount of bytes
+ * @returns The status of the operation, unrecoverable on an early end
+ */
+static size_t read_all(const int fd, char *dest, size_t length) {
+  while (length > 0) {
+    const ssize_t received = read(fd, dest, length);
+    if (received < 0 && errno == EINTR) {
+      continue;
+    }
+    if (received <= 0) {
+      return ERR_UNRECOVERABLE;
+    }
+    dest += received;
+    length -= received;
+  }
+  return ERR_RECOVERABLE;
+}
+
+bool daemon_forward(const int argc, const char *const *const argv,
+                    size_t *const status) {
+  struct sockaddr_un address;
+  if (get_socket_address(&address) == ERR_UNRECOVERABLE) {
+    return false;
+  }
+  const int fd = connect_socket(&address);
+  if (fd < 0) {
+    return false;
+  }
+
+  bool forwarded = false;
+  buffer_t payload = {};
+  char rcPath[PATH_MAX];
+  char *const cwd = getcwd(nullptr, 0);
+  if (cwd == nullptr ||
+      get_resolved_rc_path(rcPath) == ERR_UNRECOVERABLE ||
+      buffer_append(&payload, rcPath, strlen(rcPath) + 1) ==
+          ERR_UNRECOVERABLE ||
+      buffer_append(&payload, cwd, strlen(cwd) + 1) == ERR_UNRECOVERABLE) {
+    goto cleanup;
+  }
+  for (int i = 0; i < argc; i++) {
+    if (buffer_append(&payload, argv[i], strlen(argv[i]) + 1) ==
+        ERR_UNRECOVERABLE) {
+      goto cleanup;
+    }
+  }
+
+  // The descriptors ride along with the header as ancillary data
+  daemon_header_t header = {.length = payload.length, .argc = argc};
+  struct iovec iov = {.iov_base = &header, .iov_len = sizeof(header)};
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * DAEMON_FDS)];
+    struct cmsghdr align;
+  } control = {};
+  struct msghdr message = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+  };
+  struct cmsghdr *const cmsg = CMSG_FIRSTHDR(&message);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * DAEMON_FDS);
+  const int fds[DAEMON_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  // Nothing ran yet, a daemon refusing the request leaves it to this process
+  if (sendmsg(fd, &message, MSG_NOSIGNAL) != sizeof(header) ||
+      write_all(fd, payload.data, payload.length) == ERR_UNRECOVERABLE) {
+    goto cleanup;
+  }
+
+  uint8_t answer = ERR_UNRECOVERABLE;
+  if (read_all(fd, (char *)&answer, sizeof(answer)) == ERR_UNRECOVERABLE) {
+    fprintf(stderr, "The daemon closed the connection without an answer\n");
+    answer = ERR_UNRECOVERABLE;
+  }
+  // A daemon reading another configuration must not answer this prompt
+  forwarded = answer != DAEMON_REJECTED;
+  *status = answer;
+
+cleanup:
+  free(cwd);
+  buffer_free(&payload);
+  close(fd);
+  return forwarded;
+}
+
+/**
+ * @brief Removes the socket once the daemon is asked to stop
+ * @param int Number of the signal received
+ */
+static void on_stop_received(int) {
+  unlink(g_socket_path);
+  _exit(0);
+}
+
+/**
+ * @brief Binds the socket and listens on it. A socket file left behind by a
+ * daemon that is gone is replaced.
+ * @param address Address of the socket
+ * @returns The listening descriptor, -1 on failure
+ */
+static int listen_socket(const struct sockaddr_un *const address) {
+  const int running = connect_socket(address);
+  if (running >= 0) {
+    close(running);
+    fprintf(stderr, "A daemon is already listening on %s\n",
+            address->sun_path);
+    return -1;
+  }
+  unlink(address->sun_path);
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    fprintf(stderr, "Could not create the socket of the daemon\n");
+    return -1;
+  }
+
+  // Whoever connects may run commands, so only the owner can
+  const mode_t mask = umask(0077);
+  const int bound =
+      bind(fd, (const struct sockaddr *)address, sizeof(*address));
+  umask(mask);
+  if (bound != 0 || listen(fd, DAEMON_BACKLOG) != 0) {
+    fprintf(stderr, "Could not listen on %s\n", address->sun_path);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * @brief Receives a request, the descriptors of the client and its
+ * arguments. Gives up once the client stays silent for
+ * `DAEMON_RECEIVE_TIMEOUT_SECS`.
+ * @param client Connection of the client
+ * @param fds Receives the descriptors of the client, -1 if none arrived
+ * @param payload Receives the working directory and the arguments
+ * @param header Receives the header of the request
+ * @returns The status of the operation
+ */
+static size_t receive_request(const int client, int *const fds,
+                              buffer_t *const payload,
+                              daemon_header_t *const header) {
+  struct iovec iov = {.iov_base = header, .iov_len = sizeof(*header)};
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * DAEMON_FDS)];
+    struct cmsghdr align;
+  } control = {};
+  struct msghdr message = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+  };
+
+  ssize_t received = -1;
+  while ((received = recvmsg(client, &message, MSG_CMSG_CLOEXEC)) < 0 &&
+         errno == EINTR) {
+  }
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != nullptr;
+       cmsg = CMSG_NXTHDR(&message, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(int) * DAEMON_FDS)) {
+      memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * DAEMON_FDS);
+    }
+  }
+
+  if (received != sizeof(*header) || fds[0] < 0 || header->argc == 0 ||
+      header->length == 0 || header->length > DAEMON_MAX_REQUEST) {
+    return ERR_UNRECOVERABLE;
+  }
+
+  buffer_clear(payload);
+  if (buffer_reserve(payload, header->length) == ERR_UNRECOVERABLE ||
+      read_all(client, payload->data, header->length) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+  payload->length = header->length;
+  payload->data[payload->length] = '\0';
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Answers a single client on its own terminal
+ * @param client Connection of the client
+ * @param idle Descriptor of /dev/null, standing in for stdio between clients
+ * @param on_request Callback answering the request
+ * @param data Pointer handed to the callback
+ */
+static void serve_client(const int client, const int idle,
+                         const daemon_request_cb_t on_request,
+                         void *const data) {
+  static buffer_t payload = {};
+  static const char **argv = nullptr;
+  static size_t capacity = 0;
+  int fds[DAEMON_FDS] = {-1, -1, -1};
+  daemon_header_t header = {};
+
+  const struct timeval timeout = {.tv_sec = DAEMON_RECEIVE_TIMEOUT_SECS};
+  if (!is_own_peer(client) ||
+      setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                 sizeof(timeout)) != 0 ||
+      receive_request(client, fds, &payload, &header) == ERR_UNRECOVERABLE) {
+    goto cleanup;
+  }
+
+  if (header.argc > capacity) {
+    const char **const grown = realloc(argv, header.argc * sizeof(*argv));
+    if (grown == nullptr) {
+      goto cleanup;
+    }
+    argv = grown;
+    capacity = header.argc;
+  }
+
+  // The configuration path and the working directory come first, every
+  // string is null terminated
+  const char *cursor = payload.data;
+  const char *const end = payload.data + payload.length;
+  if (strcmp(cursor, g_rc_path) != 0) {
+    const uint8_t rejected = DAEMON_REJECTED;
+    send(client, &rejected, sizeof(rejected), MSG_NOSIGNAL);
+    goto cleanup;
+  }
+  cursor += strlen(cursor) + 1;
+  if (cursor >= end) {
+    goto cleanup;
+  }
+  const char *const cwd = cursor;
+  cursor += strlen(cursor) + 1;
+  for (uint32_t i = 0; i < header.argc; i++) {
+    if (cursor >= end) {
+      goto cleanup;
+    }
+    argv[i] = cursor;
+    cursor += strlen(cursor) + 1;
+  }
+
+  for (size_t i = 0; i < DAEMON_FDS; i++) {
+    dup2(fds[i], (int)i);
+  }
+
+  size_t status = ERR_UNRECOVERABLE;
+  if (chdir(cwd) != 0) {
+    fprintf(stderr, "The daemon could not enter %s\n", cwd);
+  } else {
+    status = on_request((int)header.argc, argv, data);
+  }
+
+  // Nothing of this client may reach the next one
+  fflush(stdout);
+  fflush(stderr);
+  __fpurge(stdin);
+  clearerr(stdin);
+  for (size_t i = 0; i < DAEMON_FDS; i++) {
+    dup2(idle, (int)i);
+  }
+  if (chdir("/") != 0) {
+    status = ERR_UNRECOVERABLE;
+  }
+
+  const uint8_t answer = (uint8_t)status;
+  send(client, &answer, sizeof(answer), MSG_NOSIGNAL);
+
+cleanup:
+  for (size_t i = 0; i < DAEMON_FDS; i++) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+}
+
+size_t daemon_serve(const termchat_config_t *const config,
+                    const daemon_request_cb_t on_request, void *const data) {
+  struct sockaddr_un address;
+  if (get_socket_address(&address) == ERR_UNRECOVERABLE) {
+    fprintf(stderr, "Could not find a path for the socket of the daemon\n");
+    return ERR_UNRECOVERABLE;
+  }
+  if (get_resolved_rc_path(g_rc_path) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+
+  const int fd = listen_socket(&address);
+  if (fd < 0) {
+    return ERR_UNRECOVERABLE;
+  }
+  const int idle = open("/dev/null", O_RDWR | O_CLOEXEC);
+  if (idle < 0) {
+    fprintf(stderr, "Could not open /dev/null\n");
+    close(fd);
+    unlink(address.sun_path);
+    return ERR_UNRECOVERABLE;
+  }
+
+  // No transfer ran yet, so there is no resolver thread the child could miss
+  fflush(stdout);
+  const pid_t pid = fork();
+  if (pid != 0) {
+    close(idle);
+    close(fd);
+    if (pid < 0) {
+      fprintf(stderr, "Could not start the daemon\n");
+      unlink(address.sun_path);
+      return ERR_UNRECOVERABLE;
+    }
+    printf("Daemon %d listening on %s\n", (int)pid, address.sun_path);
+    return ERR_RECOVERABLE;
+  }
+
+  // Without a controlling terminal, using the one of a client never stops
+  // the daemon with SIGTTIN or SIGTTOU
+  setsid();
+  memcpy(g_socket_path, address.sun_path, sizeof(g_socket_path));
+  signal(SIGTERM, on_stop_received);
+  signal(SIGINT, on_stop_received);
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+  for (size_t i = 0; i < DAEMON_FDS; i++) {
+    dup2(idle, (int)i);
+  }
+  // Prompts asking for permission must show before the keypress is read
+  setvbuf(stdout, nullptr, _IOLBF, 0);
+  if (chdir("/") != 0) {
+    return ERR_UNRECOVERABLE;
+  }
+
+  while (true) {
+    // The warm-up stops as soon as a client connects
+    if (completions_await_input(config, fd) == ERR_UNRECOVERABLE) {
+      break;
+    }
+
+    const int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+    if (client < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      break;
+    }
+    serve_client(client, idle, on_request, data);
+    close(client);
+  }
+
+  close(idle);
+  close(fd);
+  unlink(g_socket_path);
+  return ERR_UNRECOVERABLE;
+}
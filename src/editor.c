@@ -0,0 +1,312 @@
+#include "editor.h"
+#include "buffer.h"
+#include "globdef.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+constexpr size_t EDITOR_READ_SIZE = 4096;
+constexpr char KEY_CTRL_D = 4;
+constexpr char KEY_CTRL_H = 8;
+constexpr char KEY_CTRL_U = 21;
+constexpr char KEY_CTRL_W = 23;
+constexpr char KEY_ESCAPE = 27;
+constexpr char KEY_BACKSPACE = 127;
+constexpr char ERASE_CHAR[] = "\b \b";
+constexpr char ERASE_LINE[] = "\r\033[2K";
+constexpr char PREVIEW_START[] = "\033[0;2m> ";
+constexpr char PREVIEW_END[] = "\033[0m";
+// Room left for the prompt marker and the count of queued lines
+constexpr size_t PREVIEW_MARGIN = 32;
+
+typedef enum : uint8_t {
+  escape_none,
+  escape_started,
+  escape_sequence
+} escape_state_t;
+
+/**
+ * @brief Writes bytes to the terminal, continuing after partial writes
+ * @param text Bytes to write
+ * @param length Amount of bytes
+ */
+static void write_terminal(const char *text, size_t length) {
+  // Text printed through stdio must come out first
+  fflush(stdout);
+  while (length > 0) {
+    const ssize_t written = write(STDOUT_FILENO, text, length);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return;
+    }
+    text += written;
+    length -= written;
+  }
+}
+
+/**
+ * @brief Writes keystrokes to the terminal while the editor is visible
+ * @param editor Editor that received the keystrokes
+ * @param text Bytes to write
+ * @param length Amount of bytes
+ */
+static void echo(const editor_t *const editor, const char *const text,
+                 const size_t length) {
+  if (editor->visible) {
+    write_terminal(text, length);
+  }
+}
+
+/**
+ * @brief Removes the last character of the line, with every byte of its
+ * UTF-8 sequence, and erases it from the terminal
+ * @param editor Editor holding the line
+ * @returns Whether a character was removed
+ */
+static bool erase_last(editor_t *const editor) {
+  buffer_t *const line = &editor->line;
+  if (line->length == 0) {
+    return false;
+  }
+  while (line->length > 1 && (line->data[line->length - 1] & 0xC0) == 0x80) {
+    line->length--;
+  }
+  line->data[--line->length] = '\0';
+  echo(editor, ERASE_CHAR, sizeof(ERASE_CHAR) - 1);
+  return true;
+}
+
+/**
+ * @brief Moves the current line into the queue of finished lines
+ * @param editor Editor holding the line
+ * @returns The status of the operation
+ */
+static size_t queue_line(editor_t *const editor) {
+  if (buffer_append(&editor->queue, editor->line.data, editor->line.length) ==
+          ERR_UNRECOVERABLE ||
+      buffer_append(&editor->queue, "", 1) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+  editor->queued++;
+  buffer_clear(&editor->line);
+  echo(editor, "\n", 1);
+  editor->visible = false;
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Applies a single keystroke to the line
+ * @param editor Editor holding the line
+ * @param key Byte that was read
+ * @returns The status of the operation
+ */
+static size_t apply_key(editor_t *const editor, const char key) {
+  // Arrow and function keys arrive as sequences, none of them edits the line
+  if (editor->escape == escape_started) {
+    editor->escape = key == '[' || key == 'O' ? escape_sequence : escape_none;
+    return ERR_RECOVERABLE;
+  }
+  if (editor->escape == escape_sequence) {
+    if (key >= 0x40 && key <= 0x7E) {
+      editor->escape = escape_none;
+    }
+    return ERR_RECOVERABLE;
+  }
+
+  switch (key) {
+  case '\n':
+    return queue_line(editor);
+  case KEY_ESCAPE:
+    editor->escape = editor->raw ? escape_started : escape_none;
+    return ERR_RECOVERABLE;
+  case KEY_BACKSPACE:
+  case KEY_CTRL_H:
+    erase_last(editor);
+    return ERR_RECOVERABLE;
+  case KEY_CTRL_U:
+    while (erase_last(editor)) {
+    }
+    return ERR_RECOVERABLE;
+  case KEY_CTRL_W:
+    while (editor->line.length > 0 &&
+           editor->line.data[editor->line.length - 1] == ' ') {
+      erase_last(editor);
+    }
+    while (editor->line.length > 0 &&
+           editor->line.data[editor->line.length - 1] != ' ') {
+      erase_last(editor);
+    }
+    return ERR_RECOVERABLE;
+  case KEY_CTRL_D:
+    editor->closed = editor->line.length == 0;
+    return ERR_RECOVERABLE;
+  default:
+    break;
+  }
+
+  if ((unsigned char)key < ' ' && key != '\t') {
+    return ERR_RECOVERABLE;
+  }
+  if (buffer_append(&editor->line, &key, 1) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+  echo(editor, &key, 1);
+  return ERR_RECOVERABLE;
+}
+
+size_t editor_open(editor_t *const editor, const int fd) {
+  *editor = (editor_t){.fd = fd};
+  if (!isatty(fd) || tcgetattr(fd, &editor->saved) != 0) {
+    return ERR_RECOVERABLE;
+  }
+
+  // Signals stay enabled, so Ctrl-C still ends the program
+  struct termios raw = editor->saved;
+  raw.c_lflag &= ~(ICANON | ECHO);
+  raw.c_cc[VMIN] = 1;
+  raw.c_cc[VTIME] = 0;
+  if (tcsetattr(fd, TCSANOW, &raw) != 0) {
+    fprintf(stderr, "Could not switch the terminal to raw input\n");
+    return ERR_UNRECOVERABLE;
+  }
+  editor->raw = true;
+  return ERR_RECOVERABLE;
+}
+
+void editor_close(editor_t *const editor) {
+  if (editor->raw) {
+    tcsetattr(editor->fd, TCSANOW, &editor->saved);
+    editor->raw = false;
+  }
+  buffer_free(&editor->line);
+  buffer_free(&editor->queue);
+  editor->queued = 0;
+  editor->fd = -1;
+}
+
+void editor_restore(const editor_t *const editor) {
+  if (editor->raw) {
+    tcsetattr(editor->fd, TCSANOW, &editor->saved);
+  }
+}
+
+size_t editor_feed(editor_t *const editor) {
+  if (editor->closed) {
+    return ERR_RECOVERABLE;
+  }
+
+  char chunk[EDITOR_READ_SIZE];
+  const ssize_t length = read(editor->fd, chunk, sizeof(chunk));
+  if (length < 0) {
+    if (errno == EINTR || errno == EAGAIN) {
+      return ERR_RECOVERABLE;
+    }
+    fprintf(stderr, "Failed to read the next keystrokes\n");
+    editor->closed = true;
+    return ERR_UNRECOVERABLE;
+  }
+  if (length == 0) {
+    // A last line without a newline still counts
+    editor->closed = true;
+    return editor->line.length > 0 ? queue_line(editor) : ERR_RECOVERABLE;
+  }
+
+  for (ssize_t i = 0; i < length; i++) {
+    if (apply_key(editor, chunk[i]) == ERR_UNRECOVERABLE) {
+      return ERR_UNRECOVERABLE;
+    }
+  }
+  return ERR_RECOVERABLE;
+}
+
+size_t editor_wait(editor_t *const editor) {
+  struct pollfd input = {.fd = editor->fd, .events = POLLIN};
+  const int ready = poll(&input, 1, -1);
+  if (ready < 0) {
+    return errno == EINTR ? ERR_RECOVERABLE : ERR_UNRECOVERABLE;
+  }
+  return editor_feed(editor);
+}
+
+void editor_drain(editor_t *const editor) {
+  if (editor->fd < 0) {
+    return;
+  }
+  struct pollfd input = {.fd = editor->fd, .events = POLLIN};
+  while (!editor->closed && poll(&input, 1, 0) > 0) {
+    if (editor_feed(editor) == ERR_UNRECOVERABLE) {
+      return;
+    }
+  }
+}
+
+void editor_preview(editor_t *const editor) {
+  editor_clear_preview(editor);
+  if (!editor->raw || editor->visible ||
+      (editor->line.length == 0 && editor->queued == 0)) {
+    return;
+  }
+
+  struct winsize size = {};
+  const size_t width =
+      ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0
+          ? size.ws_col
+          : 80;
+  const size_t room = width > PREVIEW_MARGIN ? width - PREVIEW_MARGIN : 1;
+
+  // Bytes never take less room than the columns they fill
+  size_t start = editor->line.length > room ? editor->line.length - room : 0;
+  while (start < editor->line.length &&
+         (editor->line.data[start] & 0xC0) == 0x80) {
+    start++;
+  }
+
+  char queued[PREVIEW_MARGIN] = "";
+  if (editor->queued > 0) {
+    snprintf(queued, sizeof(queued), "(+%zu) ", editor->queued);
+  }
+  write_terminal(PREVIEW_START, sizeof(PREVIEW_START) - 1);
+  write_terminal(queued, strlen(queued));
+  write_terminal(&editor->line.data[start], editor->line.length - start);
+  write_terminal(PREVIEW_END, sizeof(PREVIEW_END) - 1);
+  editor->previewed = true;
+}
+
+void editor_clear_preview(editor_t *const editor) {
+  if (editor->previewed) {
+    write_terminal(ERASE_LINE, sizeof(ERASE_LINE) - 1);
+    editor->previewed = false;
+  }
+}
+
+void editor_show(editor_t *const editor) {
+  editor->visible = true;
+  echo(editor, editor->line.data, editor->line.length);
+}
+
+void editor_hide(editor_t *const editor) { editor->visible = false; }
+
+bool editor_has_line(const editor_t *const editor) {
+  return editor->queued > 0;
+}
+
+size_t editor_take_line(editor_t *const editor, char *const dest,
+                        const size_t len) {
+  if (editor->queued == 0) {
+    return ERR_UNRECOVERABLE;
+  }
+
+  buffer_t *const queue = &editor->queue;
+  const size_t taken = strlen(queue->data) + 1;
+  snprintf(dest, len, "%s", queue->data);
+  memmove(queue->data, queue->data + taken, queue->length - taken);
+  queue->length -= taken;
+  queue->data[queue->length] = '\0';
+  editor->queued--;
+  return ERR_RECOVERABLE;
+}
@@ -0,0 +1,328 @@
+#include "escape.h"
+#include "buffer.h"
+#include "globdef.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__SSE2__)
+#include <immintrin.h>
+#define ESCAPE_SIMD 1
+#endif
+
+constexpr uint8_t JSON_CONTROL_MAX = 0x1f;
+constexpr char HEX_DIGITS[] = "0123456789abcdef";
+constexpr uint32_t UTF8_REPLACEMENT = 0xfffd;
+constexpr uint32_t SURROGATE_HIGH_MIN = 0xd800;
+constexpr uint32_t SURROGATE_LOW_MIN = 0xdc00;
+constexpr uint32_t SURROGATE_LOW_MAX = 0xdfff;
+constexpr size_t UNICODE_ESCAPE_LEN = 6;
+
+typedef size_t (*escape_scan_t)(const char *const src, const size_t length);
+
+/**
+ * @brief Whether a byte must be escaped inside a JSON string
+ * @param c Byte to check
+ * @returns True for quotes, backslashes and control characters
+ */
+static inline bool needs_escape(const unsigned char c) {
+  return c <= JSON_CONTROL_MAX || c == '"' || c == '\\';
+}
+
+/**
+ * @brief Finds the first byte that must be escaped, one byte at a time
+ * @param src String to scan
+ * @param length Length of the string
+ * @returns Position of the byte, or `length` if there is none
+ */
+static size_t scan_scalar(const char *const src, const size_t length) {
+  size_t i = 0;
+  while (i < length && !needs_escape((unsigned char)src[i])) {
+    i++;
+  }
+  return i;
+}
+
+#ifdef ESCAPE_SIMD
+/**
+ * @brief Finds the first byte that must be escaped, 16 bytes at a time
+ * @param src String to scan
+ * @param length Length of the string
+ * @returns Position of the byte, or `length` if there is none
+ */
+static size_t scan_sse2(const char *const src, const size_t length) {
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(JSON_CONTROL_MAX);
+
+  size_t i = 0;
+  for (; i + sizeof(__m128i) <= length; i += sizeof(__m128i)) {
+    const __m128i chunk = _mm_loadu_si128((const __m128i *)&src[i]);
+    // max(c, 0x1f) == 0x1f holds exactly for the unsigned bytes <= 0x1f
+    const __m128i hits = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                     _mm_cmpeq_epi8(chunk, backslash)),
+        _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+    const int mask = _mm_movemask_epi8(hits);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return i + scan_scalar(&src[i], length - i);
+}
+
+/**
+ * @brief Finds the first byte that must be escaped, 32 bytes at a time
+ * @param src String to scan
+ * @param length Length of the string
+ * @returns Position of the byte, or `length` if there is none
+ */
+[[gnu::target("avx2")]] static size_t scan_avx2(const char *const src,
+                                                const size_t length) {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  const __m256i control = _mm256_set1_epi8(JSON_CONTROL_MAX);
+
+  size_t i = 0;
+  for (; i + sizeof(__m256i) <= length; i += sizeof(__m256i)) {
+    const __m256i chunk = _mm256_loadu_si256((const __m256i *)&src[i]);
+    const __m256i hits = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote),
+                        _mm256_cmpeq_epi8(chunk, backslash)),
+        _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, control), control));
+    const uint32_t mask = (uint32_t)_mm256_movemask_epi8(hits);
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return i + scan_sse2(&src[i], length - i);
+}
+#endif
+
+/**
+ * @brief Picks the widest scanner the processor supports, once
+ * @returns The scanner to use
+ */
+static escape_scan_t get_scanner() {
+  static escape_scan_t scanner = nullptr;
+  if (scanner == nullptr) {
+#ifdef ESCAPE_SIMD
+    __builtin_cpu_init();
+    scanner = __builtin_cpu_supports("avx2") ? scan_avx2 : scan_sse2;
+#else
+    scanner = scan_scalar;
+#endif
+  }
+  return scanner;
+}
+
+size_t json_escape(buffer_t *const dest, const char *const src,
+                   const size_t length) {
+  const escape_scan_t scan = get_scanner();
+  // Most text needs few escapes, so reserve a little headroom up front and
+  // let escape-heavy input grow the buffer
+  if (buffer_reserve(dest, dest->length + length + length / 8) ==
+      ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+  dest->data[dest->length] = '\0';
+
+  size_t i = 0;
+  while (i < length) {
+    const size_t run = scan(&src[i], length - i);
+    if (buffer_append(dest, &src[i], run) == ERR_UNRECOVERABLE) {
+      return ERR_UNRECOVERABLE;
+    }
+    i += run;
+    if (i >= length) {
+      break;
+    }
+
+    const unsigned char c = (unsigned char)src[i++];
+    char escaped[UNICODE_ESCAPE_LEN] = {'\\', (char)c};
+    size_t escapedLength = 2;
+    switch (c) {
+    case '"':
+    case '\\':
+      break;
+    case '\n':
+      escaped[1] = 'n';
+      break;
+    case '\r':
+      escaped[1] = 'r';
+      break;
+    case '\t':
+      escaped[1] = 't';
+      break;
+    case '\b':
+      escaped[1] = 'b';
+      break;
+    case '\f':
+      escaped[1] = 'f';
+      break;
+    default:
+      escaped[1] = 'u';
+      escaped[2] = '0';
+      escaped[3] = '0';
+      escaped[4] = HEX_DIGITS[c >> 4];
+      escaped[5] = HEX_DIGITS[c & 0xf];
+      escapedLength = UNICODE_ESCAPE_LEN;
+      break;
+    }
+
+    if (buffer_append(dest, escaped, escapedLength) == ERR_UNRECOVERABLE) {
+      return ERR_UNRECOVERABLE;
+    }
+  }
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Reads the four hexadecimal digits of a `\uXXXX` escape
+ * @param src Position of the first digit
+ * @param code Where the value is stored
+ * @returns Whether all four digits were valid
+ */
+static bool read_hex4(const char *const src, uint32_t *const code) {
+  uint32_t value = 0;
+  for (size_t i = 0; i < 4; i++) {
+    const char c = src[i];
+    value <<= 4;
+    if (c >= '0' && c <= '9') {
+      value |= c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      value |= c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      value |= c - 'A' + 10;
+    } else {
+      return false;
+    }
+  }
+  *code = value;
+  return true;
+}
+
+/**
+ * @brief Writes a code point as UTF-8
+ * @param dest Where the bytes are written
+ * @param code Code point to encode
+ * @returns Amount of bytes written
+ */
+static size_t write_utf8(char *const dest, const uint32_t code) {
+  if (code < 0x80) {
+    dest[0] = (char)code;
+    return 1;
+  }
+  if (code < 0x800) {
+    dest[0] = (char)(0xc0 | (code >> 6));
+    dest[1] = (char)(0x80 | (code & 0x3f));
+    return 2;
+  }
+  if (code < 0x10000) {
+    dest[0] = (char)(0xe0 | (code >> 12));
+    dest[1] = (char)(0x80 | ((code >> 6) & 0x3f));
+    dest[2] = (char)(0x80 | (code & 0x3f));
+    return 3;
+  }
+  dest[0] = (char)(0xf0 | (code >> 18));
+  dest[1] = (char)(0x80 | ((code >> 12) & 0x3f));
+  dest[2] = (char)(0x80 | ((code >> 6) & 0x3f));
+  dest[3] = (char)(0x80 | (code & 0x3f));
+  return 4;
+}
+
+/**
+ * @brief Decodes a `\uXXXX` escape, combining surrogate pairs
+ * @param src Position of the backslash
+ * @param left Bytes left from the backslash on
+ * @param dest Where the UTF-8 bytes are written
+ * @param consumed Amount of escaped bytes the sequence used
+ * @returns Amount of bytes written, 0 if the escape is malformed
+ */
+static size_t decode_unicode(const char *const src, const size_t left,
+                             char *const dest, size_t *const consumed) {
+  uint32_t code = 0;
+  if (left < UNICODE_ESCAPE_LEN || !read_hex4(&src[2], &code)) {
+    return 0;
+  }
+  *consumed = UNICODE_ESCAPE_LEN;
+
+  if (code >= SURROGATE_HIGH_MIN && code <= SURROGATE_LOW_MAX) {
+    uint32_t low = 0;
+    if (code < SURROGATE_LOW_MIN && left >= 2 * UNICODE_ESCAPE_LEN &&
+        src[6] == '\\' && src[7] == 'u' && read_hex4(&src[8], &low) &&
+        low >= SURROGATE_LOW_MIN && low <= SURROGATE_LOW_MAX) {
+      code = 0x10000 + ((code - SURROGATE_HIGH_MIN) << 10) +
+             (low - SURROGATE_LOW_MIN);
+      *consumed = 2 * UNICODE_ESCAPE_LEN;
+    } else {
+      // Lone surrogates cannot be represented in UTF-8
+      code = UTF8_REPLACEMENT;
+    }
+  }
+  return write_utf8(dest, code);
+}
+
+size_t json_unescape(char *const dest, const char *const src,
+                     const size_t length) {
+  size_t read = 0;
+  size_t written = 0;
+
+  while (read < length) {
+    // memchr is vectorized by the C library, so runs without escapes are
+    // moved in bulk
+    const char *const next = memchr(&src[read], '\\', length - read);
+    const size_t run =
+        next != nullptr ? (size_t)(next - &src[read]) : length - read;
+    if (dest + written != src + read) {
+      memmove(&dest[written], &src[read], run);
+    }
+    written += run;
+    read += run;
+    if (next == nullptr || read + 1 >= length) {
+      break;
+    }
+
+    const char c = src[read + 1];
+    size_t consumed = 2;
+    switch (c) {
+    case 'n':
+      dest[written++] = '\n';
+      break;
+    case 't':
+      dest[written++] = '\t';
+      break;
+    case 'r':
+      dest[written++] = '\r';
+      break;
+    case 'b':
+      dest[written++] = '\b';
+      break;
+    case 'f':
+      dest[written++] = '\f';
+      break;
+    case 'u': {
+      const size_t utf8 =
+          decode_unicode(&src[read], length - read, &dest[written], &consumed);
+      if (utf8 == 0) {
+        // Keep malformed escapes as they are
+        dest[written++] = '\\';
+        consumed = 1;
+      }
+      written += utf8;
+      break;
+    }
+    default:
+      // Covers \" \\ \/ and keeps unknown escapes readable
+      dest[written++] = c;
+      break;
+    }
+    read += consumed;
+  }
+
+  // A trailing lone backslash is kept as it is
+  if (read < length) {
+    dest[written++] = src[read];
+  }
+  dest[written] = '\0';
+  return written;
+}
@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+#include "exec.h"
+#include "globdef.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+// Both ends of the output reach the model, the middle of a long listing
+// rarely matters
+constexpr size_t EXEC_HEAD_BYTES = 16384;
+constexpr size_t EXEC_TAIL_BYTES = 16384;
+constexpr size_t EXEC_READ_SIZE = 16384;
+constexpr int EXEC_STATUS_UNSPAWNED = -1;
+// Without pidfds, commands that closed their pipes are checked this often
+constexpr int EXEC_REAP_INTERVAL_MS = 100;
+
+/**
+ * @brief Writes a whole chunk to a descriptor, continuing after partial writes
+ * @param fd Descriptor to write to
+ * @param src Bytes to write
+ * @param length Amount of bytes
+ */
+static void write_all(const int fd, const char *src, size_t length) {
+  while (length > 0) {
+    const ssize_t written = write(fd, src, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    src += written;
+    length -= written;
+  }
+}
+
+/**
+ * @brief Shows a chunk of output on the terminal, starting every line with
+ * the number of the command when several commands share the terminal
+ * @param job Job that produced the output
+ * @param index Number of the job
+ * @param stream 0 for stdout, 1 for stderr
+ * @param chunk Output of the command
+ * @param length Length of the output
+ * @param prefix Whether lines are prefixed
+ */
+static void stream_chunk(exec_job_t *const job, const size_t index,
+                         const int stream, const char *chunk, size_t length,
+                         const bool prefix) {
+  const int fd = stream == 0 ? STDOUT_FILENO : STDERR_FILENO;
+  if (!prefix) {
+    write_all(fd, chunk, length);
+    return;
+  }
+
+  char label[32];
+  const int labelLength = snprintf(label, sizeof(label), "[%zu] ", index + 1);
+  while (length > 0) {
+    if (job->line_start[stream]) {
+      write_all(fd, label, labelLength);
+      job->line_start[stream] = false;
+    }
+    const char *const newline = memchr(chunk, '\n', length);
+    const size_t line =
+        newline != nullptr ? (size_t)(newline - chunk) + 1 : length;
+    write_all(fd, chunk, line);
+    job->line_start[stream] = newline != nullptr;
+    chunk += line;
+    length -= line;
+  }
+}
+
+/**
+ * @brief Keeps the beginning of the output and a sliding window over its end
+ * @param job Job that produced the output
+ * @param chunk Output of the command
+ * @param length Length of the output
+ * @returns The status of the operation
+ */
+static size_t capture_chunk(exec_job_t *const job, const char *chunk,
+                            size_t length) {
+  job->total += length;
+  if (job->head.length < EXEC_HEAD_BYTES) {
+    const size_t room = EXEC_HEAD_BYTES - job->head.length;
+    const size_t taken = length < room ? length : room;
+    if (buffer_append(&job->head, chunk, taken) == ERR_UNRECOVERABLE) {
+      return ERR_UNRECOVERABLE;
+    }
+    chunk += taken;
+    length -= taken;
+  }
+
+  if (length == 0) {
+    return ERR_RECOVERABLE;
+  }
+  if (buffer_append(&job->tail, chunk, length) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+
+  // Trimming only once the window doubled keeps the copies amortized
+  if (job->tail.length > EXEC_TAIL_BYTES * 2) {
+    const size_t dropped = job->tail.length - EXEC_TAIL_BYTES;
+    memmove(job->tail.data, job->tail.data + dropped, EXEC_TAIL_BYTES);
+    job->tail.length = EXEC_TAIL_BYTES;
+    job->tail.data[job->tail.length] = '\0';
+  }
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Starts a command with its output redirected into non-blocking pipes
+ * and its input read from /dev/null
+ * @param job Job holding the command
+ * @returns The status of the operation
+ */
+static size_t spawn_job(exec_job_t *const job) {
+  int pipes[2][2] = {{-1, -1}, {-1, -1}};
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  size_t status = ERR_UNRECOVERABLE;
+
+  for (size_t i = 0; i < 2; i++) {
+    if (pipe2(pipes[i], O_CLOEXEC) != 0 ||
+        fcntl(pipes[i][0], F_SETFL, O_NONBLOCK) != 0) {
+      fprintf(stderr, "Could not create the pipes of a command\n");
+      goto cleanup;
+    }
+  }
+
+  // The other ends are closed on exec, every command only sees its own pipes
+  posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null",
+                                   O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, pipes[0][1], STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&actions, pipes[1][1], STDERR_FILENO);
+
+  char *const argv[] = {"sh", "-c", (char *)job->command, nullptr};
+  if (posix_spawn(&job->pid, "/bin/sh", &actions, nullptr, argv, environ) !=
+      0) {
+    fprintf(stderr, "Could not start %s\n", job->command);
+    goto cleanup;
+  }
+
+  job->spawned = true;
+  // Kernels before 5.3 lack pidfds, the command is then polled for instead
+  job->pidfd = (int)syscall(SYS_pidfd_open, job->pid, 0);
+  for (size_t i = 0; i < 2; i++) {
+    job->fds[i] = pipes[i][0];
+    job->line_start[i] = true;
+    pipes[i][0] = -1;
+  }
+  status = ERR_RECOVERABLE;
+
+cleanup:
+  posix_spawn_file_actions_destroy(&actions);
+  for (size_t i = 0; i < 2; i++) {
+    for (size_t j = 0; j < 2; j++) {
+      if (pipes[i][j] >= 0) {
+        close(pipes[i][j]);
+      }
+    }
+  }
+  return status;
+}
+
+/**
+ * @brief Collects the exit status of a command without blocking
+ * @param job Job whose command may have exited
+ */
+static void reap_job(exec_job_t *const job) {
+  int waitStatus = 0;
+  pid_t reaped = -1;
+  while ((reaped = waitpid(job->pid, &waitStatus, WNOHANG)) < 0 &&
+         errno == EINTR) {
+  }
+  if (reaped == 0) {
+    return;
+  }
+  job->status = reaped < 0 ? EXEC_STATUS_UNSPAWNED
+                : WIFEXITED(waitStatus) ? WEXITSTATUS(waitStatus)
+                                        : 128 + WTERMSIG(waitStatus);
+  job->pid = -1;
+  if (job->pidfd >= 0) {
+    close(job->pidfd);
+    job->pidfd = -1;
+  }
+}
+
+/**
+ * @brief Kills a command that is still running, waits for it and closes its
+ * descriptors, so nothing is left behind when the commands are abandoned
+ * @param job Job to stop
+ */
+static void abandon_job(exec_job_t *const job) {
+  if (job->pid > 0) {
+    kill(job->pid, SIGKILL);
+    while (waitpid(job->pid, nullptr, 0) < 0 && errno == EINTR) {
+    }
+    job->pid = -1;
+  }
+  if (job->pidfd >= 0) {
+    close(job->pidfd);
+    job->pidfd = -1;
+  }
+  for (size_t i = 0; i < 2; i++) {
+    if (job->fds[i] >= 0) {
+      close(job->fds[i]);
+      job->fds[i] = -1;
+    }
+  }
+}
+
+size_t exec_run(exec_job_t *const jobs, const size_t count,
+                const size_t parallel) {
+  const bool prefix = parallel > 1 && count > 1;
+  // Both pipes and the pidfd of every command
+  struct pollfd *const polled = calloc(count * 3, sizeof(struct pollfd));
+  if (polled == nullptr) {
+    fprintf(stderr, "Could not allocate the command table\n");
+    return ERR_UNRECOVERABLE;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    jobs[i].pid = -1;
+    jobs[i].pidfd = -1;
+    jobs[i].fds[0] = jobs[i].fds[1] = -1;
+    jobs[i].status = EXEC_STATUS_UNSPAWNED;
+    jobs[i].spawned = false;
+    jobs[i].finished = false;
+  }
+
+  char chunk[EXEC_READ_SIZE];
+  size_t next = 0, running = 0, status = ERR_RECOVERABLE;
+  while (next < count || running > 0) {
+    while (running < (parallel > 0 ? parallel : 1) && next < count) {
+      if (spawn_job(&jobs[next]) == ERR_RECOVERABLE) {
+        running++;
+      }
+      next++;
+    }
+
+    size_t watched = 0;
+    int timeout = -1;
+    for (size_t i = 0; i < next; i++) {
+      const exec_job_t *const job = &jobs[i];
+      for (size_t j = 0; j < 2; j++) {
+        if (job->fds[j] >= 0) {
+          polled[watched++] = (struct pollfd){
+              .fd = job->fds[j],
+              .events = POLLIN,
+          };
+        }
+      }
+      if (job->pidfd >= 0) {
+        polled[watched++] = (struct pollfd){
+            .fd = job->pidfd,
+            .events = POLLIN,
+        };
+      } else if (job->pid > 0 && job->fds[0] < 0 && job->fds[1] < 0) {
+        timeout = EXEC_REAP_INTERVAL_MS;
+      }
+    }
+
+    if (watched > 0 || timeout >= 0) {
+      if (poll(polled, watched, timeout) < 0 && errno != EINTR) {
+        fprintf(stderr, "Failed to wait for the output of the commands\n");
+        status = ERR_UNRECOVERABLE;
+        break;
+      }
+    }
+
+    for (size_t i = 0; i < next; i++) {
+      exec_job_t *const job = &jobs[i];
+      for (size_t j = 0; j < 2; j++) {
+        while (job->fds[j] >= 0) {
+          const ssize_t length = read(job->fds[j], chunk, sizeof(chunk));
+          if (length < 0 && (errno == EAGAIN || errno == EINTR)) {
+            break;
+          }
+          if (length <= 0) {
+            close(job->fds[j]);
+            job->fds[j] = -1;
+            break;
+          }
+          stream_chunk(job, i, j, chunk, length, prefix);
+          if (capture_chunk(job, chunk, length) == ERR_UNRECOVERABLE) {
+            status = ERR_UNRECOVERABLE;
+          }
+        }
+      }
+
+      // A command that closed its pipes may still run, it never blocks the
+      // output of the others
+      if (job->pid > 0) {
+        reap_job(job);
+      }
+
+      // The command is done once it exited and closed both of its pipes
+      if (job->spawned && !job->finished && job->pid < 0 &&
+          job->fds[0] < 0 && job->fds[1] < 0) {
+        job->finished = true;
+        running--;
+        if (prefix) {
+          for (size_t j = 0; j < 2; j++) {
+            if (!job->line_start[j]) {
+              write_all(j == 0 ? STDOUT_FILENO : STDERR_FILENO, "\n", 1);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  for (size_t i = 0; i < next; i++) {
+    abandon_job(&jobs[i]);
+  }
+  free(polled);
+  return status;
+}
+
+size_t exec_output(const exec_job_t *const job, buffer_t *const dest) {
+  if (!job->spawned) {
+    return buffer_printf(dest, "(the command could not be started)");
+  }
+  if (buffer_append(dest, job->head.data, job->head.length) ==
+      ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+  if (job->tail.length == 0) {
+    return ERR_RECOVERABLE;
+  }
+
+  const size_t kept =
+      job->tail.length < EXEC_TAIL_BYTES ? job->tail.length : EXEC_TAIL_BYTES;
+  const size_t omitted = job->total - job->head.length - kept;
+  if (omitted > 0 &&
+      buffer_printf(dest, "\n[... %zu bytes omitted ...]\n", omitted) ==
+          ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+  return buffer_append(dest, job->tail.data + job->tail.length - kept, kept);
+}
+
+void exec_job_free(exec_job_t *const job) {
+  buffer_free(&job->head);
+  buffer_free(&job->tail);
+}
@@ -0,0 +1,111 @@
+#include "jsonscan.h"
+#include <stddef.h>
+
+const char *json_skip_space(const char *cursor, const char *const end) {
+  while (cursor < end && (*cursor == ' ' || *cursor == '\t' ||
+                          *cursor == '\n' || *cursor == '\r')) {
+    cursor++;
+  }
+  return cursor;
+}
+
+const char *json_scan_string(const char *cursor, const char *const end) {
+  for (cursor++; cursor < end; cursor++) {
+    if (*cursor == '\\') {
+      cursor++;
+    } else if (*cursor == '"') {
+      return cursor;
+    }
+  }
+  return nullptr;
+}
+
+const char *json_skip_value(const char *cursor, const char *const end) {
+  size_t depth = 0;
+  while (cursor < end) {
+    switch (*cursor) {
+    case '"':
+      if ((cursor = json_scan_string(cursor, end)) == nullptr) {
+        return nullptr;
+      }
+      break;
+    case '{':
+    case '[':
+      depth++;
+      break;
+    case '}':
+    case ']':
+      if (depth == 0) {
+        return cursor;
+      }
+      if (--depth == 0) {
+        return cursor + 1;
+      }
+      break;
+    case ',':
+      if (depth == 0) {
+        return cursor;
+      }
+      break;
+    default:
+      break;
+    }
+    cursor++;
+  }
+  return depth == 0 ? cursor : nullptr;
+}
+
+const char *json_object_each(const char *cursor, const char *const end,
+                             const json_member_cb_t on_member,
+                             void *const data) {
+  cursor = json_skip_space(cursor, end);
+  if (cursor >= end || *cursor++ != '{') {
+    return nullptr;
+  }
+
+  while ((cursor = json_skip_space(cursor, end)) < end && *cursor != '}') {
+    const char *const close =
+        *cursor == '"' ? json_scan_string(cursor, end) : nullptr;
+    if (close == nullptr) {
+      return nullptr;
+    }
+
+    const char *const key = cursor + 1;
+    cursor = json_skip_space(close + 1, end);
+    if (cursor >= end || *cursor++ != ':') {
+      return nullptr;
+    }
+
+    cursor = json_skip_space(cursor, end);
+    if ((cursor = on_member(key, close - key, cursor, end, data)) == nullptr) {
+      return nullptr;
+    }
+
+    cursor = json_skip_space(cursor, end);
+    if (cursor < end && *cursor == ',') {
+      cursor++;
+    }
+  }
+  return cursor < end ? cursor + 1 : nullptr;
+}
+
+const char *json_array_each(const char *cursor, const char *const end,
+                            const json_element_cb_t on_element,
+                            void *const data) {
+  cursor = json_skip_space(cursor, end);
+  if (cursor >= end || *cursor++ != '[') {
+    return nullptr;
+  }
+
+  while ((cursor = json_skip_space(cursor, end)) < end && *cursor != ']') {
+    if ((cursor = on_element(cursor, end, data)) == nullptr) {
+      return nullptr;
+    }
+
+    cursor = json_skip_space(cursor, end);
+    if (cursor < end && *cursor == ',') {
+      cursor++;
+    }
+  }
+  return cursor < end ? cursor + 1 : nullptr;
+}
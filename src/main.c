@@ -1,6 +1,13 @@
+#include "batch.h"
+#include "buffer.h"
 #include "completions.h"
 #include "config.h"
+#include "daemon.h"
+#include "editor.h"
+#include "escape.h"
+#include "exec.h"
 #include "globdef.h"
+#include "render.h"
 #include "utils.h"
 #include <signal.h>
 #include <stdint.h>
@@ -9,31 +16,64 @@
 #include <stdlib.h>
 #include <string.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 constexpr uint8_t ARG_FLAG_POSITION = 1;
+constexpr char FLAG_PREFIX = '-';
 constexpr uint8_t COMMAND_MIN_LEN = 2;
 constexpr uint8_t COMMAND_DELIMITER = '`';
+constexpr size_t FENCE_LEN = 3;
+constexpr size_t MAX_COMMANDS = 16;
+constexpr size_t DEFAULT_BATCH_PARALLEL = 8;
 constexpr uint8_t HELP_TABLE[] =
     "+----------------+---------------------------------+\n"
     "| Short-form     | Purpose                         |\n"
     "+----------------+---------------------------------+\n"
     "| -i             | Enters interactive mode         |\n"
     "| -h             | Shows a table with all commands |\n"
+    "| -v             | Reports connections and tokens  |\n"
+    "| -b <file>      | Runs prompts from a JSONL file  |\n"
+    "| -j <n>         | Parallel requests in batch mode |\n"
+    "| -s <name>      | Resumes or starts a named chat  |\n"
+    "| -d             | Answers prompts as a daemon     |\n"
+    "| --stats[=json] | Times every phase of a turn     |\n"
     "+----------------+---------------------------------+\n";
 
 typedef struct {
   bool interactive_mode;
   bool help_mode;
+  bool verbose_mode;
+  const char *prompt;
+  const char *batch_path;
+  size_t batch_parallel;
+  const char *session_name;
+  bool stats_mode;
+  bool stats_json;
+  bool daemon_mode;
 } term_params_t;
 
 typedef enum : uint8_t {
   term_flag_none,
   term_flag_help,
-  term_flag_interactive
+  term_flag_interactive,
+  term_flag_verbose,
+  term_flag_batch,
+  term_flag_parallel,
+  term_flag_session,
+  term_flag_stats,
+  term_flag_stats_json,
+  term_flag_daemon
 } term_flag_t;
 
 static volatile bool g_keep_alive = true;
+static term_renderer_t g_renderer = {};
+static editor_t g_editor = {.fd = -1};
+// Whether a streamed answer is being written, text typed ahead is then drawn
+// below it
+static bool g_streaming = false;
+// Session the daemon answered the last prompt of, its context is kept
+static char *g_served_session = nullptr;
 
 /**
  * @brief Get the code for the specific parameter
@@ -44,6 +84,13 @@ static term_flag_t get_flag_code(const char *const src) {
   term_flag_t status = term_flag_none;
   status += !!(strcmp(src, "-i") == 0) * term_flag_interactive;
   status += !!(strcmp(src, "-h") == 0) * term_flag_help;
+  status += !!(strcmp(src, "-v") == 0) * term_flag_verbose;
+  status += !!(strcmp(src, "-b") == 0) * term_flag_batch;
+  status += !!(strcmp(src, "-j") == 0) * term_flag_parallel;
+  status += !!(strcmp(src, "-s") == 0) * term_flag_session;
+  status += !!(strcmp(src, "--stats") == 0) * term_flag_stats;
+  status += !!(strcmp(src, "--stats=json") == 0) * term_flag_stats_json;
+  status += !!(strcmp(src, "-d") == 0) * term_flag_daemon;
   return status;
 }
 
@@ -55,154 +102,237 @@ static term_flag_t get_flag_code(const char *const src) {
  */
 static void get_parameters(const int argc, const char *const *argv,
                            term_params_t *const params) {
-  if (argc <= ARG_FLAG_POSITION) {
-    return;
-  }
-
-  const char *const param = argv[ARG_FLAG_POSITION];
-  const term_flag_t argument = get_flag_code(param);
-  switch (argument) {
-  default:
-  case term_flag_none:
-    // No need to do anything here; just process the prompt normally
-    break;
-  case term_flag_help:
-    params->help_mode = true;
-    break;
-  case term_flag_interactive:
-    params->interactive_mode = true;
-    break;
-  }
-}
+  for (int i = ARG_FLAG_POSITION; i < argc; i++) {
+    const char *const param = argv[i];
+    if (param[0] != FLAG_PREFIX) {
+      // The first argument that is not a flag is the prompt
+      if (params->prompt == nullptr) {
+        params->prompt = param;
+      }
+      continue;
+    }
 
-/**
- * @brief Unescape a string passed by argument
- * @param input String to unescape
- * @param match delimiter to look out for
- * @returns The status of the operation
- */
-static size_t unescape_string(char *const input, const char match) {
-  int length = strlen(input);
-  for (int i = 0; i < length; i++) {
-    if (input[i] == '\\' && i + 1 < length && input[i + 1] == match) {
-      memcpy(&input[i], &input[i + 1], --length);
-      i--;
-      input[length] = '\0';
+    const term_flag_t argument = get_flag_code(param);
+    switch (argument) {
+    default:
+    case term_flag_none:
+      // Unknown flags are treated as part of the prompt
+      if (params->prompt == nullptr) {
+        params->prompt = param;
+      }
+      break;
+    case term_flag_help:
+      params->help_mode = true;
+      break;
+    case term_flag_interactive:
+      params->interactive_mode = true;
+      break;
+    case term_flag_verbose:
+      params->verbose_mode = true;
+      break;
+    case term_flag_batch:
+      if (i + 1 < argc) {
+        params->batch_path = argv[++i];
+      }
+      break;
+    case term_flag_parallel:
+      if (i + 1 < argc) {
+        const long parallel = strtol(argv[++i], nullptr, 10);
+        params->batch_parallel = parallel > 0 ? (size_t)parallel : 0;
+      }
+      break;
+    case term_flag_session:
+      if (i + 1 < argc) {
+        params->session_name = argv[++i];
+      }
+      break;
+    case term_flag_stats_json:
+      params->stats_json = true;
+      [[fallthrough]];
+    case term_flag_stats:
+      params->stats_mode = true;
+      break;
+    case term_flag_daemon:
+      params->daemon_mode = true;
+      break;
     }
   }
-  return ERR_RECOVERABLE;
 }
 
 /**
- * @brief Get a substring inside a string into the dest pointer
+ * @brief Collects every command inside the src string. A command is defined
+ * as being any substring between two backticks (e.g. `mkdir build`). Fenced
+ * code blocks are skipped.
  * @param src Source string which contains the entire content
- * @param dest Destination string where the substring will reside
- * @returns The status of the operation
+ * @param storage Buffer receiving the commands, each null terminated
+ * @param offsets Start of every command inside the storage
+ * @returns The amount of commands, at most MAX_COMMANDS
  */
-static size_t get_executable_command(const char *const src, char *const dest) {
-  const int len = strlen(src);
-  int start = -1, end = -1;
-  for (int i = 0; i < len; i++) {
-    if (src[i] == COMMAND_DELIMITER) {
-      if (start < 0) {
-        start = i;
-        continue;
+static size_t get_executable_commands(const char *const src,
+                                      buffer_t *const storage,
+                                      size_t *const offsets) {
+  buffer_clear(storage);
+  size_t count = 0;
+  const char *cursor = src;
+  while (count < MAX_COMMANDS &&
+         (cursor = strchr(cursor, COMMAND_DELIMITER)) != nullptr) {
+    const size_t run = strspn(cursor, (const char[]){COMMAND_DELIMITER, 0});
+    if (run >= FENCE_LEN) {
+      const char *const fenceEnd = strstr(cursor + run, "```");
+      if (fenceEnd == nullptr) {
+        break;
       }
+      cursor = fenceEnd + strspn(fenceEnd, (const char[]){COMMAND_DELIMITER, 0});
+      continue;
+    }
 
-      end = i;
+    const char *const start = cursor + run;
+    const char *const end = strchr(start, COMMAND_DELIMITER);
+    if (end == nullptr) {
       break;
     }
-  }
+    cursor = end + 1;
 
-  const int size = end - start;
-  if (start < 0 || end < 0 || size > MAX_BUFF_SIZE || size < COMMAND_MIN_LEN) {
-    return ERR_UNRECOVERABLE;
+    const size_t size = end - start;
+    if (run != 1 || size + 1 < COMMAND_MIN_LEN || size >= MAX_BUFF_SIZE) {
+      continue;
+    }
+    offsets[count++] = storage->length;
+    if (buffer_append(storage, start, size) == ERR_UNRECOVERABLE ||
+        buffer_append(storage, "", 1) == ERR_UNRECOVERABLE) {
+      return 0;
+    }
   }
-
-  memcpy(dest, &src[start + 1], size - 1);
-  dest[size - 1] = '\0';
-  return ERR_RECOVERABLE;
+  return count;
 }
 
 /**
- * @brief Replaces all instances of a char with another in a string
- * @param string String to analyse and modify
- * @param target The char that should be replaced
- * @param repalce The new char to be inserted
+ * @brief Asks whether a command may run with a single keypress
+ * @param model String containing the name of the LLM model
+ * @param command Command to run
+ * @returns The key that was pressed
  */
-static void replace_chars_in_string(term_string_t *const string,
-                                    const term_code_t target,
-                                    const term_code_t replace) {
-  for (size_t i = 0; i < string->length; i++) {
-    if (string->text[i] == target) {
-      string->text[i] = replace;
-    }
+static char ask_permission(const char *const model, const char *const command) {
+  term_string_t string = {.length = 0};
+  const char *const condition = " would like to execute (Y/n/a): ";
+  if (merge_strings(&string, 4, "> ", model, condition, command) ==
+      ERR_UNRECOVERABLE) {
+    fprintf(stderr, "Failed to merge strings to show executable command\n");
+    return 'n';
   }
+
+  term_print_color(string, term_color_red);
+  // Read past stdio, which would buffer the keystrokes typed after this one
+  char key = 'n';
+  return read(STDIN_FILENO, &key, 1) == 1 ? key : 'n';
 }
 
 /**
- * @brief Searches and executes the first instance of a command inside the src
- * string. A command is defined as being any substring between two backticks
- * (e.g. `mkdir build`)
+ * @brief Searches every command inside the src string and executes the ones
+ * the user approves, several at once when `exec_parallel` allows it. Their
+ * output is shown while they run and added to the context afterwards.
  *
- * @param src The source string containing the command within
- * @param model String containing the name of the LLM model
+ * @param src The source string containing the commands within
+ * @param config Configuration naming the model and the parallelism
  */
 static size_t process_string_command(const char *const src,
-                                     const char *const model) {
-  char command[MAX_BUFF_SIZE];
-  if (get_executable_command(src, command) == ERR_RECOVERABLE) {
-    term_string_t string = {.length = 0};
-    const char *const condition = " would like to execute (Y/n): ";
-    if (merge_strings(&string, 4, "> ", model, condition, command) ==
-        ERR_UNRECOVERABLE) {
-      fprintf(stderr, "Failed to merge strings to show executable command\n");
-      return ERR_UNRECOVERABLE;
-    }
-
-    term_print_color(string, term_color_red);
-
-    // Process the next keypress without needing to press enter
-    struct termios old_termios, new_termios;
-    tcgetattr(STDIN_FILENO, &old_termios);
-    new_termios = old_termios;
-    new_termios.c_lflag &= ~(ICANON | ECHO);
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
-
-    const char next_char = getchar();
-    if (next_char == 'y' || next_char == 'Y') {
-      FILE *file = nullptr;
-      if ((file = popen(command, "r")) == nullptr) {
-        fprintf(stderr, "Failed to execute command\n");
-        return ERR_UNRECOVERABLE;
-      }
+                                     const termchat_config_t *const config) {
+  static buffer_t storage = {};
+  size_t offsets[MAX_COMMANDS];
+  const size_t count = get_executable_commands(src, &storage, offsets);
+  if (count == 0) {
+    return ERR_RECOVERABLE;
+  }
 
-      char output[MAX_BUFF_SIZE];
-      while (fgets(output, MAX_BUFF_SIZE, file) != NULL) {
-        printf("%s", output);
-      }
+  // Keystrokes typed ahead belong to the next prompt, not to the question
+  editor_drain(&g_editor);
+
+  // Process the next keypress without needing to press enter
+  struct termios old_termios, new_termios;
+  tcgetattr(STDIN_FILENO, &old_termios);
+  new_termios = old_termios;
+  new_termios.c_lflag &= ~(ICANON | ECHO);
+  tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+
+  exec_job_t jobs[MAX_COMMANDS] = {};
+  size_t approved = 0;
+  bool approve_all = false;
+  for (size_t i = 0; i < count; i++) {
+    const char *const command = storage.data + offsets[i];
+    const char key = approve_all ? 'y' : ask_permission(config->model, command);
+    approve_all = approve_all || key == 'a' || key == 'A';
+    if (key == 'y' || key == 'Y' || approve_all) {
+      jobs[approved++].command = command;
+    }
+  }
 
-      term_string_t str = {.length = 0};
-      if (merge_strings(&str, 2, "Resource:", output) == ERR_UNRECOVERABLE) {
-        fprintf(stderr, "Failed to merge resource with command string\n");
-        return ERR_UNRECOVERABLE;
-      }
+  // Reverting the changes made to the terminal above
+  tcsetattr(STDIN_FILENO, TCSANOW, &old_termios);
+  if (approved == 0) {
+    return ERR_RECOVERABLE;
+  }
 
-      replace_chars_in_string(&str, term_code_newline, term_code_space);
+  const size_t parallel =
+      config->exec_parallel > 1 ? (size_t)config->exec_parallel : 1;
+  if (parallel > 1 && approved > 1) {
+    for (size_t i = 0; i < approved; i++) {
+      printf("[%zu] %s\n", i + 1, jobs[i].command);
+    }
+  }
 
-      if (add_context(str.text, role_type_developer) == ERR_UNRECOVERABLE) {
-        fprintf(stderr, "Command could not be added to context history\n");
-        return ERR_UNRECOVERABLE;
-      }
+  // Text printed through stdio must come out before the command output
+  fflush(stdout);
+  size_t status = exec_run(jobs, approved, parallel);
 
-      pclose(file);
+  static buffer_t resource = {};
+  for (size_t i = 0; i < approved && status == ERR_RECOVERABLE; i++) {
+    buffer_clear(&resource);
+    if (jobs[i].status != 0) {
+      fprintf(stderr, "> `%s` exited with status %d\n", jobs[i].command,
+              jobs[i].status);
+    }
+    if (buffer_printf(&resource, "Resource: `%s` exited with status %d\n",
+                      jobs[i].command, jobs[i].status) == ERR_UNRECOVERABLE ||
+        exec_output(&jobs[i], &resource) == ERR_UNRECOVERABLE ||
+        add_context(resource.data, role_type_developer) == ERR_UNRECOVERABLE) {
+      fprintf(stderr, "Command could not be added to context history\n");
+      status = ERR_UNRECOVERABLE;
     }
+  }
 
-    // Reverting the changes made to the terminal above
-    tcsetattr(STDIN_FILENO, TCSANOW, &old_termios);
+  for (size_t i = 0; i < approved; i++) {
+    exec_job_free(&jobs[i]);
   }
+  return status;
+}
 
-  return ERR_RECOVERABLE;
+/**
+ * @brief Draws the line typed ahead below a streamed answer. Only done at the
+ * start of a line, so the answer never has to be interrupted mid-line.
+ */
+static void preview_typed_ahead() {
+  if (g_streaming && g_renderer.tty && g_renderer.line_start) {
+    editor_preview(&g_editor);
+    // The preview resets the colors of the terminal
+    g_renderer.open = false;
+  }
+}
+
+/**
+ * @brief Renders a fragment of a streamed response as soon as it arrives
+ * @param fragment Unescaped content of the fragment
+ * @param length Length of the fragment
+ * @param data Unused
+ */
+static void on_stream_delta(const char *const fragment, const size_t length,
+                            void *const) {
+  if (render_markdown(&g_renderer, fragment, length) == ERR_UNRECOVERABLE ||
+      g_renderer.out.length == 0) {
+    return;
+  }
+  editor_clear_preview(&g_editor);
+  render_flush(&g_renderer);
+  preview_typed_ahead();
 }
 
 /**
@@ -216,39 +346,187 @@ static void clear_terminal() { printf("\e[1;1H\e[2J"); }
  */
 static void on_sigint_received(int) {
   g_keep_alive = false;
+  // Buffers must not be released from inside the handler
+  editor_restore(&g_editor);
   clear_terminal();
   exit(0);
 }
 
 /**
- * @brief Get the next line from stdin
- * @param dest Destination pointer where the string will be saved
+ * @brief Consumes keystrokes for the next prompt, whether it is being typed
+ * or an answer is still arriving
+ * @param fd Descriptor of the terminal
+ * @param data Editor receiving the keystrokes
+ * @returns True once a prompt is complete or the input ended
+ */
+static bool on_editor_input(const int, void *const data) {
+  editor_t *const editor = (editor_t *)data;
+  editor_feed(editor);
+  preview_typed_ahead();
+  if (editor->closed) {
+    // The end of the input stays readable, watching it would spin
+    completions_watch_input(-1, nullptr, nullptr);
+  }
+  return editor_has_line(editor) || editor->closed;
+}
+
+/**
+ * @brief Gets the next prompt of interactive mode. A prompt that was
+ * finished while the last answer arrived is taken right away, otherwise the
+ * editor is shown with whatever was typed ahead until a prompt is complete.
+ * @param config Configuration of the session
+ * @param print_model Whether the prompt shows the model
+ * @param dest Destination of the prompt
+ * @param len Size of the destination
+ * @returns The status of the operation
  */
-static size_t get_next_line(char *const dest, const size_t len) {
-  if (fgets(dest, len, stdin) == nullptr) {
+static size_t get_next_prompt(const termchat_config_t *const config,
+                              const bool print_model, char *const dest,
+                              const size_t len) {
+  const bool typedAhead = editor_has_line(&g_editor);
+  if (print_model || typedAhead) {
+    printf("(%s)> ", config->model);
+    fflush(stdout);
+  }
+
+  if (!typedAhead) {
+    editor_show(&g_editor);
+    if (completions_await_input(config, STDIN_FILENO) == ERR_UNRECOVERABLE) {
+      fprintf(stderr, "Failed to wait for the next line\n");
+      return ERR_UNRECOVERABLE;
+    }
+    while (!editor_has_line(&g_editor) && !g_editor.closed) {
+      if (editor_wait(&g_editor) == ERR_UNRECOVERABLE) {
+        fprintf(stderr, "Failed to wait for the next line\n");
+        return ERR_UNRECOVERABLE;
+      }
+    }
+  }
+
+  editor_hide(&g_editor);
+  if (editor_take_line(&g_editor, dest, len) == ERR_UNRECOVERABLE) {
     fprintf(stderr, "Failed to read next line\n");
     return ERR_UNRECOVERABLE;
   }
-  dest[strcspn(dest, "\n")] = 0;
+  if (typedAhead) {
+    // The prompt was not echoed while it was typed
+    printf("%s\n", dest);
+  }
   return ERR_RECOVERABLE;
 }
 
 /**
- * @brief Event loop of the entire application if started with the '-i' flag
- * @param argv Array of string arguments
- * @param params Struct containing all parameters of the application
- * @returns The status of the operation
+ * @brief Prints the tokens of the last turn and of the whole session, and
+ * their cost when the prices are configured
+ * @param config Configuration holding the prices
+ * @param estimate Tokens the local tokenizer counted for the request
  */
-static size_t event_loop(const char *const *argv,
-                         const term_params_t *const params) {
-  if (params->interactive_mode == true) {
-    clear_terminal();
-    signal(SIGINT, on_sigint_received);
+static void report_usage(const termchat_config_t *const config,
+                         const size_t estimate) {
+  const completion_usage_t *const usage = completions_usage();
+  const completion_usage_t *const total = completions_usage_total();
+  if (usage->reported) {
+    fprintf(stderr, "Tokens: %lld prompt (%lld cached), %lld completion",
+            (long long)usage->prompt_tokens, (long long)usage->cached_tokens,
+            (long long)usage->completion_tokens);
+  } else {
+    fprintf(stderr, "Tokens: not reported");
+  }
+  if (estimate != CONTEXT_TOKENS_UNKNOWN) {
+    fprintf(stderr, ", %zu prompt estimated", estimate);
   }
+  fprintf(stderr, "\n");
 
-  bool print_model = true;
-  char filepath[MAX_BUFF_SIZE];
+  if (!total->reported) {
+    return;
+  }
+  fprintf(stderr, "Session: %lld prompt (%lld cached), %lld completion",
+          (long long)total->prompt_tokens, (long long)total->cached_tokens,
+          (long long)total->completion_tokens);
+  if (config->input_cost > 0 || config->output_cost > 0) {
+    // Prices are given in dollars per million tokens
+    const double uncached = total->prompt_tokens - total->cached_tokens;
+    const double cost = (uncached * config->input_cost +
+                         total->cached_tokens * config->cached_input_cost +
+                         total->completion_tokens * config->output_cost) /
+                        1e6;
+    fprintf(stderr, ", $%.4f", cost);
+  }
+  fprintf(stderr, "\n");
+}
+
+/**
+ * @brief Reads the monotonic clock
+ * @returns Microseconds since an arbitrary point in the past
+ */
+static int64_t now_us() {
+  struct timespec now = {};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**
+ * @brief Prints how long every phase of the last turn took, either as a
+ * compact line or as a JSON object
+ * @param json Whether the phases are printed as JSON
+ * @param total_us Duration of the whole turn
+ * @param parse_us Time spent parsing the response outside the client
+ * @param render_us Time spent rendering the response outside the client
+ */
+static void report_stats(const bool json, const int64_t total_us,
+                         const int64_t parse_us, const int64_t render_us) {
+  const completion_stats_t *const stats = completions_stats();
+  const struct {
+    const char *name;
+    int64_t us;
+  } phases[] = {
+      {"build", stats->build_us},
+      {"dns", stats->dns_us},
+      {"connect", stats->connect_us},
+      {"tls", stats->tls_us},
+      {"wait", stats->wait_us},
+      {"transfer", stats->transfer_us},
+      {"parse", stats->parse_us + parse_us},
+      {"render", stats->render_us + render_us},
+      {"total", total_us},
+  };
+  const size_t count = sizeof(phases) / sizeof(phases[0]);
+
+  fprintf(stderr, json ? "{" : "Stats:");
+  for (size_t i = 0; i < count; i++) {
+    fprintf(stderr, json ? "\"%s_ms\":%.3f," : " %s %.2f ms", phases[i].name,
+            phases[i].us / 1e3);
+  }
+  if (json) {
+    fprintf(stderr,
+            "\"upload_bytes\":%lld,\"download_bytes\":%lld,"
+            "\"retries\":%lld,\"reused\":%s,\"cached\":%s,"
+            "\"hedged\":%s,\"compressed\":%s}\n",
+            (long long)stats->upload_bytes, (long long)stats->download_bytes,
+            (long long)stats->retries, stats->reused ? "true" : "false",
+            stats->cached ? "true" : "false",
+            stats->hedged ? "true" : "false",
+            stats->compressed ? "true" : "false");
+    return;
+  }
+  fprintf(stderr, ", %lld B up%s, %lld B down%s%s%s",
+          (long long)stats->upload_bytes,
+          stats->compressed ? " compressed" : "",
+          (long long)stats->download_bytes, stats->reused ? ", reused" : "",
+          stats->cached ? ", cached" : "", stats->hedged ? ", hedged" : "");
+  if (stats->retries > 0) {
+    fprintf(stderr, ", %lld retries", (long long)stats->retries);
+  }
+  fprintf(stderr, "\n");
+}
 
+/**
+ * @brief Loads the rc file of the user
+ * @param config Configuration to fill
+ * @returns The status of the operation
+ */
+static size_t load_config(termchat_config_t *const config) {
+  char filepath[MAX_BUFF_SIZE];
   if (get_rc_path(filepath, MAX_BUFF_SIZE) == ERR_UNRECOVERABLE) {
     fprintf(stderr, "Failed to get config file directory\n");
     return ERR_UNRECOVERABLE;
@@ -259,52 +537,49 @@ static size_t event_loop(const char *const *argv,
     return ERR_UNRECOVERABLE;
   }
 
-  char config[MAX_BUFF_SIZE];
-  if (get_rc_contents(filepath, config, sizeof(config)) == ERR_UNRECOVERABLE) {
+  if (config_load(filepath, config) == ERR_UNRECOVERABLE) {
     fprintf(stderr, "Failed to get config file contents\n");
     return ERR_UNRECOVERABLE;
   }
+  return ERR_RECOVERABLE;
+}
 
-  char api_key[MAX_BUFF_SIZE];
-  if (get_json_value(config, "openai", api_key) <= 0) {
-    fprintf(stderr, "Failed to get the api key from the config file\n");
-    return ERR_UNRECOVERABLE;
-  }
-
-  char model[MAX_BUFF_SIZE];
-  const int model_size = get_json_value(config, "model", model);
-  if (model_size <= 0) {
-    fprintf(stderr, "Failed to get gpt model from config file\n");
-    return ERR_UNRECOVERABLE;
+/**
+ * @brief Event loop of the entire application if started with the '-i' flag
+ * @param params Struct containing all parameters of the application
+ * @param config Configuration of the session
+ * @returns The status of the operation
+ */
+static size_t event_loop(const term_params_t *const params,
+                         const termchat_config_t *const config) {
+  if (params->interactive_mode == true) {
+    clear_terminal();
+    signal(SIGINT, on_sigint_received);
+    if (editor_open(&g_editor, STDIN_FILENO) == ERR_UNRECOVERABLE) {
+      return ERR_UNRECOVERABLE;
+    }
+    // The next prompt can be typed while an answer is still arriving
+    completions_watch_input(STDIN_FILENO, on_editor_input, &g_editor);
   }
 
-  char role[MAX_BUFF_SIZE];
-  if (get_json_value(config, "role", role) <= 0) {
-    fprintf(stderr, "Failed to get role from config file\n");
-    return ERR_UNRECOVERABLE;
-  }
+  bool print_model = true;
 
-  char instruction[MAX_BUFF_SIZE];
-  if (get_json_value(config, "instruction", instruction) <= 0) {
-    fprintf(stderr, "Failed to get instruction from config file\n");
-    return ERR_UNRECOVERABLE;
-  }
+  // Both buffers keep their storage between turns
+  static buffer_t prompt_output = {};
+  static buffer_t content = {};
 
   while (g_keep_alive) {
     char prompt_input[MAX_BUFF_SIZE] = {};
     if (params->interactive_mode) {
-      if (print_model) {
-        printf("(%s)> ", model);
-      }
-
-      if (get_next_line(prompt_input, MAX_BUFF_SIZE)) {
+      if (get_next_prompt(config, print_model, prompt_input,
+                          MAX_BUFF_SIZE) == ERR_UNRECOVERABLE) {
         fprintf(stderr, "Failed to put next line into buffer\n");
         return ERR_UNRECOVERABLE;
       }
 
       print_model = true;
     } else {
-      if (snprintf(prompt_input, MAX_BUFF_SIZE, "%s", argv[1]) < 0) {
+      if (snprintf(prompt_input, MAX_BUFF_SIZE, "%s", params->prompt) < 0) {
         fprintf(stderr, "Failed to fit argument into prompt input\n");
         return ERR_UNRECOVERABLE;
       }
@@ -316,45 +591,107 @@ static size_t event_loop(const char *const *argv,
       continue;
     }
 
-    char prompt_output[MAX_BUFF_SIZE];
-    if (get_prompt_response(api_key, model, role, instruction,
-                            params->interactive_mode == false ? argv[1]
-                                                              : prompt_input,
-                            prompt_output) == ERR_UNRECOVERABLE) {
-      fprintf(stderr,
-              "Could not get a response from the OpenAI Completions API\n");
-      return ERR_UNRECOVERABLE;
+    const char *const input =
+        params->interactive_mode == false ? params->prompt : prompt_input;
+    const int64_t turnStarted = now_us();
+    int64_t parseUs = 0;
+    if (config->stream) {
+      render_init(&g_renderer, STDOUT_FILENO);
+      g_streaming = params->interactive_mode;
+      const size_t streamStatus = get_prompt_stream(
+          config, input, on_stream_delta, nullptr, &content);
+      g_streaming = false;
+      editor_clear_preview(&g_editor);
+      if (streamStatus == ERR_UNRECOVERABLE) {
+        fprintf(stderr,
+                "Could not get a response from the OpenAI Completions API\n");
+        // Requests are retried already, the session survives a failed turn
+        if (completions_discard_turn() == ERR_UNRECOVERABLE) {
+          return ERR_UNRECOVERABLE;
+        }
+        if (params->interactive_mode) {
+          continue;
+        }
+        return ERR_UNRECOVERABLE;
+      }
+    } else {
+      if (get_prompt_response(config, input, &prompt_output) ==
+          ERR_UNRECOVERABLE) {
+        fprintf(stderr,
+                "Could not get a response from the OpenAI Completions API\n");
+        // Requests are retried already, the session survives a failed turn
+        if (completions_discard_turn() == ERR_UNRECOVERABLE) {
+          return ERR_UNRECOVERABLE;
+        }
+        if (params->interactive_mode) {
+          continue;
+        }
+        return ERR_UNRECOVERABLE;
+      }
+
+      // The response was parsed once while it was received
+      const int64_t parseStarted = now_us();
+      const response_fields_t *const fields = completions_response();
+      buffer_clear(&content);
+      if (fields->content == nullptr ||
+          buffer_reserve(&content, fields->content_length) ==
+              ERR_UNRECOVERABLE) {
+        if (fields->error != nullptr) {
+          fprintf(stderr, "The API answered with an error: %.*s\n",
+                  (int)fields->error_length, fields->error);
+        } else {
+          fprintf(stderr,
+                  "Could not parse JSON response into a readable format. "
+                  "Attempted to parse %s\n",
+                  prompt_output.data);
+        }
+        if (completions_discard_turn() == ERR_UNRECOVERABLE) {
+          return ERR_UNRECOVERABLE;
+        }
+        if (params->interactive_mode) {
+          continue;
+        }
+        return ERR_UNRECOVERABLE;
+      }
+      content.length =
+          json_unescape(content.data, fields->content, fields->content_length);
+      parseUs = now_us() - parseStarted;
     }
 
-    char content[MAX_BUFF_SIZE];
-    if (!get_json_value(prompt_output, "content", content)) {
-      fprintf(stderr,
-              "Could not parse JSON response into a readable format. Attempted "
-              "to parse %s\n",
-              prompt_output);
-      return ERR_UNRECOVERABLE;
+    if (params->verbose_mode) {
+      if (completions_stats()->cached) {
+        fprintf(stderr, "Served from the response cache\n");
+      } else {
+        fprintf(stderr, "Connection reused: %s\n",
+                completions_connection_reused() ? "yes" : "no");
+      }
+      // The context still holds exactly the messages that were sent
+      report_usage(config, completions_count_tokens(config));
     }
 
-    if (add_context(content, role_type_assistant) == ERR_UNRECOVERABLE) {
+    if (add_context(content.data, role_type_assistant) == ERR_UNRECOVERABLE) {
       fprintf(stderr, "Could not capture response to window context\n");
       return ERR_UNRECOVERABLE;
     }
 
-    if (unescape_string(content, '"') == ERR_UNRECOVERABLE) {
-      fprintf(stderr, "Failed to unescape string\n");
-      return ERR_UNRECOVERABLE;
+    const int64_t renderStarted = now_us();
+    if (!config->stream) {
+      render_init(&g_renderer, STDOUT_FILENO);
+      render_markdown(&g_renderer, content.data, content.length);
     }
-
-    term_string_t printableString = {.length = 0};
-
-    if (merge_strings(&printableString, 2, content, "\n") ==
-        ERR_UNRECOVERABLE) {
-      fprintf(stderr, "Could not merge content string and newline\n");
-      return ERR_UNRECOVERABLE;
+    // Streamed fragments were rendered while they arrived
+    render_finish(&g_renderer);
+    printf("\n\n");
+
+    if (params->stats_mode) {
+      fflush(stdout);
+      const int64_t now = now_us();
+      report_stats(params->stats_json, now - turnStarted, parseUs,
+                   now - renderStarted);
     }
-    term_print_color(printableString, term_color_green);
 
-    if (process_string_command(content, model) == ERR_UNRECOVERABLE) {
+    if (process_string_command(content.data, config) ==
+        ERR_UNRECOVERABLE) {
       fprintf(stderr, "Could not process command\n");
       return ERR_UNRECOVERABLE;
     }
@@ -367,6 +704,70 @@ static size_t event_loop(const char *const *argv,
   return ERR_UNRECOVERABLE;
 }
 
+/**
+ * @brief Prepares the context of the daemon for a prompt. Prompts of the
+ * session that was answered last continue its context in memory, any other
+ * prompt starts from an empty context or from the replayed session log.
+ * @param name Name of the session, null for a prompt without one
+ * @param verbose Whether the restored messages are reported
+ * @returns The status of the operation
+ */
+static size_t open_served_session(const char *const name,
+                                  const bool verbose) {
+  if (name != nullptr && g_served_session != nullptr &&
+      strcmp(name, g_served_session) == 0) {
+    return ERR_RECOVERABLE;
+  }
+
+  free(g_served_session);
+  g_served_session = nullptr;
+  completions_reset_context();
+  if (name == nullptr) {
+    return ERR_RECOVERABLE;
+  }
+
+  size_t restored = 0;
+  if (completions_open_session(name, &restored) == ERR_UNRECOVERABLE) {
+    fprintf(stderr, "Failed to open session %s\n", name);
+    return ERR_UNRECOVERABLE;
+  }
+  if ((g_served_session = strdup(name)) == nullptr) {
+    fprintf(stderr, "Failed to remember session %s\n", name);
+    completions_reset_context();
+    return ERR_UNRECOVERABLE;
+  }
+
+  if (verbose) {
+    fprintf(stderr, "Session %s: %zu messages restored\n", name, restored);
+  }
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Answers a prompt a client forwarded to the daemon
+ * @param argc Number of arguments the client was started with
+ * @param argv Arguments the client was started with
+ * @param data Configuration of the daemon
+ * @returns The status the client exits with
+ */
+static size_t serve_request(const int argc, const char *const *const argv,
+                            void *const data) {
+  const termchat_config_t *const config = (const termchat_config_t *)data;
+  term_params_t params = {.batch_parallel = DEFAULT_BATCH_PARALLEL};
+  get_parameters(argc, argv, &params);
+  if (params.prompt == nullptr || params.interactive_mode ||
+      params.batch_path != nullptr || params.daemon_mode) {
+    fprintf(stderr, "The daemon only answers single prompts\n");
+    return ERR_UNRECOVERABLE;
+  }
+
+  if (open_served_session(params.session_name, params.verbose_mode) ==
+      ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+  return event_loop(&params, config);
+}
+
 /**
  * @brief Entry point of the application
  * @param argc Number of arguments given at the start of the program
@@ -374,7 +775,7 @@ static size_t event_loop(const char *const *argv,
  * @returns The status of the operation, 0 if success
  */
 int main(const int argc, const char *const *argv) {
-  term_params_t params = {};
+  term_params_t params = {.batch_parallel = DEFAULT_BATCH_PARALLEL};
   get_parameters(argc, argv, &params);
 
   if (params.help_mode == true) {
@@ -382,7 +783,8 @@ int main(const int argc, const char *const *argv) {
     return ERR_RECOVERABLE;
   }
 
-  if (argc < 2 && params.interactive_mode == false) {
+  if (params.prompt == nullptr && params.interactive_mode == false &&
+      params.batch_path == nullptr && params.daemon_mode == false) {
     term_print_color_char("Error: Invalid arguments.", term_color_red);
     fprintf(
         stderr,
@@ -390,5 +792,53 @@ int main(const int argc, const char *const *argv) {
     return ERR_UNRECOVERABLE;
   }
 
-  return event_loop(argv, &params);
+  // A running daemon answers single prompts with its warm connection
+  size_t forwarded = ERR_RECOVERABLE;
+  if (params.interactive_mode == false && params.batch_path == nullptr &&
+      params.daemon_mode == false && daemon_forward(argc, argv, &forwarded)) {
+    return forwarded;
+  }
+
+  if (completions_init() == ERR_UNRECOVERABLE) {
+    fprintf(stderr, "Failed to initialize the HTTP client\n");
+    return ERR_UNRECOVERABLE;
+  }
+
+  static termchat_config_t config = {};
+  if (load_config(&config) == ERR_UNRECOVERABLE) {
+    completions_cleanup();
+    return ERR_UNRECOVERABLE;
+  }
+
+  size_t restored = 0;
+  if (params.session_name != nullptr && params.batch_path == nullptr &&
+      params.daemon_mode == false &&
+      completions_open_session(params.session_name, &restored) ==
+          ERR_UNRECOVERABLE) {
+    fprintf(stderr, "Failed to open session %s\n", params.session_name);
+    completions_cleanup();
+    config_free(&config);
+    return ERR_UNRECOVERABLE;
+  }
+
+  if (params.verbose_mode && params.session_name != nullptr &&
+      params.daemon_mode == false) {
+    fprintf(stderr, "Session %s: %zu messages restored\n",
+            params.session_name, restored);
+  }
+
+  size_t status = ERR_RECOVERABLE;
+  if (params.daemon_mode) {
+    status = daemon_serve(&config, serve_request, &config);
+  } else if (params.batch_path != nullptr) {
+    status = batch_run(&config, params.batch_path, params.batch_parallel);
+  } else {
+    status = event_loop(&params, &config);
+  }
+  free(g_served_session);
+  editor_close(&g_editor);
+  render_free(&g_renderer);
+  completions_cleanup();
+  config_free(&config);
+  return status;
 }
@@ -0,0 +1,262 @@
+#include "ratelimit.h"
+#include "globdef.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+// A key rejected without a Retry-After header sits out this long
+constexpr int64_t RATELIMIT_BLOCK_MS = 1000;
+constexpr long HTTP_TOO_MANY_REQUESTS = 429;
+constexpr char RATELIMIT_PREFIX[] = "x-ratelimit-";
+
+/**
+ * @brief Reads the monotonic clock
+ * @returns Milliseconds since an arbitrary point in the past
+ */
+static int64_t now_ms() {
+  struct timespec now = {};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Gets what is left in a bucket, refilled up to the current time
+ * @param bucket Bucket to read
+ * @param now Current time in milliseconds
+ * @returns The units left
+ */
+static double bucket_level(const ratelimit_bucket_t *const bucket,
+                           const int64_t now) {
+  const double level =
+      bucket->level + bucket->rate * (double)(now - bucket->updated_ms);
+  return level < bucket->limit ? level : bucket->limit;
+}
+
+/**
+ * @brief Gets the share of a bucket that is left after taking a cost out of
+ * it
+ * @param bucket Bucket to read
+ * @param cost Units to take
+ * @param now Current time in milliseconds
+ * @returns The share of the limit, 1 while the limit is unknown
+ */
+static double bucket_headroom(const ratelimit_bucket_t *const bucket,
+                              const double cost, const int64_t now) {
+  if (bucket->limit <= 0) {
+    return 1;
+  }
+  return (bucket_level(bucket, now) - cost) / bucket->limit;
+}
+
+/**
+ * @brief Gets how long until a bucket holds a cost
+ * @param bucket Bucket to read
+ * @param cost Units needed, never more than the limit
+ * @param now Current time in milliseconds
+ * @returns Milliseconds to wait, 0 if the bucket holds the cost already
+ */
+static int64_t bucket_wait(const ratelimit_bucket_t *const bucket, double cost,
+                           const int64_t now) {
+  if (bucket->limit <= 0) {
+    return 0;
+  }
+  cost = cost < bucket->limit ? cost : bucket->limit;
+  const double missing = cost - bucket_level(bucket, now);
+  if (missing <= 0) {
+    return 0;
+  }
+  // Without a reset time the server is asked again after a short while
+  return bucket->rate > 0 ? (int64_t)(missing / bucket->rate) + 1
+                          : RATELIMIT_BLOCK_MS;
+}
+
+/**
+ * @brief Takes a cost out of a bucket
+ * @param bucket Bucket to take from
+ * @param cost Units to take
+ * @param now Current time in milliseconds
+ */
+static void bucket_take(ratelimit_bucket_t *const bucket, const double cost,
+                        const int64_t now) {
+  if (bucket->limit <= 0) {
+    return;
+  }
+  bucket->level = bucket_level(bucket, now) - cost;
+  bucket->updated_ms = now;
+}
+
+/**
+ * @brief Parses a duration such as `20ms`, `1s` or `6m0s`
+ * @param value Start of the duration
+ * @param end End of the header line
+ * @returns The duration in milliseconds, negative if malformed
+ */
+static double parse_duration_ms(const char *value, const char *const end) {
+  double total = 0;
+  while (value < end && *value != '\r' && *value != '\n') {
+    char *unit = nullptr;
+    const double amount = strtod(value, &unit);
+    if (unit == value || unit >= end) {
+      return -1;
+    }
+
+    if (end - unit >= 2 && memcmp(unit, "ms", 2) == 0) {
+      total += amount;
+      unit += 2;
+    } else if (*unit == 'h') {
+      total += amount * 3600000;
+      unit++;
+    } else if (*unit == 'm') {
+      total += amount * 60000;
+      unit++;
+    } else if (*unit == 's') {
+      total += amount * 1000;
+      unit++;
+    } else {
+      return -1;
+    }
+    value = unit;
+  }
+  return total;
+}
+
+size_t ratelimit_open(ratelimit_pool_t *const pool,
+                      const termchat_config_t *const config) {
+  *pool = (ratelimit_pool_t){};
+  const size_t count = config->pool_count + 1;
+  if ((pool->keys = calloc(count, sizeof(ratelimit_key_t))) == nullptr) {
+    fprintf(stderr, "Failed to allocate memory for the key pool\n");
+    return ERR_UNRECOVERABLE;
+  }
+
+  pool->keys[0].api_key = config->api_key;
+  pool->keys[0].endpoint = config->endpoint;
+  for (size_t i = 0; i < config->pool_count; i++) {
+    pool->keys[i + 1].api_key = config->pool[i].api_key;
+    pool->keys[i + 1].endpoint = config->pool[i].endpoint;
+  }
+  for (size_t i = 0; i < count; i++) {
+    pool->keys[i].index = i;
+  }
+  pool->count = count;
+  return ERR_RECOVERABLE;
+}
+
+void ratelimit_close(ratelimit_pool_t *const pool) {
+  for (size_t i = 0; i < pool->count; i++) {
+    curl_slist_free_all(pool->keys[i].headers);
+    curl_slist_free_all(pool->keys[i].gzip_headers);
+  }
+  free(pool->keys);
+  *pool = (ratelimit_pool_t){};
+}
+
+ratelimit_key_t *ratelimit_pick(ratelimit_pool_t *const pool,
+                                const double tokens, int64_t *const wait_ms) {
+  const int64_t now = now_ms();
+  ratelimit_key_t *best = nullptr;
+  double bestHeadroom = 0;
+  int64_t wait = INT64_MAX;
+
+  for (size_t i = 0; i < pool->count; i++) {
+    ratelimit_key_t *const key = &pool->keys[i];
+    int64_t keyWait = key->blocked_until_ms - now;
+    const int64_t requestsWait = bucket_wait(&key->requests, 1, now);
+    const int64_t tokensWait = bucket_wait(&key->tokens, tokens, now);
+    keyWait = keyWait > requestsWait ? keyWait : requestsWait;
+    keyWait = keyWait > tokensWait ? keyWait : tokensWait;
+    if (keyWait > 0) {
+      wait = keyWait < wait ? keyWait : wait;
+      continue;
+    }
+
+    // The scarcer of both limits decides, ties go to the idler key
+    const double requests = bucket_headroom(&key->requests, 1, now);
+    const double budget = bucket_headroom(&key->tokens, tokens, now);
+    const double headroom = requests < budget ? requests : budget;
+    if (best == nullptr || headroom > bestHeadroom ||
+        (headroom == bestHeadroom && key->in_flight < best->in_flight)) {
+      best = key;
+      bestHeadroom = headroom;
+    }
+  }
+
+  if (best == nullptr) {
+    *wait_ms = wait;
+    return nullptr;
+  }
+
+  bucket_take(&best->requests, 1, now);
+  bucket_take(&best->tokens, tokens, now);
+  best->in_flight++;
+  *wait_ms = 0;
+  return best;
+}
+
+size_t ratelimit_header_cb(char *const line, size_t size, size_t nitems,
+                           void *const data) {
+  const size_t length = size * nitems;
+  ratelimit_key_t *const key = (ratelimit_key_t *)data;
+  const size_t prefixLength = sizeof(RATELIMIT_PREFIX) - 1;
+  const char *const end = line + length;
+  const char *const colon = memchr(line, ':', length);
+  if (key == nullptr || colon == nullptr || length <= prefixLength ||
+      strncasecmp(line, RATELIMIT_PREFIX, prefixLength) != 0) {
+    return length;
+  }
+
+  // Names look like `limit-requests`, `remaining-tokens` or `reset-tokens`
+  const char *const name = line + prefixLength;
+  const size_t nameLength = colon - name;
+  const char *const dash = memchr(name, '-', nameLength);
+  if (dash == nullptr) {
+    return length;
+  }
+
+  ratelimit_bucket_t *bucket = nullptr;
+  const size_t kindLength = colon - dash - 1;
+  if (kindLength == 8 && strncasecmp(dash + 1, "requests", 8) == 0) {
+    bucket = &key->requests;
+  } else if (kindLength == 6 && strncasecmp(dash + 1, "tokens", 6) == 0) {
+    bucket = &key->tokens;
+  } else {
+    return length;
+  }
+
+  const char *value = colon + 1;
+  while (value < end && *value == ' ') {
+    value++;
+  }
+
+  const size_t fieldLength = dash - name;
+  const int64_t now = now_ms();
+  if (fieldLength == 5 && strncasecmp(name, "limit", 5) == 0) {
+    bucket->limit = strtod(value, nullptr);
+  } else if (fieldLength == 9 && strncasecmp(name, "remaining", 9) == 0) {
+    bucket->level = strtod(value, nullptr);
+    bucket->updated_ms = now;
+  } else if (fieldLength == 5 && strncasecmp(name, "reset", 5) == 0) {
+    // The bucket is full again once the reset elapsed
+    const double reset = parse_duration_ms(value, end);
+    if (reset > 0 && bucket->limit > bucket->level) {
+      bucket->rate = (bucket->limit - bucket->level) / reset;
+    } else if (reset == 0) {
+      bucket->level = bucket->limit;
+    }
+  }
+  return length;
+}
+
+void ratelimit_finish(ratelimit_key_t *const key, const long http_status,
+                      const int64_t retry_after_s) {
+  if (key->in_flight > 0) {
+    key->in_flight--;
+  }
+  if (http_status == HTTP_TOO_MANY_REQUESTS) {
+    key->blocked_until_ms =
+        now_ms() + (retry_after_s > 0 ? retry_after_s * 1000
+                                      : RATELIMIT_BLOCK_MS);
+  }
+}
@@ -0,0 +1,294 @@
+#include "reactor.h"
+#include "globdef.h"
+#include <curl/curl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+constexpr int REACTOR_MAX_EVENTS = 16;
+constexpr long NSEC_PER_MSEC = 1000000;
+constexpr long MSEC_PER_SEC = 1000;
+
+/**
+ * @brief Arms a timer descriptor
+ * @param fd Timer descriptor to arm
+ * @param timeout_ms Milliseconds until the first expiration, -1 disarms
+ * @param interval_ms Milliseconds between further expirations, 0 for one shot
+ * @returns The status of the operation
+ */
+static size_t arm_timer(const int fd, const long timeout_ms,
+                        const long interval_ms) {
+  struct itimerspec spec = {};
+  if (timeout_ms >= 0) {
+    // A zero value would disarm the timer, so expire immediately instead
+    const long expire_ns = timeout_ms > 0 ? 0 : 1;
+    spec.it_value.tv_sec = timeout_ms / MSEC_PER_SEC;
+    spec.it_value.tv_nsec = (timeout_ms % MSEC_PER_SEC) * NSEC_PER_MSEC;
+    spec.it_value.tv_nsec += expire_ns;
+    spec.it_interval.tv_sec = interval_ms / MSEC_PER_SEC;
+    spec.it_interval.tv_nsec = (interval_ms % MSEC_PER_SEC) * NSEC_PER_MSEC;
+  }
+
+  if (timerfd_settime(fd, 0, &spec, nullptr) != 0) {
+    fprintf(stderr, "Timer could not be armed\n");
+    return ERR_UNRECOVERABLE;
+  }
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Drains the expiration counter of a timer descriptor
+ * @param fd Timer descriptor to drain
+ */
+static void drain_timer(const int fd) {
+  uint64_t expirations = 0;
+  if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+    fprintf(stderr, "Timer expiration could not be read\n");
+  }
+}
+
+/**
+ * @brief Called by libcurl whenever it wants a socket to be watched
+ * differently
+ *
+ * @param easy Transfer owning the socket
+ * @param socket Socket to watch
+ * @param what Which events libcurl is interested in
+ * @param userp Reactor watching the socket
+ * @param socketp Pointer assigned to the socket, non-null once registered
+ */
+static int on_socket(CURL *const, const curl_socket_t socket, const int what,
+                     void *const userp, void *const socketp) {
+  reactor_t *const reactor = (reactor_t *)userp;
+
+  if (what == CURL_POLL_REMOVE) {
+    epoll_ctl(reactor->epoll, EPOLL_CTL_DEL, socket, nullptr);
+    curl_multi_assign(reactor->multi, socket, nullptr);
+    return 0;
+  }
+
+  struct epoll_event event = {.data.fd = socket};
+  event.events |= (what & CURL_POLL_IN) ? EPOLLIN : 0;
+  event.events |= (what & CURL_POLL_OUT) ? EPOLLOUT : 0;
+
+  const int operation = socketp != nullptr ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(reactor->epoll, operation, socket, &event) != 0) {
+    fprintf(stderr, "Socket could not be watched\n");
+    return -1;
+  }
+
+  curl_multi_assign(reactor->multi, socket, reactor);
+  return 0;
+}
+
+/**
+ * @brief Called by libcurl whenever it needs to be woken up after a timeout
+ * @param multi Multi handle requesting the timeout
+ * @param timeout_ms Milliseconds until the timeout, -1 to remove it
+ * @param userp Reactor owning the timer
+ */
+static int on_timeout(CURLM *const, const long timeout_ms, void *const userp) {
+  const reactor_t *const reactor = (const reactor_t *)userp;
+  return arm_timer(reactor->timer, timeout_ms, 0) == ERR_RECOVERABLE ? 0 : -1;
+}
+
+/**
+ * @brief Registers a descriptor for read events
+ * @param reactor Reactor to register with
+ * @param fd Descriptor to register
+ * @returns The status of the operation
+ */
+static size_t watch_readable(const reactor_t *const reactor, const int fd) {
+  struct epoll_event event = {.events = EPOLLIN, .data.fd = fd};
+  if (epoll_ctl(reactor->epoll, EPOLL_CTL_ADD, fd, &event) != 0) {
+    fprintf(stderr, "Descriptor could not be watched\n");
+    return ERR_UNRECOVERABLE;
+  }
+  return ERR_RECOVERABLE;
+}
+
+size_t reactor_init(reactor_t *const reactor) {
+  *reactor = (reactor_t){.epoll = -1, .timer = -1, .ticker = -1, .input = -1};
+
+  if ((reactor->epoll = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    fprintf(stderr, "Could not create epoll instance\n");
+    goto failure;
+  }
+
+  const int flags = TFD_NONBLOCK | TFD_CLOEXEC;
+  if ((reactor->timer = timerfd_create(CLOCK_MONOTONIC, flags)) < 0 ||
+      (reactor->ticker = timerfd_create(CLOCK_MONOTONIC, flags)) < 0) {
+    fprintf(stderr, "Could not create timers\n");
+    goto failure;
+  }
+
+  if (watch_readable(reactor, reactor->timer) == ERR_UNRECOVERABLE ||
+      watch_readable(reactor, reactor->ticker) == ERR_UNRECOVERABLE) {
+    goto failure;
+  }
+
+  if ((reactor->multi = curl_multi_init()) == nullptr) {
+    fprintf(stderr, "Could not initialize libcurl multi handle\n");
+    goto failure;
+  }
+
+  curl_multi_setopt(reactor->multi, CURLMOPT_SOCKETFUNCTION, on_socket);
+  curl_multi_setopt(reactor->multi, CURLMOPT_SOCKETDATA, reactor);
+  curl_multi_setopt(reactor->multi, CURLMOPT_TIMERFUNCTION, on_timeout);
+  curl_multi_setopt(reactor->multi, CURLMOPT_TIMERDATA, reactor);
+  // Concurrent transfers to the same host share one HTTP/2 connection
+  curl_multi_setopt(reactor->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+  return ERR_RECOVERABLE;
+
+failure:
+  reactor_cleanup(reactor);
+  return ERR_UNRECOVERABLE;
+}
+
+void reactor_cleanup(reactor_t *const reactor) {
+  if (reactor->multi != nullptr) {
+    curl_multi_cleanup(reactor->multi);
+    reactor->multi = nullptr;
+  }
+
+  const int fds[] = {reactor->timer, reactor->ticker, reactor->epoll};
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+  reactor->timer = reactor->ticker = reactor->epoll = -1;
+}
+
+size_t reactor_add(reactor_t *const reactor,
+                   reactor_transfer_t *const transfer) {
+  curl_easy_setopt(transfer->curl, CURLOPT_PRIVATE, transfer);
+  if (curl_multi_add_handle(reactor->multi, transfer->curl) != CURLM_OK) {
+    fprintf(stderr, "Transfer could not be added to the reactor\n");
+    return ERR_UNRECOVERABLE;
+  }
+  transfer->active = true;
+  reactor->active++;
+  return ERR_RECOVERABLE;
+}
+
+void reactor_remove(reactor_t *const reactor,
+                    reactor_transfer_t *const transfer) {
+  if (!transfer->active) {
+    return;
+  }
+  curl_multi_remove_handle(reactor->multi, transfer->curl);
+  transfer->active = false;
+  reactor->active--;
+}
+
+size_t reactor_set_ticker(reactor_t *const reactor, const uint32_t interval_ms,
+                          const reactor_tick_cb_t on_tick, void *const data) {
+  reactor->on_tick = on_tick;
+  reactor->tick_data = data;
+  const long timeout = interval_ms > 0 ? (long)interval_ms : -1;
+  return arm_timer(reactor->ticker, timeout, interval_ms);
+}
+
+size_t reactor_watch_input(reactor_t *const reactor, const int fd,
+                           const reactor_input_cb_t on_input,
+                           void *const data) {
+  if (reactor->input >= 0) {
+    epoll_ctl(reactor->epoll, EPOLL_CTL_DEL, reactor->input, nullptr);
+    reactor->input = -1;
+  }
+
+  reactor->on_input = on_input;
+  reactor->input_data = data;
+  if (fd < 0) {
+    return ERR_RECOVERABLE;
+  }
+
+  if (watch_readable(reactor, fd) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+  reactor->input = fd;
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Hands every finished transfer to its callback
+ * @param reactor Reactor owning the transfers
+ */
+static void collect_finished(reactor_t *const reactor) {
+  CURLMsg *message = nullptr;
+  int pending = 0;
+  while ((message = curl_multi_info_read(reactor->multi, &pending)) !=
+         nullptr) {
+    if (message->msg != CURLMSG_DONE) {
+      continue;
+    }
+
+    reactor_transfer_t *transfer = nullptr;
+    curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, &transfer);
+    const CURLcode code = message->data.result;
+    reactor_remove(reactor, transfer);
+    if (transfer->on_done != nullptr) {
+      transfer->on_done(transfer, code);
+    }
+  }
+}
+
+size_t reactor_run(reactor_t *const reactor) {
+  int running = 0;
+  if (curl_multi_socket_action(reactor->multi, CURL_SOCKET_TIMEOUT, 0,
+                               &running) != CURLM_OK) {
+    fprintf(stderr, "Transfers could not be started\n");
+    return ERR_UNRECOVERABLE;
+  }
+  collect_finished(reactor);
+
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+  while (reactor->active > 0) {
+    const int count = epoll_wait(reactor->epoll, events, REACTOR_MAX_EVENTS, -1);
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Failed to wait for events\n");
+      return ERR_UNRECOVERABLE;
+    }
+
+    for (int i = 0; i < count; i++) {
+      const int fd = events[i].data.fd;
+      CURLMcode code = CURLM_OK;
+
+      if (fd == reactor->timer) {
+        drain_timer(fd);
+        code = curl_multi_socket_action(reactor->multi, CURL_SOCKET_TIMEOUT, 0,
+                                        &running);
+      } else if (fd == reactor->ticker) {
+        drain_timer(fd);
+        if (reactor->on_tick != nullptr) {
+          reactor->on_tick(reactor->tick_data);
+        }
+      } else if (fd == reactor->input) {
+        reactor->on_input(fd, reactor->input_data);
+      } else {
+        int mask = 0;
+        mask |= (events[i].events & EPOLLIN) ? CURL_CSELECT_IN : 0;
+        mask |= (events[i].events & EPOLLOUT) ? CURL_CSELECT_OUT : 0;
+        mask |= (events[i].events & (EPOLLERR | EPOLLHUP)) ? CURL_CSELECT_ERR
+                                                           : 0;
+        code = curl_multi_socket_action(reactor->multi, fd, mask, &running);
+      }
+
+      if (code != CURLM_OK) {
+        fprintf(stderr, "Transfers could not make progress\n");
+        return ERR_UNRECOVERABLE;
+      }
+    }
+
+    collect_finished(reactor);
+  }
+
+  return ERR_RECOVERABLE;
+}
@@ -0,0 +1,342 @@
+#include "render.h"
+#include "buffer.h"
+#include "globdef.h"
+#include "term.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+constexpr char RENDER_RESET[] = "\033[0m";
+constexpr size_t FENCE_TICKS = 3;
+constexpr size_t HEADING_MAX_LEVEL = 6;
+constexpr size_t LIST_NUMBER_MAX_DIGITS = 9;
+// Markers indented further belong to indented code or nested blocks
+constexpr size_t MARKER_MAX_INDENT = 3;
+constexpr term_color_t COLOR_PROSE = term_color_green;
+constexpr term_color_t COLOR_CODE = term_color_none;
+constexpr term_color_t COLOR_INLINE_CODE = term_color_yellow;
+constexpr term_color_t COLOR_FENCE = term_color_blue;
+constexpr term_color_t COLOR_HEADING = term_color_cyan;
+constexpr term_color_t COLOR_LIST = term_color_yellow;
+
+void render_init(term_renderer_t *const renderer, const int fd) {
+  renderer->fd = fd;
+  renderer->tty = isatty(fd);
+  renderer->open = false;
+  renderer->color = term_color_none;
+  // The answer continues the line of the prompt
+  renderer->line_start = false;
+  buffer_clear(&renderer->out);
+  renderer->line = render_line_indent;
+  renderer->indent = 0;
+  renderer->marker_length = 0;
+  renderer->code_block = false;
+  renderer->inline_code = false;
+  renderer->ticks = 0;
+  renderer->open_ticks = 0;
+}
+
+size_t render_text(term_renderer_t *const renderer, const char *const text,
+                   const size_t length, const term_color_t color) {
+  if (renderer->tty && (!renderer->open || renderer->color != color)) {
+    if (buffer_printf(&renderer->out, "\033[%dm", color) ==
+        ERR_UNRECOVERABLE) {
+      return ERR_UNRECOVERABLE;
+    }
+    renderer->open = true;
+    renderer->color = color;
+  }
+  return buffer_append(&renderer->out, text, length);
+}
+
+/**
+ * @brief Counts how often a character repeats at the start of a text
+ * @param text Text to look at
+ * @param length Length of the text
+ * @param c Character to count
+ * @returns The length of the run
+ */
+static size_t count_run(const char *const text, const size_t length,
+                        const char c) {
+  size_t run = 0;
+  while (run < length && text[run] == c) {
+    run++;
+  }
+  return run;
+}
+
+/**
+ * @brief Decides what the held back start of a line is
+ * @param renderer Renderer holding the marker
+ * @param marked Receives how many bytes form a list marker
+ * @returns The kind of the line, or render_line_marker while undecided
+ */
+static render_line_t classify_marker(const term_renderer_t *const renderer,
+                                     size_t *const marked) {
+  const char *const marker = renderer->marker;
+  const size_t length = renderer->marker_length;
+  *marked = 0;
+  if (length == 0) {
+    return renderer->code_block ? render_line_code : render_line_prose;
+  }
+
+  const size_t ticks = count_run(marker, length, '`');
+  if (renderer->indent <= MARKER_MAX_INDENT && ticks == length &&
+      length < FENCE_TICKS) {
+    return render_line_marker;
+  }
+  if (renderer->indent <= MARKER_MAX_INDENT && ticks >= FENCE_TICKS) {
+    return render_line_fence;
+  }
+  if (renderer->code_block) {
+    return render_line_code;
+  }
+
+  if (marker[0] == '#' && renderer->indent <= MARKER_MAX_INDENT) {
+    const size_t level = count_run(marker, length, '#');
+    if (level > HEADING_MAX_LEVEL) {
+      return render_line_prose;
+    }
+    if (level == length) {
+      return render_line_marker;
+    }
+    return marker[level] == ' ' ? render_line_heading : render_line_prose;
+  }
+
+  if (marker[0] == '-' || marker[0] == '*' || marker[0] == '+') {
+    if (length == 1) {
+      return render_line_marker;
+    }
+    *marked = marker[1] == ' ' ? 1 : 0;
+    return render_line_prose;
+  }
+
+  size_t digits = 0;
+  while (digits < length && marker[digits] >= '0' && marker[digits] <= '9') {
+    digits++;
+  }
+  if (digits == 0 || digits > LIST_NUMBER_MAX_DIGITS) {
+    return render_line_prose;
+  }
+  if (digits == length ||
+      (digits + 1 == length &&
+       (marker[digits] == '.' || marker[digits] == ')'))) {
+    return render_line_marker;
+  }
+  if ((marker[digits] == '.' || marker[digits] == ')') &&
+      marker[digits + 1] == ' ') {
+    *marked = digits + 1;
+  }
+  return render_line_prose;
+}
+
+/**
+ * @brief Ends a run of backticks, which opens inline code or closes the span
+ * opened by a run of the same length
+ * @param renderer Renderer inside a line of prose
+ */
+static void close_ticks(term_renderer_t *const renderer) {
+  if (renderer->ticks == 0) {
+    return;
+  }
+  if (!renderer->inline_code) {
+    renderer->inline_code = true;
+    renderer->open_ticks = renderer->ticks;
+  } else if (renderer->ticks == renderer->open_ticks) {
+    renderer->inline_code = false;
+  }
+  renderer->ticks = 0;
+}
+
+/**
+ * @brief Queues part of a line that holds no newline in the colors of its
+ * kind
+ * @param renderer Renderer collecting the output
+ * @param text Part of the line
+ * @param length Length of the part
+ * @returns The status of the operation
+ */
+static size_t render_line(term_renderer_t *const renderer, const char *text,
+                          size_t length) {
+  switch (renderer->line) {
+  case render_line_heading:
+    return render_text(renderer, text, length, COLOR_HEADING);
+  case render_line_fence:
+    return render_text(renderer, text, length, COLOR_FENCE);
+  case render_line_code:
+    return render_text(renderer, text, length, COLOR_CODE);
+  default:
+    break;
+  }
+
+  while (length > 0) {
+    if (*text == '`') {
+      renderer->ticks++;
+      if (render_text(renderer, text, 1, COLOR_INLINE_CODE) ==
+          ERR_UNRECOVERABLE) {
+        return ERR_UNRECOVERABLE;
+      }
+      text++;
+      length--;
+      continue;
+    }
+
+    close_ticks(renderer);
+    const char *const tick = memchr(text, '`', length);
+    const size_t run = tick != nullptr ? (size_t)(tick - text) : length;
+    if (render_text(renderer, text, run,
+                    renderer->inline_code ? COLOR_INLINE_CODE
+                                          : COLOR_PROSE) ==
+        ERR_UNRECOVERABLE) {
+      return ERR_UNRECOVERABLE;
+    }
+    text += run;
+    length -= run;
+  }
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Settles the kind of the line once its marker is known, or when the
+ * line ends before that, and queues the held back bytes
+ * @param renderer Renderer holding the marker
+ * @param complete Whether nothing more of the marker can arrive
+ * @returns The status of the operation
+ */
+static size_t resolve_marker(term_renderer_t *const renderer,
+                             const bool complete) {
+  size_t marked = 0;
+  render_line_t line = classify_marker(renderer, &marked);
+  if (line == render_line_marker) {
+    if (!complete) {
+      return ERR_RECOVERABLE;
+    }
+    line = renderer->code_block ? render_line_code : render_line_prose;
+  }
+
+  renderer->line = line;
+  const size_t length = renderer->marker_length;
+  renderer->marker_length = 0;
+  if (marked > 0 && render_text(renderer, renderer->marker, marked,
+                                COLOR_LIST) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+  return render_line(renderer, renderer->marker + marked, length - marked);
+}
+
+/**
+ * @brief Ends the current line. A fence line opens or closes a code block,
+ * inline code never spans lines.
+ * @param renderer Renderer collecting the output
+ * @returns The status of the operation
+ */
+static size_t end_line(term_renderer_t *const renderer) {
+  close_ticks(renderer);
+  renderer->inline_code = false;
+  if (renderer->line == render_line_fence) {
+    renderer->code_block = !renderer->code_block;
+  }
+  renderer->line = render_line_indent;
+  renderer->indent = 0;
+  return buffer_append(&renderer->out, "\n", 1);
+}
+
+size_t render_markdown(term_renderer_t *const renderer, const char *const text,
+                       const size_t length) {
+  size_t i = 0;
+  while (i < length) {
+    const char c = text[i];
+    switch (renderer->line) {
+    case render_line_indent:
+      if (c == ' ' || c == '\t') {
+        // Whitespace looks the same in every color
+        renderer->indent += c == ' ' ? 1 : 4;
+        if (buffer_append(&renderer->out, &c, 1) == ERR_UNRECOVERABLE) {
+          return ERR_UNRECOVERABLE;
+        }
+        i++;
+        continue;
+      }
+      renderer->line = render_line_marker;
+      renderer->marker_length = 0;
+      [[fallthrough]];
+    case render_line_marker:
+      if (c == '\n' || renderer->marker_length == RENDER_MARKER_MAX) {
+        if (resolve_marker(renderer, true) == ERR_UNRECOVERABLE) {
+          return ERR_UNRECOVERABLE;
+        }
+        continue;
+      }
+      renderer->marker[renderer->marker_length++] = c;
+      i++;
+      if (resolve_marker(renderer, false) == ERR_UNRECOVERABLE) {
+        return ERR_UNRECOVERABLE;
+      }
+      continue;
+    default:
+      break;
+    }
+
+    const char *const newline = memchr(&text[i], '\n', length - i);
+    const size_t end = newline != nullptr ? (size_t)(newline - text) : length;
+    if (render_line(renderer, &text[i], end - i) == ERR_UNRECOVERABLE) {
+      return ERR_UNRECOVERABLE;
+    }
+    i = end;
+    if (newline != nullptr) {
+      if (end_line(renderer) == ERR_UNRECOVERABLE) {
+        return ERR_UNRECOVERABLE;
+      }
+      i++;
+    }
+  }
+  return ERR_RECOVERABLE;
+}
+
+size_t render_flush(term_renderer_t *const renderer) {
+  // Text printed through stdio must come out first
+  fflush(stdout);
+
+  if (renderer->out.length > 0) {
+    renderer->line_start =
+        renderer->out.data[renderer->out.length - 1] == '\n';
+  }
+
+  size_t written = 0;
+  while (written < renderer->out.length) {
+    const ssize_t result = write(renderer->fd, &renderer->out.data[written],
+                                 renderer->out.length - written);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Failed to write rendered output\n");
+      buffer_clear(&renderer->out);
+      return ERR_UNRECOVERABLE;
+    }
+    written += result;
+  }
+
+  buffer_clear(&renderer->out);
+  return ERR_RECOVERABLE;
+}
+
+size_t render_finish(term_renderer_t *const renderer) {
+  if (renderer->line == render_line_marker &&
+      resolve_marker(renderer, true) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+  if (renderer->open) {
+    if (buffer_append(&renderer->out, RENDER_RESET,
+                      sizeof(RENDER_RESET) - 1) == ERR_UNRECOVERABLE) {
+      return ERR_UNRECOVERABLE;
+    }
+    renderer->open = false;
+  }
+  return render_flush(renderer);
+}
+
+void render_free(term_renderer_t *const renderer) {
+  buffer_free(&renderer->out);
+}
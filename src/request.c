@@ -0,0 +1,149 @@
+#include "request.h"
+#include "globdef.h"
+#include <curl/curl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+constexpr size_t REQUEST_MIN_SEGMENTS = 8;
+// Fast levels keep most of the gain on JSON while costing little CPU per turn
+constexpr int REQUEST_GZIP_LEVEL = 3;
+// A window of 15 bits with 16 added selects the gzip wrapper
+constexpr int REQUEST_GZIP_WINDOW = 15 + 16;
+constexpr int REQUEST_GZIP_MEMORY = 8;
+
+void request_body_reset(request_body_t *const body) {
+  body->count = 0;
+  body->total = 0;
+  body->segment = 0;
+  body->offset = 0;
+}
+
+size_t request_body_add(request_body_t *const body, const void *const data,
+                        const size_t length) {
+  if (length == 0) {
+    return ERR_RECOVERABLE;
+  }
+
+  if (body->count == body->capacity) {
+    const size_t capacity =
+        body->capacity > 0 ? body->capacity * 2 : REQUEST_MIN_SEGMENTS;
+    struct iovec *const segments =
+        realloc(body->segments, capacity * sizeof(struct iovec));
+    if (segments == nullptr) {
+      fprintf(stderr, "Request body could not grow\n");
+      return ERR_UNRECOVERABLE;
+    }
+    body->segments = segments;
+    body->capacity = capacity;
+  }
+
+  body->segments[body->count++] = (struct iovec){
+      .iov_base = (void *)data,
+      .iov_len = length,
+  };
+  body->total += length;
+  return ERR_RECOVERABLE;
+}
+
+size_t request_body_read(char *const buffer, const size_t size,
+                         const size_t nitems, void *const body) {
+  request_body_t *const request = (request_body_t *)body;
+  const size_t capacity = size * nitems;
+  size_t written = 0;
+
+  while (written < capacity && request->segment < request->count) {
+    const struct iovec *const segment = &request->segments[request->segment];
+    const size_t left = segment->iov_len - request->offset;
+    const size_t chunk =
+        left < capacity - written ? left : capacity - written;
+
+    memcpy(&buffer[written], (const char *)segment->iov_base + request->offset,
+           chunk);
+    written += chunk;
+    request->offset += chunk;
+
+    if (request->offset == segment->iov_len) {
+      request->segment++;
+      request->offset = 0;
+    }
+  }
+  return written;
+}
+
+int request_body_seek(void *const body, const curl_off_t offset,
+                      const int origin) {
+  request_body_t *const request = (request_body_t *)body;
+  if (origin != SEEK_SET || offset < 0 ||
+      (size_t)offset > request->total) {
+    return CURL_SEEKFUNC_CANTSEEK;
+  }
+
+  size_t left = offset;
+  request->segment = 0;
+  request->offset = 0;
+  while (request->segment < request->count &&
+         left >= request->segments[request->segment].iov_len) {
+    left -= request->segments[request->segment].iov_len;
+    request->segment++;
+  }
+  request->offset = left;
+  return CURL_SEEKFUNC_OK;
+}
+
+size_t request_body_gzip(const request_body_t *const body,
+                         buffer_t *const dest) {
+  z_stream stream = {};
+  if (deflateInit2(&stream, REQUEST_GZIP_LEVEL, Z_DEFLATED, REQUEST_GZIP_WINDOW,
+                   REQUEST_GZIP_MEMORY, Z_DEFAULT_STRATEGY) != Z_OK) {
+    fprintf(stderr, "Could not start compressing the request body\n");
+    return ERR_UNRECOVERABLE;
+  }
+
+  buffer_clear(dest);
+  size_t status = ERR_UNRECOVERABLE;
+  if (buffer_reserve(dest, deflateBound(&stream, body->total)) ==
+      ERR_UNRECOVERABLE) {
+    goto cleanup;
+  }
+
+  for (size_t i = 0; i <= body->count; i++) {
+    // A last pass without input finishes the stream
+    const bool last = i == body->count;
+    stream.next_in = last ? nullptr : body->segments[i].iov_base;
+    stream.avail_in = last ? 0 : body->segments[i].iov_len;
+
+    int result = Z_OK;
+    do {
+      // The last byte of the storage is kept for the terminating null byte
+      if (dest->length + 1 == dest->capacity &&
+          buffer_reserve(dest, dest->capacity) == ERR_UNRECOVERABLE) {
+        goto cleanup;
+      }
+      const size_t room = dest->capacity - 1 - dest->length;
+      stream.next_out = (Bytef *)dest->data + dest->length;
+      stream.avail_out = room;
+      result = deflate(&stream, last ? Z_FINISH : Z_NO_FLUSH);
+      dest->length += room - stream.avail_out;
+    } while (result == Z_OK && (stream.avail_in > 0 || last));
+
+    if (result != (last ? Z_STREAM_END : Z_OK) && result != Z_BUF_ERROR) {
+      goto cleanup;
+    }
+  }
+  dest->data[dest->length] = '\0';
+  status = ERR_RECOVERABLE;
+
+cleanup:
+  if (status == ERR_UNRECOVERABLE) {
+    fprintf(stderr, "Request body could not be compressed\n");
+  }
+  deflateEnd(&stream);
+  return status;
+}
+
+void request_body_free(request_body_t *const body) {
+  free(body->segments);
+  *body = (request_body_t){};
+}
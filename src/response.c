@@ -0,0 +1,188 @@
+#include "response.h"
+#include "jsonscan.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  response_fields_t *fields;
+  size_t index;
+} response_choices_t;
+
+/**
+ * @brief Records the position of a string value
+ * @param value Start of the value
+ * @param end End of the document
+ * @param dest Receives the escaped content of the string
+ * @param length Receives the length of the content
+ * @returns Position right after the value, or null on malformed input
+ */
+static const char *read_string(const char *const value, const char *const end,
+                               const char **const dest, size_t *const length) {
+  if (*value != '"') {
+    // Values such as a null content are left unset
+    return json_skip_value(value, end);
+  }
+  const char *const quote = json_scan_string(value, end);
+  if (quote == nullptr) {
+    return nullptr;
+  }
+  *dest = value + 1;
+  *length = quote - value - 1;
+  return quote + 1;
+}
+
+/**
+ * @brief Reads the token counts of the `usage` object
+ * @param key Name of the member
+ * @param length Length of the name
+ * @param value Start of the value
+ * @param end End of the document
+ * @param data Usage to fill
+ * @returns Position right after the value, or null on malformed input
+ */
+static const char *on_usage_member(const char *const key, const size_t length,
+                                   const char *const value,
+                                   const char *const end, void *const data) {
+  completion_usage_t *const usage = (completion_usage_t *)data;
+  int64_t *field = nullptr;
+  if (length == 13 && memcmp(key, "prompt_tokens", length) == 0) {
+    field = &usage->prompt_tokens;
+  } else if (length == 17 && memcmp(key, "completion_tokens", length) == 0) {
+    field = &usage->completion_tokens;
+  } else if (length == 13 && memcmp(key, "cached_tokens", length) == 0) {
+    field = &usage->cached_tokens;
+  } else if (length == 21 &&
+             memcmp(key, "prompt_tokens_details", length) == 0 &&
+             *value == '{') {
+    return json_object_each(value, end, on_usage_member, usage);
+  }
+
+  if (field == nullptr) {
+    return json_skip_value(value, end);
+  }
+
+  char *next = nullptr;
+  *field = strtoll(value, &next, 10);
+  return next != value ? next : json_skip_value(value, end);
+}
+
+/**
+ * @brief Reads the `content` of a message or of a streamed delta
+ * @param key Name of the member
+ * @param length Length of the name
+ * @param value Start of the value
+ * @param end End of the document
+ * @param data Fields to fill
+ * @returns Position right after the value, or null on malformed input
+ */
+static const char *on_message_member(const char *const key,
+                                     const size_t length,
+                                     const char *const value,
+                                     const char *const end, void *const data) {
+  response_fields_t *const fields = (response_fields_t *)data;
+  if (length == 7 && memcmp(key, "content", length) == 0) {
+    return read_string(value, end, &fields->content, &fields->content_length);
+  }
+  return json_skip_value(value, end);
+}
+
+/**
+ * @brief Reads the message and the finish reason of the first choice
+ * @param key Name of the member
+ * @param length Length of the name
+ * @param value Start of the value
+ * @param end End of the document
+ * @param data Fields to fill
+ * @returns Position right after the value, or null on malformed input
+ */
+static const char *on_choice_member(const char *const key, const size_t length,
+                                    const char *const value,
+                                    const char *const end, void *const data) {
+  response_fields_t *const fields = (response_fields_t *)data;
+  if (((length == 7 && memcmp(key, "message", length) == 0) ||
+       (length == 5 && memcmp(key, "delta", length) == 0)) &&
+      *value == '{') {
+    return json_object_each(value, end, on_message_member, fields);
+  }
+  if (length == 13 && memcmp(key, "finish_reason", length) == 0) {
+    return read_string(value, end, &fields->finish_reason,
+                       &fields->finish_reason_length);
+  }
+  return json_skip_value(value, end);
+}
+
+/**
+ * @brief Walks into the first choice and skips every other one
+ * @param value Start of the element
+ * @param end End of the document
+ * @param data Choices being walked
+ * @returns Position right after the element, or null on malformed input
+ */
+static const char *on_choice(const char *const value, const char *const end,
+                             void *const data) {
+  response_choices_t *const choices = (response_choices_t *)data;
+  if (choices->index++ == 0 && *value == '{') {
+    return json_object_each(value, end, on_choice_member, choices->fields);
+  }
+  return json_skip_value(value, end);
+}
+
+/**
+ * @brief Reads the `message` of an error object
+ * @param key Name of the member
+ * @param length Length of the name
+ * @param value Start of the value
+ * @param end End of the document
+ * @param data Fields to fill
+ * @returns Position right after the value, or null on malformed input
+ */
+static const char *on_error_member(const char *const key, const size_t length,
+                                   const char *const value,
+                                   const char *const end, void *const data) {
+  response_fields_t *const fields = (response_fields_t *)data;
+  if (length == 7 && memcmp(key, "message", length) == 0) {
+    return read_string(value, end, &fields->error, &fields->error_length);
+  }
+  return json_skip_value(value, end);
+}
+
+/**
+ * @brief Dispatches the top-level members of a response
+ * @param key Name of the member
+ * @param length Length of the name
+ * @param value Start of the value
+ * @param end End of the document
+ * @param data Fields to fill
+ * @returns Position right after the value, or null on malformed input
+ */
+static const char *on_response_member(const char *const key,
+                                      const size_t length,
+                                      const char *const value,
+                                      const char *const end,
+                                      void *const data) {
+  response_fields_t *const fields = (response_fields_t *)data;
+  if (length == 7 && memcmp(key, "choices", length) == 0 && *value == '[') {
+    response_choices_t choices = {.fields = fields};
+    return json_array_each(value, end, on_choice, &choices);
+  }
+  if (length == 5 && memcmp(key, "usage", length) == 0 && *value == '{') {
+    fields->usage.reported = true;
+    return json_object_each(value, end, on_usage_member, &fields->usage);
+  }
+  if (length == 5 && memcmp(key, "error", length) == 0) {
+    // Some servers send the error as a plain string
+    return *value == '{'
+               ? json_object_each(value, end, on_error_member, fields)
+               : read_string(value, end, &fields->error,
+                             &fields->error_length);
+  }
+  return json_skip_value(value, end);
+}
+
+bool response_parse(const char *const response, const size_t length,
+                    response_fields_t *const fields) {
+  *fields = (response_fields_t){};
+  return response != nullptr &&
+         json_object_each(response, response + length, on_response_member,
+                          fields) != nullptr;
+}
@@ -0,0 +1,234 @@
+#include "session.h"
+#include "globdef.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+constexpr char SESSION_MAGIC[] = "TCSLOG01";
+// The log starts with the magic without its null byte
+constexpr size_t SESSION_MAGIC_LENGTH = sizeof(SESSION_MAGIC) - 1;
+constexpr size_t SESSION_NAME_MAX = 64;
+
+typedef struct {
+  uint32_t length;
+  uint8_t role;
+  uint8_t reserved[3];
+} session_record_t;
+
+/**
+ * @brief Checks that a session name can be used as a file name
+ * @param name Name of the session
+ * @returns True if the name only holds letters, digits, '.', '-' and '_'
+ */
+static bool is_valid_name(const char *const name) {
+  const size_t length = strlen(name);
+  if (length == 0 || length > SESSION_NAME_MAX || name[0] == '.') {
+    return false;
+  }
+  return strspn(name, "abcdefghijklmnopqrstuvwxyz"
+                      "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                      "0123456789._-") == length;
+}
+
+/**
+ * @brief Builds the path of a session log, creating its directories
+ * @param dest Destination of the path
+ * @param len Size of the destination
+ * @param name Name of the session
+ * @returns The status of the operation
+ */
+static size_t get_session_path(char *const dest, const size_t len,
+                               const char *const name) {
+  const char *const state_dir = getenv("XDG_STATE_HOME");
+  const char *const home_dir = getenv("HOME");
+  int written = -1;
+  if (state_dir != nullptr) {
+    written = snprintf(dest, len, "%s/termchat/sessions/%s.log", state_dir,
+                       name);
+  } else if (home_dir != nullptr) {
+    written = snprintf(dest, len, "%s/.local/state/termchat/sessions/%s.log",
+                       home_dir, name);
+  }
+
+  if (written < 0 || (size_t)written >= len) {
+    fprintf(stderr, "Could not find session directory\n");
+    return ERR_UNRECOVERABLE;
+  }
+
+  // Create every missing directory leading to the log
+  for (char *slash = strchr(dest + 1, '/'); slash != nullptr;
+       slash = strchr(slash + 1, '/')) {
+    *slash = '\0';
+    const bool failed = mkdir(dest, 0700) != 0 && errno != EEXIST;
+    *slash = '/';
+    if (failed) {
+      fprintf(stderr, "Could not create session directory\n");
+      return ERR_UNRECOVERABLE;
+    }
+  }
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Walks the records of a mapped log
+ * @param session Session being opened
+ * @param map Start of the mapped log
+ * @param size Size of the log
+ * @param on_message Callback receiving every message
+ * @param data Pointer handed to the callback
+ * @returns Length of the log up to the last complete record, or 0 on error
+ */
+static size_t replay(session_t *const session, const char *const map,
+                     const size_t size, const session_message_cb_t on_message,
+                     void *const data) {
+  size_t position = SESSION_MAGIC_LENGTH;
+  while (size - position >= sizeof(session_record_t)) {
+    session_record_t record;
+    memcpy(&record, map + position, sizeof(record));
+    const size_t payload = position + sizeof(record);
+    if (record.role > role_type_developer || size - payload < record.length) {
+      break;
+    }
+
+    if (on_message((role_type_t)record.role, map + payload, record.length,
+                   data) == ERR_UNRECOVERABLE) {
+      return 0;
+    }
+    position = payload + record.length;
+    session->count++;
+  }
+  return position;
+}
+
+size_t session_open(session_t *const session, const char *const name,
+                    const session_message_cb_t on_message, void *const data) {
+  *session = (session_t){.fd = -1};
+
+  if (!is_valid_name(name)) {
+    fprintf(stderr, "Session names may only contain letters, digits, '.', "
+                    "'-' and '_'\n");
+    return ERR_UNRECOVERABLE;
+  }
+
+  char path[MAX_BUFF_SIZE];
+  if (get_session_path(path, sizeof(path), name) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+
+  if ((session->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC,
+                          0600)) < 0) {
+    fprintf(stderr, "Could not open session log %s\n", path);
+    return ERR_UNRECOVERABLE;
+  }
+
+  if (flock(session->fd, LOCK_EX | LOCK_NB) != 0) {
+    fprintf(stderr, "Session %s is used by another process\n", name);
+    goto failure;
+  }
+
+  struct stat st = {};
+  if (fstat(session->fd, &st) != 0) {
+    fprintf(stderr, "Could not get the size of the session log\n");
+    goto failure;
+  }
+
+  const size_t size = st.st_size;
+  if (size == 0) {
+    if (write(session->fd, SESSION_MAGIC, SESSION_MAGIC_LENGTH) !=
+        (ssize_t)SESSION_MAGIC_LENGTH) {
+      fprintf(stderr, "Could not write the session log\n");
+      goto failure;
+    }
+    session->length = SESSION_MAGIC_LENGTH;
+    return ERR_RECOVERABLE;
+  }
+
+  const char *const map =
+      mmap(nullptr, size, PROT_READ, MAP_PRIVATE, session->fd, 0);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "Could not map the session log\n");
+    goto failure;
+  }
+
+  if (size < SESSION_MAGIC_LENGTH ||
+      memcmp(map, SESSION_MAGIC, SESSION_MAGIC_LENGTH) != 0) {
+    munmap((void *)map, size);
+    fprintf(stderr, "%s is not a session log\n", path);
+    goto failure;
+  }
+
+  const size_t valid = replay(session, map, size, on_message, data);
+  munmap((void *)map, size);
+  if (valid == 0) {
+    goto failure;
+  }
+
+  // A record cut short by a crash would corrupt every later append
+  if (valid < size && ftruncate(session->fd, valid) != 0) {
+    fprintf(stderr, "Could not drop the incomplete end of the session log\n");
+    goto failure;
+  }
+  session->length = valid;
+  return ERR_RECOVERABLE;
+
+failure:
+  session_close(session);
+  return ERR_UNRECOVERABLE;
+}
+
+size_t session_append(session_t *const session, const role_type_t role,
+                      const char *const content, const size_t length) {
+  if (session->fd < 0) {
+    return ERR_RECOVERABLE;
+  }
+
+  if (length > UINT32_MAX) {
+    fprintf(stderr, "Message is too long for the session log\n");
+    return ERR_UNRECOVERABLE;
+  }
+
+  session_record_t record = {.length = length, .role = role};
+  struct iovec segments[] = {
+      {.iov_base = &record, .iov_len = sizeof(record)},
+      {.iov_base = (void *)content, .iov_len = length},
+  };
+  const ssize_t expected = sizeof(record) + length;
+  if (writev(session->fd, segments, 2) != expected ||
+      fdatasync(session->fd) != 0) {
+    fprintf(stderr, "Message could not be written to the session log\n");
+    return ERR_UNRECOVERABLE;
+  }
+  session->count++;
+  session->length += expected;
+  return ERR_RECOVERABLE;
+}
+
+size_t session_rewind(session_t *const session, const session_t *const mark) {
+  if (session->fd < 0 || session->fd != mark->fd ||
+      session->length == mark->length) {
+    return ERR_RECOVERABLE;
+  }
+  if (ftruncate(session->fd, mark->length) != 0 ||
+      fdatasync(session->fd) != 0) {
+    fprintf(stderr, "Could not drop the last messages of the session log\n");
+    return ERR_UNRECOVERABLE;
+  }
+  session->count = mark->count;
+  session->length = mark->length;
+  return ERR_RECOVERABLE;
+}
+
+void session_close(session_t *const session) {
+  if (session->fd >= 0) {
+    close(session->fd);
+    session->fd = -1;
+  }
+}
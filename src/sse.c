@@ -0,0 +1,111 @@
+#include "sse.h"
+#include "buffer.h"
+#include "globdef.h"
+#include <string.h>
+
+constexpr char SSE_FIELD_DATA[] = "data";
+constexpr size_t SSE_FIELD_DATA_LEN = sizeof(SSE_FIELD_DATA) - 1;
+
+void sse_init(sse_parser_t *const parser, const sse_event_cb_t on_event,
+              void *const user) {
+  buffer_clear(&parser->line);
+  buffer_clear(&parser->data);
+  parser->skip_lf = false;
+  parser->on_event = on_event;
+  parser->user = user;
+}
+
+/**
+ * @brief Hands the accumulated event to the callback and resets its data
+ * @param parser Parser holding the event
+ */
+static void dispatch_event(sse_parser_t *const parser) {
+  buffer_t *const data = &parser->data;
+  if (data->length > 0) {
+    // The trailing newline added after every data line is not part of the
+    // payload
+    data->data[--data->length] = '\0';
+    parser->on_event(data->data, data->length, parser->user);
+  }
+  buffer_clear(data);
+}
+
+/**
+ * @brief Interprets a single complete line of the event stream
+ * @param parser Parser holding the line
+ * @returns The status of the operation
+ */
+static size_t process_line(sse_parser_t *const parser) {
+  const char *const line = parser->line.data;
+  const size_t length = parser->line.length;
+
+  if (length == 0) {
+    dispatch_event(parser);
+    return ERR_RECOVERABLE;
+  }
+
+  // Lines starting with a colon are comments, often used as keep-alives
+  if (line[0] == ':') {
+    return ERR_RECOVERABLE;
+  }
+
+  const char *const colon = memchr(line, ':', length);
+  const size_t field_length = colon ? (size_t)(colon - line) : length;
+  if (field_length != SSE_FIELD_DATA_LEN ||
+      memcmp(line, SSE_FIELD_DATA, SSE_FIELD_DATA_LEN) != 0) {
+    return ERR_RECOVERABLE;
+  }
+
+  size_t start = colon ? field_length + 1 : length;
+  if (start < length && line[start] == ' ') {
+    start++;
+  }
+
+  if (buffer_append(&parser->data, &line[start], length - start) ==
+          ERR_UNRECOVERABLE ||
+      buffer_append(&parser->data, "\n", 1) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+  return ERR_RECOVERABLE;
+}
+
+size_t sse_feed(sse_parser_t *const parser, const char *const chunk,
+                const size_t length) {
+  size_t start = 0;
+  for (size_t i = 0; i < length; i++) {
+    const char c = chunk[i];
+
+    if (parser->skip_lf) {
+      parser->skip_lf = false;
+      if (c == '\n') {
+        start = i + 1;
+        continue;
+      }
+    }
+
+    if (c != '\r' && c != '\n') {
+      continue;
+    }
+
+    // Complete the pending line with everything up to the terminator
+    parser->skip_lf = c == '\r';
+    if (buffer_append(&parser->line, &chunk[start], i - start) ==
+        ERR_UNRECOVERABLE) {
+      return ERR_UNRECOVERABLE;
+    }
+    start = i + 1;
+
+    const size_t status = process_line(parser);
+    buffer_clear(&parser->line);
+    if (status == ERR_UNRECOVERABLE) {
+      return ERR_UNRECOVERABLE;
+    }
+  }
+
+  return buffer_append(&parser->line, &chunk[start], length - start);
+}
+
+void sse_free(sse_parser_t *const parser) {
+  buffer_free(&parser->line);
+  buffer_free(&parser->data);
+}
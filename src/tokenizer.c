@@ -0,0 +1,829 @@
+#include "tokenizer.h"
+#include "globdef.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+constexpr uint32_t RANK_NONE = UINT32_MAX;
+// Longer pieces are merged in chunks, which only happens for runs of
+// whitespace or symbols that never form a single token anyway
+constexpr size_t PIECE_MAX = 256;
+constexpr uint64_t FNV_OFFSET_BASIS = 0xcbf29ce484222325ULL;
+constexpr uint64_t FNV_PRIME = 0x100000001b3ULL;
+constexpr uint32_t CODE_POINT_INVALID = 0xFFFD;
+
+typedef enum : uint8_t {
+  char_class_end,
+  char_class_upper,
+  char_class_lower,
+  // Letters without case, such as CJK, which both sides of a cased run match
+  char_class_letter,
+  // Combining marks
+  char_class_mark,
+  char_class_digit,
+  char_class_space,
+  char_class_newline,
+  char_class_symbol,
+  // Alternating pairs, uppercase at even or at odd code points
+  char_class_cased_even,
+  char_class_cased_odd
+} char_class_t;
+
+typedef struct {
+  uint32_t first;
+  uint32_t last;
+  char_class_t class;
+} char_range_t;
+
+// Non-ASCII code points that are not letters without case, sorted. This
+// follows the Unicode categories closely enough for counting, without
+// carrying the full tables: the cased scripts, combining marks and vowel
+// signs, digits, spaces, punctuation and symbols of the common blocks, and
+// emoji.
+static const char_range_t CHAR_RANGES[] = {
+    {0x80, 0x84, char_class_symbol},
+    {0x85, 0x85, char_class_space},
+    {0x86, 0x9F, char_class_symbol},
+    {0xA0, 0xA0, char_class_space},
+    {0xA1, 0xA9, char_class_symbol},
+    {0xAA, 0xAA, char_class_lower},
+    {0xAB, 0xB1, char_class_symbol},
+    {0xB2, 0xB3, char_class_digit},
+    {0xB4, 0xB4, char_class_symbol},
+    {0xB5, 0xB5, char_class_lower},
+    {0xB6, 0xB8, char_class_symbol},
+    {0xB9, 0xB9, char_class_digit},
+    {0xBA, 0xBA, char_class_lower},
+    {0xBB, 0xBB, char_class_symbol},
+    {0xBC, 0xBE, char_class_digit},
+    {0xBF, 0xBF, char_class_symbol},
+    {0xC0, 0xD6, char_class_upper},
+    {0xD7, 0xD7, char_class_symbol},
+    {0xD8, 0xDE, char_class_upper},
+    {0xDF, 0xF6, char_class_lower},
+    {0xF7, 0xF7, char_class_symbol},
+    {0xF8, 0xFF, char_class_lower},
+    {0x100, 0x137, char_class_cased_even},
+    {0x138, 0x138, char_class_lower},
+    {0x139, 0x148, char_class_cased_odd},
+    {0x149, 0x149, char_class_lower},
+    {0x14A, 0x177, char_class_cased_even},
+    {0x178, 0x178, char_class_upper},
+    {0x179, 0x17E, char_class_cased_odd},
+    {0x17F, 0x17F, char_class_lower},
+    {0x200, 0x233, char_class_cased_even},
+    {0x250, 0x2AF, char_class_lower},
+    {0x2C2, 0x2C5, char_class_symbol},
+    {0x2D2, 0x2DF, char_class_symbol},
+    {0x300, 0x36F, char_class_mark},
+    {0x37E, 0x37E, char_class_symbol},
+    {0x386, 0x386, char_class_upper},
+    {0x387, 0x387, char_class_symbol},
+    {0x388, 0x38F, char_class_upper},
+    {0x390, 0x390, char_class_lower},
+    {0x391, 0x3AB, char_class_upper},
+    {0x3AC, 0x3CE, char_class_lower},
+    {0x3D8, 0x3EF, char_class_cased_even},
+    {0x400, 0x42F, char_class_upper},
+    {0x430, 0x45F, char_class_lower},
+    {0x460, 0x481, char_class_cased_even},
+    {0x482, 0x482, char_class_symbol},
+    {0x483, 0x489, char_class_mark},
+    {0x48A, 0x4BF, char_class_cased_even},
+    {0x4C0, 0x4C0, char_class_upper},
+    {0x4C1, 0x4CE, char_class_cased_odd},
+    {0x4CF, 0x4CF, char_class_lower},
+    {0x4D0, 0x52F, char_class_cased_even},
+    {0x531, 0x556, char_class_upper},
+    {0x55A, 0x55F, char_class_symbol},
+    {0x560, 0x588, char_class_lower},
+    {0x589, 0x58F, char_class_symbol},
+    {0x591, 0x5BD, char_class_mark},
+    {0x5BE, 0x5BE, char_class_symbol},
+    {0x5BF, 0x5BF, char_class_mark},
+    {0x5C0, 0x5C0, char_class_symbol},
+    {0x5C1, 0x5C2, char_class_mark},
+    {0x5C3, 0x5C3, char_class_symbol},
+    {0x5C4, 0x5C5, char_class_mark},
+    {0x5C6, 0x5C6, char_class_symbol},
+    {0x5C7, 0x5C7, char_class_mark},
+    {0x5F3, 0x60F, char_class_symbol},
+    {0x610, 0x61A, char_class_mark},
+    {0x61B, 0x61F, char_class_symbol},
+    {0x64B, 0x65F, char_class_mark},
+    {0x660, 0x669, char_class_digit},
+    {0x66A, 0x66D, char_class_symbol},
+    {0x6D4, 0x6D4, char_class_symbol},
+    {0x6F0, 0x6F9, char_class_digit},
+    {0x900, 0x903, char_class_mark},
+    {0x93A, 0x93C, char_class_mark},
+    {0x93E, 0x94F, char_class_mark},
+    {0x951, 0x957, char_class_mark},
+    {0x962, 0x963, char_class_mark},
+    {0x964, 0x965, char_class_symbol},
+    {0x966, 0x96F, char_class_digit},
+    {0x970, 0x970, char_class_symbol},
+    {0x980, 0x983, char_class_mark},
+    {0x9BA, 0x9BC, char_class_mark},
+    {0x9BE, 0x9CF, char_class_mark},
+    {0x9D1, 0x9D7, char_class_mark},
+    {0x9E2, 0x9E3, char_class_mark},
+    {0x9E6, 0x9EF, char_class_digit},
+    {0xA00, 0xA03, char_class_mark},
+    {0xA3A, 0xA3C, char_class_mark},
+    {0xA3E, 0xA4F, char_class_mark},
+    {0xA51, 0xA57, char_class_mark},
+    {0xA62, 0xA63, char_class_mark},
+    {0xA66, 0xA6F, char_class_digit},
+    {0xA80, 0xA83, char_class_mark},
+    {0xABA, 0xABC, char_class_mark},
+    {0xABE, 0xACF, char_class_mark},
+    {0xAD1, 0xAD7, char_class_mark},
+    {0xAE2, 0xAE3, char_class_mark},
+    {0xAE6, 0xAEF, char_class_digit},
+    {0xB00, 0xB03, char_class_mark},
+    {0xB3A, 0xB3C, char_class_mark},
+    {0xB3E, 0xB4F, char_class_mark},
+    {0xB51, 0xB57, char_class_mark},
+    {0xB62, 0xB63, char_class_mark},
+    {0xB66, 0xB6F, char_class_digit},
+    {0xB80, 0xB83, char_class_mark},
+    {0xBBA, 0xBBC, char_class_mark},
+    {0xBBE, 0xBCF, char_class_mark},
+    {0xBD1, 0xBD7, char_class_mark},
+    {0xBE2, 0xBE3, char_class_mark},
+    {0xBE6, 0xBEF, char_class_digit},
+    {0xC00, 0xC03, char_class_mark},
+    {0xC3A, 0xC3C, char_class_mark},
+    {0xC3E, 0xC4F, char_class_mark},
+    {0xC51, 0xC57, char_class_mark},
+    {0xC62, 0xC63, char_class_mark},
+    {0xC66, 0xC6F, char_class_digit},
+    {0xC80, 0xC83, char_class_mark},
+    {0xCBA, 0xCBC, char_class_mark},
+    {0xCBE, 0xCCF, char_class_mark},
+    {0xCD1, 0xCD7, char_class_mark},
+    {0xCE2, 0xCE3, char_class_mark},
+    {0xCE6, 0xCEF, char_class_digit},
+    {0xD00, 0xD03, char_class_mark},
+    {0xD3A, 0xD3C, char_class_mark},
+    {0xD3E, 0xD4F, char_class_mark},
+    {0xD51, 0xD57, char_class_mark},
+    {0xD62, 0xD63, char_class_mark},
+    {0xD66, 0xD6F, char_class_digit},
+    {0xE31, 0xE31, char_class_mark},
+    {0xE34, 0xE3A, char_class_mark},
+    {0xE3F, 0xE3F, char_class_symbol},
+    {0xE47, 0xE4E, char_class_mark},
+    {0xE4F, 0xE4F, char_class_symbol},
+    {0xE50, 0xE59, char_class_digit},
+    {0xE5A, 0xE5B, char_class_symbol},
+    {0x10A0, 0x10C5, char_class_upper},
+    {0x10D0, 0x10FA, char_class_lower},
+    {0x10FB, 0x10FB, char_class_symbol},
+    {0x1680, 0x1680, char_class_space},
+    {0x1AB0, 0x1AFF, char_class_mark},
+    {0x1DC0, 0x1DFF, char_class_mark},
+    {0x1E00, 0x1E95, char_class_cased_even},
+    {0x1E96, 0x1E9D, char_class_lower},
+    {0x1E9E, 0x1E9E, char_class_upper},
+    {0x1E9F, 0x1E9F, char_class_lower},
+    {0x1EA0, 0x1EFF, char_class_cased_even},
+    {0x2000, 0x200A, char_class_space},
+    {0x200B, 0x2027, char_class_symbol},
+    {0x2028, 0x2029, char_class_space},
+    {0x202A, 0x202E, char_class_symbol},
+    {0x202F, 0x202F, char_class_space},
+    {0x2030, 0x205E, char_class_symbol},
+    {0x205F, 0x205F, char_class_space},
+    {0x2060, 0x206F, char_class_symbol},
+    {0x2070, 0x2070, char_class_digit},
+    {0x2071, 0x2071, char_class_lower},
+    {0x2074, 0x2079, char_class_digit},
+    {0x207A, 0x207E, char_class_symbol},
+    {0x207F, 0x207F, char_class_lower},
+    {0x2080, 0x2089, char_class_digit},
+    {0x208A, 0x208E, char_class_symbol},
+    {0x20A0, 0x20CF, char_class_symbol},
+    {0x20D0, 0x20FF, char_class_mark},
+    {0x2100, 0x214F, char_class_symbol},
+    {0x2150, 0x2189, char_class_digit},
+    {0x218A, 0x245F, char_class_symbol},
+    {0x2460, 0x249B, char_class_digit},
+    {0x249C, 0x24E9, char_class_symbol},
+    {0x24EA, 0x24FF, char_class_digit},
+    {0x2500, 0x2775, char_class_symbol},
+    {0x2776, 0x2793, char_class_digit},
+    {0x2794, 0x2BFF, char_class_symbol},
+    {0x2C00, 0x2C2F, char_class_upper},
+    {0x2C30, 0x2C5F, char_class_lower},
+    {0x2C80, 0x2CE3, char_class_cased_even},
+    {0x2CE4, 0x2CEA, char_class_symbol},
+    {0x2CF9, 0x2CFF, char_class_symbol},
+    {0x2D00, 0x2D2D, char_class_lower},
+    {0x2D70, 0x2D70, char_class_symbol},
+    {0x2DE0, 0x2DFF, char_class_mark},
+    {0x2E00, 0x2E7F, char_class_symbol},
+    {0x2E80, 0x2FFF, char_class_symbol},
+    {0x3000, 0x3000, char_class_space},
+    {0x3001, 0x3004, char_class_symbol},
+    {0x3007, 0x3007, char_class_digit},
+    {0x3008, 0x3020, char_class_symbol},
+    {0x3021, 0x3029, char_class_digit},
+    {0x302A, 0x302F, char_class_mark},
+    {0x3030, 0x3030, char_class_symbol},
+    {0x3036, 0x3037, char_class_symbol},
+    {0x3038, 0x303A, char_class_digit},
+    {0x303D, 0x303F, char_class_symbol},
+    {0x3099, 0x309A, char_class_mark},
+    {0x309B, 0x309C, char_class_symbol},
+    {0x30A0, 0x30A0, char_class_symbol},
+    {0x30FB, 0x30FB, char_class_symbol},
+    {0x3190, 0x319F, char_class_symbol},
+    {0x31C0, 0x31EF, char_class_symbol},
+    {0x3200, 0x33FF, char_class_symbol},
+    {0x4DC0, 0x4DFF, char_class_symbol},
+    {0xA490, 0xA4CF, char_class_symbol},
+    {0xA640, 0xA66D, char_class_cased_even},
+    {0xA66F, 0xA67F, char_class_mark},
+    {0xA680, 0xA69B, char_class_cased_even},
+    {0xA722, 0xA72F, char_class_cased_even},
+    {0xA732, 0xA76F, char_class_cased_even},
+    {0xA77E, 0xA787, char_class_cased_even},
+    {0xA790, 0xA793, char_class_cased_even},
+    {0xA796, 0xA7A9, char_class_cased_even},
+    {0xD800, 0xF8FF, char_class_symbol},
+    {0xFB00, 0xFB06, char_class_lower},
+    {0xFB13, 0xFB17, char_class_lower},
+    {0xFD3E, 0xFD3F, char_class_symbol},
+    {0xFE00, 0xFE0F, char_class_mark},
+    {0xFE10, 0xFE19, char_class_symbol},
+    {0xFE20, 0xFE2F, char_class_mark},
+    {0xFE30, 0xFE6F, char_class_symbol},
+    {0xFEFF, 0xFF0F, char_class_symbol},
+    {0xFF10, 0xFF19, char_class_digit},
+    {0xFF1A, 0xFF20, char_class_symbol},
+    {0xFF21, 0xFF3A, char_class_upper},
+    {0xFF3B, 0xFF40, char_class_symbol},
+    {0xFF41, 0xFF5A, char_class_lower},
+    {0xFF5B, 0xFF65, char_class_symbol},
+    {0xFFE0, 0xFFFF, char_class_symbol},
+    {0x10400, 0x10427, char_class_upper},
+    {0x10428, 0x1044F, char_class_lower},
+    {0x1D000, 0x1D1FF, char_class_symbol},
+    {0x1D7CE, 0x1D7FF, char_class_digit},
+    {0x1F000, 0x1F0FF, char_class_symbol},
+    {0x1F100, 0x1F10C, char_class_digit},
+    {0x1F10D, 0x1FBEF, char_class_symbol},
+    {0x1FBF0, 0x1FBF9, char_class_digit},
+    {0xE0000, 0xE007F, char_class_symbol},
+    {0xE0100, 0xE01EF, char_class_mark},
+    {0xF0000, 0x10FFFF, char_class_symbol},
+};
+
+/**
+ * @brief Hashes the bytes of a token
+ * @param bytes Bytes of the token
+ * @param length Length of the token
+ * @returns The hash of the token
+ */
+static uint64_t hash_bytes(const unsigned char *const bytes,
+                           const size_t length) {
+  uint64_t hash = FNV_OFFSET_BASIS;
+  for (size_t i = 0; i < length; i++) {
+    hash = (hash ^ bytes[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+/**
+ * @brief Looks up the rank of a token
+ * @param tokenizer Loaded tokenizer
+ * @param bytes Bytes of the token
+ * @param length Length of the token
+ * @returns The rank, or RANK_NONE if the bytes are not a token
+ */
+static uint32_t find_rank(const tokenizer_t *const tokenizer,
+                          const unsigned char *const bytes,
+                          const size_t length) {
+  const uint64_t hash = hash_bytes(bytes, length);
+  for (size_t i = hash & tokenizer->mask;; i = (i + 1) & tokenizer->mask) {
+    const tokenizer_entry_t *const entry = &tokenizer->table[i];
+    if (entry->length == 0) {
+      return RANK_NONE;
+    }
+    if (entry->hash == hash && entry->length == length &&
+        memcmp(tokenizer->blob + entry->offset, bytes, length) == 0) {
+      return entry->rank;
+    }
+  }
+}
+
+/**
+ * @brief Decodes a base64 encoded token
+ * @param src Encoded token
+ * @param length Length of the encoded token
+ * @param dest Destination of the decoded bytes
+ * @returns The amount of decoded bytes
+ */
+static size_t decode_base64(const char *const src, const size_t length,
+                            unsigned char *const dest) {
+  uint32_t bits = 0;
+  int pending = 0;
+  size_t written = 0;
+  for (size_t i = 0; i < length && src[i] != '='; i++) {
+    const char c = src[i];
+    uint32_t value = 0;
+    if (c >= 'A' && c <= 'Z') {
+      value = c - 'A';
+    } else if (c >= 'a' && c <= 'z') {
+      value = c - 'a' + 26;
+    } else if (c >= '0' && c <= '9') {
+      value = c - '0' + 52;
+    } else if (c == '+') {
+      value = 62;
+    } else if (c == '/') {
+      value = 63;
+    } else {
+      return 0;
+    }
+
+    bits = (bits << 6) | value;
+    if ((pending += 6) >= 8) {
+      pending -= 8;
+      dest[written++] = (bits >> pending) & 0xff;
+    }
+  }
+  return written;
+}
+
+const char *tokenizer_encoding(const char *const model) {
+  // Only the models released before gpt-4o use the older encoding
+  if (strncmp(model, "gpt-3.5", 7) == 0 ||
+      (strncmp(model, "gpt-4", 5) == 0 &&
+       (model[5] == '\0' || model[5] == '-'))) {
+    return "cl100k_base";
+  }
+  return "o200k_base";
+}
+
+size_t tokenizer_load(tokenizer_t *const tokenizer, const char *const path,
+                      const char *const encoding) {
+  *tokenizer = (tokenizer_t){
+      .split = strcmp(encoding, "cl100k_base") == 0 ? tokenizer_split_cl100k
+                                                    : tokenizer_split_o200k,
+  };
+  char *text = nullptr;
+
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return ERR_UNRECOVERABLE;
+  }
+
+  struct stat st = {};
+  if (fstat(fd, &st) != 0 || st.st_size <= 0 ||
+      (text = malloc(st.st_size)) == nullptr ||
+      read(fd, text, st.st_size) != st.st_size) {
+    close(fd);
+    free(text);
+    fprintf(stderr, "Failed to read ranks file %s\n", path);
+    return ERR_UNRECOVERABLE;
+  }
+  close(fd);
+
+  const char *const end = text + st.st_size;
+  size_t lines = 0;
+  for (const char *cursor = text; cursor < end; lines++) {
+    const char *const newline = memchr(cursor, '\n', end - cursor);
+    cursor = newline != nullptr ? newline + 1 : end;
+  }
+
+  // Half empty keeps the probe sequences short
+  size_t capacity = 1;
+  while (capacity < lines * 2) {
+    capacity <<= 1;
+  }
+
+  tokenizer->mask = capacity - 1;
+  tokenizer->blob = malloc(st.st_size);
+  tokenizer->table = calloc(capacity, sizeof(tokenizer_entry_t));
+  if (tokenizer->blob == nullptr || tokenizer->table == nullptr) {
+    free(text);
+    tokenizer_free(tokenizer);
+    fprintf(stderr, "Failed to allocate the merge table\n");
+    return ERR_UNRECOVERABLE;
+  }
+
+  size_t blob_length = 0;
+  for (const char *cursor = text; cursor < end;) {
+    const char *newline = memchr(cursor, '\n', end - cursor);
+    newline = newline != nullptr ? newline : end;
+    const char *const space = memchr(cursor, ' ', newline - cursor);
+    if (space == nullptr) {
+      cursor = newline + 1;
+      continue;
+    }
+
+    unsigned char *const bytes = tokenizer->blob + blob_length;
+    const size_t length = decode_base64(cursor, space - cursor, bytes);
+    const long rank = strtol(space + 1, nullptr, 10);
+    cursor = newline + 1;
+    if (length == 0 || rank < 0 || find_rank(tokenizer, bytes, length) !=
+                                       RANK_NONE) {
+      continue;
+    }
+
+    const uint64_t hash = hash_bytes(bytes, length);
+    size_t slot = hash & tokenizer->mask;
+    while (tokenizer->table[slot].length != 0) {
+      slot = (slot + 1) & tokenizer->mask;
+    }
+    tokenizer->table[slot] = (tokenizer_entry_t){
+        .hash = hash,
+        .offset = blob_length,
+        .length = length,
+        .rank = rank,
+    };
+    blob_length += length;
+    tokenizer->count++;
+  }
+
+  free(text);
+  if (tokenizer->count == 0) {
+    tokenizer_free(tokenizer);
+    fprintf(stderr, "Ranks file %s holds no tokens\n", path);
+    return ERR_UNRECOVERABLE;
+  }
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Counts the tokens of a single piece by repeatedly merging the
+ * adjacent pair with the lowest rank
+ * @param tokenizer Loaded tokenizer
+ * @param piece Bytes of the piece
+ * @param length Length of the piece, at most PIECE_MAX
+ * @returns The amount of tokens
+ */
+static size_t count_piece(const tokenizer_t *const tokenizer,
+                          const unsigned char *const piece,
+                          const size_t length) {
+  if (length <= 1) {
+    return length;
+  }
+  if (find_rank(tokenizer, piece, length) != RANK_NONE) {
+    return 1;
+  }
+
+  // Boundaries between the current parts, and the rank of merging the two
+  // parts that start at each boundary
+  size_t starts[PIECE_MAX + 1];
+  uint32_t ranks[PIECE_MAX + 1];
+  size_t parts = length + 1;
+  for (size_t i = 0; i < parts; i++) {
+    starts[i] = i;
+  }
+  for (size_t i = 0; i + 2 < parts; i++) {
+    ranks[i] = find_rank(tokenizer, piece + i, 2);
+  }
+
+  while (parts > 2) {
+    size_t best = 0;
+    uint32_t best_rank = RANK_NONE;
+    for (size_t i = 0; i + 2 < parts; i++) {
+      if (ranks[i] < best_rank) {
+        best_rank = ranks[i];
+        best = i;
+      }
+    }
+    if (best_rank == RANK_NONE) {
+      break;
+    }
+
+    memmove(&starts[best + 1], &starts[best + 2],
+            (parts - best - 2) * sizeof(starts[0]));
+    memmove(&ranks[best + 1], &ranks[best + 2],
+            (parts - best - 2) * sizeof(ranks[0]));
+    parts--;
+
+    if (best + 2 < parts) {
+      ranks[best] = find_rank(tokenizer, piece + starts[best],
+                              starts[best + 2] - starts[best]);
+    }
+    if (best > 0) {
+      ranks[best - 1] = find_rank(tokenizer, piece + starts[best - 1],
+                                  starts[best + 1] - starts[best - 1]);
+    }
+  }
+  return parts - 1;
+}
+
+/**
+ * @brief Decodes the UTF-8 character starting at a position
+ * @param text Text being split
+ * @param i Start of the character
+ * @param length Length of the text
+ * @param code_point Destination of the code point, CODE_POINT_INVALID for
+ * bytes that do not start a valid sequence
+ * @returns The length of the character in bytes
+ */
+static size_t decode_utf8(const unsigned char *const text, const size_t i,
+                          const size_t length, uint32_t *const code_point) {
+  const unsigned char c = text[i];
+  if (c < 0x80) {
+    *code_point = c;
+    return 1;
+  }
+
+  const size_t width = c >= 0xF8   ? 0
+                       : c >= 0xF0 ? 4
+                       : c >= 0xE0 ? 3
+                       : c >= 0xC0 ? 2
+                                   : 0;
+  *code_point = CODE_POINT_INVALID;
+  if (width == 0 || i + width > length) {
+    return 1;
+  }
+
+  uint32_t value = c & (0x7F >> width);
+  for (size_t k = 1; k < width; k++) {
+    if ((text[i + k] & 0xC0) != 0x80) {
+      return 1;
+    }
+    value = (value << 6) | (text[i + k] & 0x3F);
+  }
+  *code_point = value;
+  return width;
+}
+
+/**
+ * @brief Classifies a code point the way the pre-tokenization patterns see
+ * it. Code points outside of the table are letters without case.
+ * @param code_point Code point to classify
+ */
+static char_class_t classify(const uint32_t code_point) {
+  if (code_point < 0x80) {
+    const unsigned char c = code_point;
+    if (c >= 'A' && c <= 'Z') {
+      return char_class_upper;
+    }
+    if (c >= 'a' && c <= 'z') {
+      return char_class_lower;
+    }
+    if (c >= '0' && c <= '9') {
+      return char_class_digit;
+    }
+    if (c == '\n' || c == '\r') {
+      return char_class_newline;
+    }
+    if (c == ' ' || c == '\t' || c == '\v' || c == '\f') {
+      return char_class_space;
+    }
+    return char_class_symbol;
+  }
+
+  size_t low = 0;
+  size_t high = sizeof(CHAR_RANGES) / sizeof(CHAR_RANGES[0]);
+  while (low < high) {
+    const size_t middle = (low + high) / 2;
+    const char_range_t *const range = &CHAR_RANGES[middle];
+    if (code_point < range->first) {
+      high = middle;
+    } else if (code_point > range->last) {
+      low = middle + 1;
+    } else if (range->class == char_class_cased_even) {
+      return code_point % 2 == 0 ? char_class_upper : char_class_lower;
+    } else if (range->class == char_class_cased_odd) {
+      return code_point % 2 == 1 ? char_class_upper : char_class_lower;
+    } else {
+      return range->class;
+    }
+  }
+  return char_class_letter;
+}
+
+/**
+ * @brief Classifies the character starting at a position
+ * @param text Text being split
+ * @param i Start of the character
+ * @param length Length of the text
+ * @param end Destination of the end of the character
+ * @returns The class, char_class_end past the end of the text
+ */
+static char_class_t char_at(const unsigned char *const text, const size_t i,
+                            const size_t length, size_t *const end) {
+  if (i >= length) {
+    *end = i;
+    return char_class_end;
+  }
+  uint32_t code_point = 0;
+  *end = i + decode_utf8(text, i, length, &code_point);
+  return classify(code_point);
+}
+
+/**
+ * @brief Whether a class matches \p{L}. Marks only join letters in
+ * o200k_base, whose letter runs include \p{M}.
+ * @param split Pre-tokenization pattern
+ * @param class Class of the character
+ */
+static bool is_letter(const tokenizer_split_t split, const char_class_t class) {
+  return class == char_class_upper || class == char_class_lower ||
+         class == char_class_letter ||
+         (split == tokenizer_split_o200k && class == char_class_mark);
+}
+
+/**
+ * @brief Whether a class is whitespace
+ * @param class Class of the character
+ */
+static bool is_space(const char_class_t class) {
+  return class == char_class_space || class == char_class_newline;
+}
+
+/**
+ * @brief Whether a class matches [^\s\p{L}\p{N}]
+ * @param split Pre-tokenization pattern
+ * @param class Class of the character
+ */
+static bool is_symbol(const tokenizer_split_t split, const char_class_t class) {
+  return class != char_class_end && class != char_class_digit &&
+         !is_space(class) && !is_letter(split, class);
+}
+
+/**
+ * @brief Measures the contraction such as 's 't 're 've 'm 'll 'd starting
+ * at a position, in any case
+ * @param text Text being split
+ * @param i Position of the apostrophe
+ * @param length Length of the text
+ * @returns The length of the contraction, or 0 if there is none
+ */
+static size_t contraction_length(const unsigned char *const text,
+                                 const size_t i, const size_t length) {
+  if (i + 1 >= length || text[i] != '\'') {
+    return 0;
+  }
+  const unsigned char lower = text[i + 1] | 0x20;
+  if (lower == 's' || lower == 't' || lower == 'm' || lower == 'd') {
+    return 2;
+  }
+  const unsigned char after = i + 2 < length ? text[i + 2] | 0x20 : 0;
+  if ((lower == 'r' && after == 'e') || (lower == 'v' && after == 'e') ||
+      (lower == 'l' && after == 'l')) {
+    return 3;
+  }
+  return 0;
+}
+
+/**
+ * @brief Finds the end of a letter run of o200k_base, which splits words at
+ * case changes: [\p{Lu}\p{Lo}\p{M}]*[\p{Ll}\p{Lo}\p{M}]+ first, and
+ * [\p{Lu}\p{Lo}\p{M}]+[\p{Ll}\p{Lo}\p{M}]* otherwise. Letters without case
+ * belong to both sides.
+ * @param text Text being split
+ * @param i Start of the run, a letter
+ * @param length Length of the text
+ * @returns End of the run
+ */
+static size_t cased_run_end(const unsigned char *const text, const size_t i,
+                            const size_t length) {
+  size_t upper_end = i;
+  size_t uncased_end = 0;
+  size_t end = 0;
+  char_class_t class = char_at(text, upper_end, length, &end);
+  while (class == char_class_upper || class == char_class_letter ||
+         class == char_class_mark) {
+    if (class != char_class_upper) {
+      uncased_end = end;
+    }
+    upper_end = end;
+    class = char_at(text, upper_end, length, &end);
+  }
+
+  size_t lower_end = upper_end;
+  while (class == char_class_lower || class == char_class_letter ||
+         class == char_class_mark) {
+    lower_end = end;
+    class = char_at(text, lower_end, length, &end);
+  }
+  if (lower_end > upper_end) {
+    return lower_end;
+  }
+  // The lowercase side backtracks onto the last letter without case
+  return uncased_end > 0 ? uncased_end : upper_end;
+}
+
+/**
+ * @brief Finds the end of the piece starting at a position, following the
+ * pre-tokenization pattern of the encoding
+ * @param split Pre-tokenization pattern
+ * @param text Text being split
+ * @param i Start of the piece
+ * @param length Length of the text
+ * @returns End of the piece
+ */
+static size_t next_piece(const tokenizer_split_t split,
+                         const unsigned char *const text, const size_t i,
+                         const size_t length) {
+  // Contractions stand alone in cl100k_base and end words in o200k_base
+  const size_t contraction = contraction_length(text, i, length);
+  if (split == tokenizer_split_cl100k && contraction > 0) {
+    return i + contraction;
+  }
+
+  size_t after = 0;
+  size_t end = 0;
+  const char_class_t class = char_at(text, i, length, &after);
+  const char_class_t next = char_at(text, after, length, &end);
+
+  // Letters, optionally preceded by a single symbol or space
+  size_t start = i;
+  if (!is_letter(split, class) && class != char_class_newline &&
+      class != char_class_digit && is_letter(split, next)) {
+    start = after;
+  }
+  if (is_letter(split, char_at(text, start, length, &end))) {
+    if (split == tokenizer_split_o200k) {
+      end = cased_run_end(text, start, length);
+      return end + contraction_length(text, end, length);
+    }
+    size_t letters = end;
+    while (is_letter(split, char_at(text, letters, length, &after))) {
+      letters = after;
+    }
+    return letters;
+  }
+
+  // Up to three digits
+  if (class == char_class_digit) {
+    end = after;
+    for (size_t digits = 1;
+         digits < 3 && char_at(text, end, length, &after) == char_class_digit;
+         digits++) {
+      end = after;
+    }
+    return end;
+  }
+
+  // Symbols, optionally preceded by a space and followed by newlines, or
+  // slashes in o200k_base
+  const size_t symbols = text[i] == ' ' ? after : i;
+  if (is_symbol(split, char_at(text, symbols, length, &end))) {
+    while (is_symbol(split, char_at(text, end, length, &after))) {
+      end = after;
+    }
+    while (end < length && (text[end] == '\n' || text[end] == '\r' ||
+                            (split == tokenizer_split_o200k &&
+                             text[end] == '/'))) {
+      end++;
+    }
+    return end;
+  }
+
+  // Whitespace up to the last newline, or up to the space preceding a word
+  size_t last = i;
+  size_t newline_end = 0;
+  size_t spaces = 0;
+  end = i;
+  for (char_class_t space = class; is_space(space);
+       space = char_at(text, end, length, &after)) {
+    if (space == char_class_newline) {
+      newline_end = after;
+    }
+    last = end;
+    end = after;
+    spaces++;
+  }
+  if (newline_end > 0) {
+    return newline_end;
+  }
+  if (end < length && spaces > 1) {
+    return last;
+  }
+  return end > i ? end : after;
+}
+
+size_t tokenizer_count(const tokenizer_t *const tokenizer,
+                       const char *const text, const size_t length) {
+  const unsigned char *const bytes = (const unsigned char *)text;
+  size_t tokens = 0;
+  for (size_t i = 0; i < length;) {
+    const size_t end = next_piece(tokenizer->split, bytes, i, length);
+    for (size_t chunk = i; chunk < end; chunk += PIECE_MAX) {
+      const size_t size = end - chunk < PIECE_MAX ? end - chunk : PIECE_MAX;
+      tokens += count_piece(tokenizer, bytes + chunk, size);
+    }
+    i = end;
+  }
+  return tokens;
+}
+
+void tokenizer_free(tokenizer_t *const tokenizer) {
+  free(tokenizer->blob);
+  free(tokenizer->table);
+  *tokenizer = (tokenizer_t){};
+}
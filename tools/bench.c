@@ -0,0 +1,537 @@
+#define _GNU_SOURCE
+#include "globdef.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+constexpr char BENCH_CLIENT[] = "build/out";
+constexpr char BENCH_MOCK[] = "build/mock";
+constexpr char BENCH_MODEL[] = "mock";
+constexpr char BENCH_PROMPT[] = "Summarize the plot of a short story";
+constexpr uint16_t BENCH_DEFAULT_PORT = 8089;
+constexpr size_t BENCH_DEFAULT_COUNT = 50;
+constexpr size_t BENCH_DEFAULT_PARALLEL = 8;
+constexpr int BENCH_STARTUP_MS = 2000;
+constexpr int BENCH_TURN_TIMEOUT_MS = 30000;
+constexpr size_t BENCH_MAX_MOCK_ARGS = 32;
+constexpr char HELP_TABLE[] =
+    "+----------------+--------------------------------------+\n"
+    "| Short-form     | Purpose                              |\n"
+    "+----------------+--------------------------------------+\n"
+    "| -c <n>         | Requests per workload                |\n"
+    "| -j <n>         | Parallel requests in batch mode      |\n"
+    "| -p <port>      | Port the mock server listens on      |\n"
+    "| -s             | Streams the responses                |\n"
+    "| -- <args>      | Passes the remaining flags to mock   |\n"
+    "| -h             | Shows this table                     |\n"
+    "+----------------+--------------------------------------+\n";
+
+typedef struct {
+  size_t count;
+  size_t parallel;
+  uint16_t port;
+  bool stream;
+  const char *mock_args[BENCH_MAX_MOCK_ARGS];
+  size_t mock_arg_count;
+} bench_options_t;
+
+typedef struct {
+  const char *name;
+  double wall_ms;
+  size_t failed;
+  size_t count;
+  double *latency_ms;
+  double *first_byte_ms;
+} bench_result_t;
+
+/**
+ * @brief Reads the monotonic clock
+ * @returns Milliseconds since an arbitrary point in the past
+ */
+static double now_ms() {
+  struct timespec now = {};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1e3 + now.tv_nsec / 1e6;
+}
+
+/**
+ * @brief Compares two samples for sorting
+ * @param a First sample
+ * @param b Second sample
+ * @returns Negative, zero or positive like `strcmp`
+ */
+static int compare_samples(const void *const a, const void *const b) {
+  const double left = *(const double *)a, right = *(const double *)b;
+  return (left > right) - (left < right);
+}
+
+/**
+ * @brief Gets a percentile of sorted samples with the nearest rank method
+ * @param samples Sorted samples
+ * @param count Amount of samples
+ * @param percent Percentile to get
+ * @returns The value of the percentile
+ */
+static double percentile(const double *const samples, const size_t count,
+                         const double percent) {
+  size_t rank = (size_t)(percent / 100.0 * count + 0.999999);
+  rank = rank == 0 ? 1 : (rank > count ? count : rank);
+  return samples[rank - 1];
+}
+
+/**
+ * @brief Prints one row of the report for a set of samples
+ * @param label Name of the row
+ * @param samples Samples, sorted in place
+ * @param count Amount of samples
+ */
+static void print_samples(const char *const label, double *const samples,
+                          const size_t count) {
+  if (count == 0) {
+    return;
+  }
+  qsort(samples, count, sizeof(double), compare_samples);
+  printf("  %-12s p50 %8.1f ms  p90 %8.1f ms  p99 %8.1f ms  max %8.1f ms\n",
+         label, percentile(samples, count, 50), percentile(samples, count, 90),
+         percentile(samples, count, 99), samples[count - 1]);
+}
+
+/**
+ * @brief Prints the throughput and latency percentiles of a workload
+ * @param result Measurements of the workload
+ */
+static void print_result(bench_result_t *const result) {
+  const size_t succeeded = result->count - result->failed;
+  printf("%s: %zu requests, %zu failed, %.1f ms, %.2f req/s\n", result->name,
+         result->count, result->failed, result->wall_ms,
+         result->wall_ms > 0 ? succeeded * 1e3 / result->wall_ms : 0.0);
+  print_samples("latency", result->latency_ms, succeeded);
+  if (result->first_byte_ms != nullptr) {
+    print_samples("first byte", result->first_byte_ms, succeeded);
+  }
+}
+
+/**
+ * @brief Writes an rc file pointing the client at the mock server
+ * @param dir Directory used as `XDG_CONFIG_HOME`
+ * @param options Options of the benchmark
+ * @returns The status of the operation
+ */
+static size_t write_config(const char *const dir,
+                           const bench_options_t *const options) {
+  char path[MAX_BUFF_SIZE];
+  snprintf(path, sizeof(path), "%s/termchatrc.json", dir);
+  FILE *const file = fopen(path, "w");
+  if (file == nullptr) {
+    fprintf(stderr, "Could not write %s\n", path);
+    return ERR_UNRECOVERABLE;
+  }
+
+  // The cache would answer every repeated prompt without a request
+  fprintf(file,
+          "{\"openai\":\"sk-bench\",\"model\":\"%s\",\"role\":\"developer\","
+          "\"instruction\":\"Benchmark\",\"endpoint\":\"http://127.0.0.1:%u"
+          "/v1/chat/completions\",\"stream\":%s,\"cache\":false}\n",
+          BENCH_MODEL, options->port, options->stream ? "true" : "false");
+  fclose(file);
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Starts the mock server and waits until it accepts connections
+ * @param options Options of the benchmark
+ * @returns Process id of the server, or -1 on error
+ */
+static pid_t start_mock(const bench_options_t *const options) {
+  char port[8];
+  snprintf(port, sizeof(port), "%u", options->port);
+  const char *argv[BENCH_MAX_MOCK_ARGS + 4] = {BENCH_MOCK, "-p", port};
+  for (size_t i = 0; i < options->mock_arg_count; i++) {
+    argv[3 + i] = options->mock_args[i];
+  }
+
+  const pid_t pid = fork();
+  if (pid == 0) {
+    execv(BENCH_MOCK, (char *const *)argv);
+    fprintf(stderr, "Could not start %s\n", BENCH_MOCK);
+    _exit(ERR_UNRECOVERABLE);
+  }
+  if (pid < 0) {
+    return -1;
+  }
+
+  const struct sockaddr_in address = {
+      .sin_family = AF_INET,
+      .sin_port = htons(options->port),
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  for (double start = now_ms(); now_ms() - start < BENCH_STARTUP_MS;) {
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    const bool ready =
+        connect(fd, (const struct sockaddr *)&address, sizeof(address)) == 0;
+    close(fd);
+    if (ready) {
+      return pid;
+    }
+    usleep(10000);
+  }
+
+  fprintf(stderr, "Mock server did not start on port %u\n", options->port);
+  kill(pid, SIGTERM);
+  waitpid(pid, nullptr, 0);
+  return -1;
+}
+
+/**
+ * @brief Runs the client and waits for it to exit
+ * @param argv Arguments of the client
+ * @param output File descriptor receiving the output, or -1 to discard it
+ * @returns True if the client succeeded
+ */
+static bool run_client(const char *const *argv, const int output) {
+  const pid_t pid = fork();
+  if (pid == 0) {
+    const int null = open("/dev/null", O_RDWR);
+    dup2(null, STDIN_FILENO);
+    dup2(output >= 0 ? output : null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    execv(BENCH_CLIENT, (char *const *)argv);
+    _exit(ERR_UNRECOVERABLE);
+  }
+
+  int status = 0;
+  return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+         WEXITSTATUS(status) == 0;
+}
+
+/**
+ * @brief Runs one process per prompt, one after the other
+ * @param result Measurements to fill
+ */
+static void bench_one_shot(bench_result_t *const result) {
+  const char *const argv[] = {BENCH_CLIENT, BENCH_PROMPT, nullptr};
+  const double start = now_ms();
+  size_t samples = 0;
+  for (size_t i = 0; i < result->count; i++) {
+    const double sent = now_ms();
+    if (run_client(argv, -1)) {
+      result->latency_ms[samples++] = now_ms() - sent;
+    } else {
+      result->failed++;
+    }
+  }
+  result->wall_ms = now_ms() - start;
+}
+
+/**
+ * @brief Reads from the terminal of the client until the prompt shows up
+ * @param fd Master side of the terminal
+ * @param prompt Prompt of the interactive mode
+ * @param sent Moment the line was written
+ * @param first_byte Destination of the delay until the first byte
+ * @returns True if the prompt was read
+ */
+static bool await_prompt(const int fd, const char *const prompt,
+                         const double sent, double *const first_byte) {
+  const size_t prompt_length = strlen(prompt);
+  // Only the tail is kept, the prompt can be split between two reads
+  char tail[MAX_BUFF_SIZE];
+  size_t kept = 0;
+  bool received = false;
+
+  while (true) {
+    struct pollfd event = {.fd = fd, .events = POLLIN};
+    if (poll(&event, 1, BENCH_TURN_TIMEOUT_MS) <= 0) {
+      return false;
+    }
+    char chunk[MAX_BUFF_SIZE];
+    const ssize_t length = read(fd, chunk, sizeof(chunk));
+    if (length <= 0) {
+      return false;
+    }
+    for (ssize_t i = 0; i < length; i++) {
+      // The dots of the spinner are printed before the response arrives
+      if (!received && chunk[i] != '.') {
+        *first_byte = now_ms() - sent;
+        received = true;
+      }
+      if (kept == sizeof(tail)) {
+        memmove(tail, tail + prompt_length, kept - prompt_length);
+        kept -= prompt_length;
+      }
+      tail[kept++] = chunk[i];
+    }
+    if (kept >= prompt_length &&
+        memcmp(tail + kept - prompt_length, prompt, prompt_length) == 0) {
+      return true;
+    }
+  }
+}
+
+/**
+ * @brief Holds a single conversation in interactive mode, timing every turn
+ * from the moment the line is entered until the prompt comes back. The client
+ * runs on a pseudo terminal so its output is not held back by stdio.
+ * @param result Measurements to fill
+ */
+static void bench_interactive(bench_result_t *const result) {
+  char prompt[MAX_BUFF_SIZE];
+  snprintf(prompt, sizeof(prompt), "(%s)> ", BENCH_MODEL);
+  const double start = now_ms();
+
+  const int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+    fprintf(stderr, "Could not open a pseudo terminal\n");
+    result->failed = result->count;
+    return;
+  }
+
+  const pid_t pid = fork();
+  if (pid == 0) {
+    setsid();
+    const int slave = open(ptsname(master), O_RDWR);
+    struct termios termios = {};
+    tcgetattr(slave, &termios);
+    // The typed lines are not echoed back into the measured output
+    termios.c_lflag &= ~ECHO;
+    tcsetattr(slave, TCSANOW, &termios);
+    dup2(slave, STDIN_FILENO);
+    dup2(slave, STDOUT_FILENO);
+    const int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    execl(BENCH_CLIENT, BENCH_CLIENT, "-i", (char *)nullptr);
+    _exit(ERR_UNRECOVERABLE);
+  }
+
+  double unused = 0;
+  size_t samples = 0;
+  if (pid > 0 && await_prompt(master, prompt, now_ms(), &unused)) {
+    for (size_t i = 0; i < result->count; i++) {
+      char line[MAX_BUFF_SIZE];
+      const int length = snprintf(line, sizeof(line), "%s %zu\n", BENCH_PROMPT,
+                                  i);
+      const double sent = now_ms();
+      if (write(master, line, length) != length ||
+          !await_prompt(master, prompt, sent,
+                        &result->first_byte_ms[samples])) {
+        break;
+      }
+      result->latency_ms[samples++] = now_ms() - sent;
+    }
+  }
+
+  result->failed = result->count - samples;
+  result->wall_ms = now_ms() - start;
+  if (pid > 0) {
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+  }
+  close(master);
+}
+
+/**
+ * @brief Reads a number field of a batch result line
+ * @param line Result line
+ * @param key Quoted key followed by a colon
+ * @param dest Destination of the number
+ * @returns True if the field was found
+ */
+static bool read_field(const char *const line, const char *const key,
+                       double *const dest) {
+  const char *const found = strstr(line, key);
+  if (found == nullptr) {
+    return false;
+  }
+  *dest = strtod(found + strlen(key), nullptr);
+  return true;
+}
+
+/**
+ * @brief Runs every prompt through a single batch process and takes the
+ * latencies it reports for each line
+ * @param result Measurements to fill
+ * @param dir Directory holding the temporary files
+ * @param parallel Parallel requests of the batch
+ */
+static void bench_batch(bench_result_t *const result, const char *const dir,
+                        const size_t parallel) {
+  char input_path[MAX_BUFF_SIZE], output_path[MAX_BUFF_SIZE];
+  snprintf(input_path, sizeof(input_path), "%s/prompts.jsonl", dir);
+  snprintf(output_path, sizeof(output_path), "%s/results.jsonl", dir);
+  result->failed = result->count;
+
+  FILE *input = fopen(input_path, "w");
+  if (input == nullptr) {
+    fprintf(stderr, "Could not write %s\n", input_path);
+    return;
+  }
+  for (size_t i = 0; i < result->count; i++) {
+    fprintf(input, "{\"id\":\"%zu\",\"prompt\":\"%s %zu\"}\n", i, BENCH_PROMPT,
+            i);
+  }
+  fclose(input);
+
+  const int output = open(output_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (output < 0) {
+    fprintf(stderr, "Could not write %s\n", output_path);
+    return;
+  }
+
+  char jobs[32];
+  snprintf(jobs, sizeof(jobs), "%zu", parallel);
+  const char *const argv[] = {BENCH_CLIENT, "-b", input_path,
+                              "-j",         jobs, nullptr};
+  const double start = now_ms();
+  run_client(argv, output);
+  result->wall_ms = now_ms() - start;
+  close(output);
+
+  FILE *const results = fopen(output_path, "r");
+  char *line = nullptr;
+  size_t capacity = 0, samples = 0;
+  while (results != nullptr && getline(&line, &capacity, results) > 0 &&
+         samples < result->count) {
+    double total = 0, first_byte = 0;
+    if (strstr(line, "\"status\":\"ok\"") != nullptr &&
+        read_field(line, "\"total_ms\":", &total) &&
+        read_field(line, "\"ttfb_ms\":", &first_byte)) {
+      result->latency_ms[samples] = total;
+      result->first_byte_ms[samples++] = first_byte;
+    }
+  }
+  free(line);
+  if (results != nullptr) {
+    fclose(results);
+  }
+  result->failed = result->count - samples;
+}
+
+/**
+ * @brief Reads the command line options
+ * @param argc Count of arguments
+ * @param argv Array of arguments
+ * @param options Destination of the options
+ * @returns The status of the operation
+ */
+static size_t get_options(const int argc, const char *const *argv,
+                          bench_options_t *const options) {
+  for (int i = 1; i < argc; i++) {
+    const char *const flag = argv[i];
+    const char *const value = i + 1 < argc ? argv[i + 1] : nullptr;
+    if (strcmp(flag, "--") == 0) {
+      for (i++; i < argc && options->mock_arg_count < BENCH_MAX_MOCK_ARGS;
+           i++) {
+        options->mock_args[options->mock_arg_count++] = argv[i];
+      }
+      break;
+    }
+    if (strcmp(flag, "-h") == 0) {
+      printf("%s", HELP_TABLE);
+      exit(0);
+    }
+    if (strcmp(flag, "-s") == 0) {
+      options->stream = true;
+      continue;
+    }
+
+    const long long number = value != nullptr ? strtoll(value, nullptr, 10) : 0;
+    if (number <= 0) {
+      fprintf(stderr, "Unknown option %s\n%s", flag, HELP_TABLE);
+      return ERR_UNRECOVERABLE;
+    }
+    i++;
+    if (strcmp(flag, "-c") == 0) {
+      options->count = number;
+    } else if (strcmp(flag, "-j") == 0) {
+      options->parallel = number;
+    } else if (strcmp(flag, "-p") == 0) {
+      options->port = number;
+    } else {
+      fprintf(stderr, "Unknown option %s\n%s", flag, HELP_TABLE);
+      return ERR_UNRECOVERABLE;
+    }
+  }
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Benchmarks the client against the loopback mock server in one-shot,
+ * interactive and batch mode, reporting throughput and latency percentiles
+ * @param argc Count of arguments
+ * @param argv Array of arguments
+ * @returns The status of the operation
+ */
+int main(const int argc, const char *const *argv) {
+  bench_options_t options = {
+      .count = BENCH_DEFAULT_COUNT,
+      .parallel = BENCH_DEFAULT_PARALLEL,
+      .port = BENCH_DEFAULT_PORT,
+  };
+  if (get_options(argc, argv, &options) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+
+  char dir[] = "/tmp/termchat-bench-XXXXXX";
+  if (mkdtemp(dir) == nullptr || write_config(dir, &options) ==
+                                     ERR_UNRECOVERABLE) {
+    fprintf(stderr, "Could not create the benchmark directory\n");
+    return ERR_UNRECOVERABLE;
+  }
+  // Sessions, caches and ranks files of the user stay untouched
+  setenv("XDG_CONFIG_HOME", dir, 1);
+  setenv("XDG_CACHE_HOME", dir, 1);
+  setenv("XDG_STATE_HOME", dir, 1);
+  setenv("XDG_DATA_HOME", dir, 1);
+  // A daemon of the user must not answer the one-shot workload
+  setenv("XDG_RUNTIME_DIR", dir, 1);
+
+  const pid_t mock = start_mock(&options);
+  if (mock < 0) {
+    return ERR_UNRECOVERABLE;
+  }
+
+  double *const samples = calloc(options.count * 6, sizeof(double));
+  if (samples == nullptr) {
+    fprintf(stderr, "Could not allocate the samples\n");
+    kill(mock, SIGTERM);
+    return ERR_UNRECOVERABLE;
+  }
+
+  bench_result_t results[] = {
+      {.name = "one-shot", .count = options.count},
+      {.name = "interactive", .count = options.count},
+      {.name = "batch", .count = options.count},
+  };
+  for (size_t i = 0; i < 3; i++) {
+    results[i].latency_ms = samples + options.count * 2 * i;
+    results[i].first_byte_ms = results[i].latency_ms + options.count;
+  }
+  // A separate process per prompt only reports when it finished
+  results[0].first_byte_ms = nullptr;
+
+  bench_one_shot(&results[0]);
+  bench_interactive(&results[1]);
+  bench_batch(&results[2], dir, options.parallel);
+
+  size_t failed = 0;
+  for (size_t i = 0; i < 3; i++) {
+    print_result(&results[i]);
+    failed += results[i].failed;
+  }
+
+  kill(mock, SIGTERM);
+  waitpid(mock, nullptr, 0);
+  free(samples);
+  return failed > 0 ? ERR_UNRECOVERABLE : ERR_RECOVERABLE;
+}
@@ -0,0 +1,703 @@
+#define _GNU_SOURCE
+#include "buffer.h"
+#include "globdef.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+constexpr uint16_t MOCK_DEFAULT_PORT = 8080;
+constexpr int MOCK_MAX_EVENTS = 64;
+constexpr int MOCK_BACKLOG = 512;
+constexpr size_t MOCK_READ_SIZE = 16384;
+constexpr int64_t USEC_PER_SEC = 1000000;
+constexpr char MOCK_PATH[] = "/v1/chat/completions";
+constexpr char HEADER_END[] = "\r\n\r\n";
+constexpr char STREAM_FLAG[] = "\"stream\":true";
+constexpr char AUTHORIZATION[] = "Authorization:";
+constexpr char CONTENT_ENCODING_GZIP[] = "Content-Encoding: gzip";
+constexpr size_t MOCK_MAX_KEYS = 64;
+constexpr size_t MOCK_KEY_SIZE = 128;
+constexpr char MOCK_WORDS[][8] = {"lorem ", "ipsum ", "dolor ", "sit ",
+                                  "amet ",  "sed ",   "do ",    "magna "};
+constexpr size_t MOCK_WORD_COUNT = sizeof(MOCK_WORDS) / sizeof(MOCK_WORDS[0]);
+constexpr char HELP_TABLE[] =
+    "+----------------+--------------------------------------+\n"
+    "| Short-form     | Purpose                              |\n"
+    "+----------------+--------------------------------------+\n"
+    "| -p <port>      | Port on 127.0.0.1 to listen on       |\n"
+    "| -t <ms>        | Time to the first token              |\n"
+    "| -r <tokens/s>  | Token rate, 0 sends all at once      |\n"
+    "| -n <tokens>    | Tokens per response                  |\n"
+    "| -e <percent>   | Share of requests that fail          |\n"
+    "| -E <status>    | HTTP status of failed requests       |\n"
+    "| -l <req/s>     | Requests per second allowed per key  |\n"
+    "| -h             | Shows this table                     |\n"
+    "+----------------+--------------------------------------+\n";
+
+typedef struct {
+  uint16_t port;
+  int64_t ttft_us;
+  int64_t token_rate;
+  size_t tokens;
+  int error_percent;
+  int error_status;
+  int64_t rate_limit;
+} mock_options_t;
+
+typedef struct {
+  char key[MOCK_KEY_SIZE];
+  double level;
+  int64_t updated_us;
+} mock_key_t;
+
+typedef enum : uint8_t {
+  conn_state_reading,
+  conn_state_waiting,
+  conn_state_streaming
+} conn_state_t;
+
+typedef struct {
+  int fd;
+  conn_state_t state;
+  buffer_t in;
+  buffer_t out;
+  size_t sent;
+  bool stream;
+  bool failed;
+  bool limited;
+  bool writable;
+  char limit_headers[160];
+  size_t token;
+  int64_t started_us;
+  int64_t deadline_us;
+} conn_t;
+
+static mock_options_t g_options = {
+    .port = MOCK_DEFAULT_PORT,
+    .ttft_us = 200000,
+    .token_rate = 0,
+    .tokens = 64,
+    .error_percent = 0,
+    .error_status = 500,
+};
+static int g_epoll = -1;
+static mock_key_t g_keys[MOCK_MAX_KEYS];
+static size_t g_key_count = 0;
+
+/**
+ * @brief Reads the monotonic clock
+ * @returns Microseconds since an arbitrary point in the past
+ */
+static int64_t now_us() {
+  struct timespec now = {};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * USEC_PER_SEC + now.tv_nsec / 1000;
+}
+
+/**
+ * @brief Gets the moment a token of the response is due
+ * @param conn Connection generating the response
+ * @param token Index of the token
+ * @returns The deadline in microseconds
+ */
+static int64_t token_deadline(const conn_t *const conn, const size_t token) {
+  const int64_t first = conn->started_us + g_options.ttft_us;
+  if (g_options.token_rate <= 0) {
+    return first;
+  }
+  return first + (int64_t)token * USEC_PER_SEC / g_options.token_rate;
+}
+
+/**
+ * @brief Takes a request out of the bucket of the key a request was sent
+ * with, refilled at the configured rate, and writes the rate-limit headers
+ * the response carries
+ * @param conn Connection that received the request
+ * @param head_end End of the request headers
+ * @returns True if the key had room for the request
+ */
+static bool take_request(conn_t *const conn, const char *const head_end) {
+  conn->limit_headers[0] = '\0';
+  if (g_options.rate_limit <= 0) {
+    return true;
+  }
+
+  char key[MOCK_KEY_SIZE] = {};
+  for (const char *line = strstr(conn->in.data, "\r\n");
+       line != nullptr && line < head_end; line = strstr(line + 2, "\r\n")) {
+    if (strncasecmp(line + 2, AUTHORIZATION, sizeof(AUTHORIZATION) - 1) == 0) {
+      const char *const value = line + 2 + sizeof(AUTHORIZATION) - 1;
+      const char *const end = strstr(value, "\r\n");
+      const size_t length = (size_t)(end - value) < sizeof(key) - 1
+                                ? (size_t)(end - value)
+                                : sizeof(key) - 1;
+      memcpy(key, value, length);
+    }
+  }
+
+  mock_key_t *entry = nullptr;
+  for (size_t i = 0; i < g_key_count && entry == nullptr; i++) {
+    if (strcmp(g_keys[i].key, key) == 0) {
+      entry = &g_keys[i];
+    }
+  }
+  const int64_t now = now_us();
+  const double limit = (double)g_options.rate_limit;
+  if (entry == nullptr) {
+    // Unknown keys beyond the table share its last entry
+    entry = &g_keys[g_key_count < MOCK_MAX_KEYS ? g_key_count++
+                                                : MOCK_MAX_KEYS - 1];
+    memcpy(entry->key, key, sizeof(key));
+    entry->level = limit;
+    entry->updated_us = now;
+  }
+
+  entry->level += limit * (double)(now - entry->updated_us) / USEC_PER_SEC;
+  entry->level = entry->level < limit ? entry->level : limit;
+  entry->updated_us = now;
+  const bool allowed = entry->level >= 1;
+  if (allowed) {
+    entry->level -= 1;
+  }
+
+  const int64_t reset_ms =
+      (int64_t)((limit - entry->level) * 1000 / limit) + 1;
+  snprintf(conn->limit_headers, sizeof(conn->limit_headers),
+           "x-ratelimit-limit-requests: %lld\r\n"
+           "x-ratelimit-remaining-requests: %lld\r\n"
+           "x-ratelimit-reset-requests: %lldms\r\n",
+           (long long)g_options.rate_limit, (long long)entry->level,
+           (long long)reset_ms);
+  return allowed;
+}
+
+/**
+ * @brief Updates the events a connection is watched for
+ * @param conn Connection to watch
+ */
+static void watch(conn_t *const conn) {
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+  if (conn->sent < conn->out.length) {
+    event.events |= EPOLLOUT;
+  }
+  epoll_ctl(g_epoll, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+/**
+ * @brief Closes a connection and releases its buffers
+ * @param conn Connection to close
+ */
+static void close_conn(conn_t *const conn) {
+  epoll_ctl(g_epoll, EPOLL_CTL_DEL, conn->fd, nullptr);
+  close(conn->fd);
+  buffer_free(&conn->in);
+  buffer_free(&conn->out);
+  free(conn);
+}
+
+/**
+ * @brief Writes as much of the pending output as the socket accepts
+ * @param conn Connection to flush
+ * @returns The status of the operation
+ */
+static size_t flush_conn(conn_t *const conn) {
+  while (conn->sent < conn->out.length) {
+    const ssize_t written = send(conn->fd, conn->out.data + conn->sent,
+                                 conn->out.length - conn->sent, MSG_NOSIGNAL);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN) {
+        break;
+      }
+      return ERR_UNRECOVERABLE;
+    }
+    conn->sent += written;
+  }
+
+  if (conn->sent == conn->out.length) {
+    buffer_clear(&conn->out);
+    conn->sent = 0;
+  }
+  watch(conn);
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Appends the content of the response, one word per token
+ * @param dest Buffer to append to
+ * @param from First token
+ * @param to Token after the last one
+ * @returns The status of the operation
+ */
+static size_t append_words(buffer_t *const dest, const size_t from,
+                           const size_t to) {
+  for (size_t i = from; i < to; i++) {
+    const char *const word = MOCK_WORDS[i % MOCK_WORD_COUNT];
+    if (buffer_append(dest, word, strlen(word)) == ERR_UNRECOVERABLE) {
+      return ERR_UNRECOVERABLE;
+    }
+  }
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Queues a complete response with a known length
+ * @param conn Connection to respond on
+ * @param status HTTP status of the response
+ * @param body Body of the response
+ * @returns The status of the operation
+ */
+static size_t queue_response(conn_t *const conn, const int status,
+                             const buffer_t *const body) {
+  return buffer_printf(&conn->out,
+                       "HTTP/1.1 %d %s\r\n"
+                       "Content-Type: application/json\r\n"
+                       "%s"
+                       "Content-Length: %zu\r\n\r\n%s",
+                       status, status < 400 ? "OK" : "Error",
+                       conn->limit_headers, body->length, body->data);
+}
+
+/**
+ * @brief Queues one chunk of a chunked response
+ * @param conn Connection to respond on
+ * @param chunk Content of the chunk
+ * @returns The status of the operation
+ */
+static size_t queue_chunk(conn_t *const conn, const buffer_t *const chunk) {
+  return buffer_printf(&conn->out, "%zx\r\n%s\r\n", chunk->length,
+                       chunk->data);
+}
+
+/**
+ * @brief Sends whatever the response owes once its deadline passed
+ * @param conn Connection whose deadline passed
+ * @returns The status of the operation
+ */
+static size_t on_deadline(conn_t *const conn) {
+  static buffer_t body = {};
+  buffer_clear(&body);
+  size_t status = ERR_RECOVERABLE;
+  const size_t usage_tokens = g_options.tokens;
+
+  if (conn->limited) {
+    status |= buffer_printf(&body, "{\"error\":{\"message\":\"Rate limit "
+                                   "reached\",\"type\":\"requests\"}}");
+    status |= queue_response(conn, 429, &body);
+    conn->state = conn_state_reading;
+  } else if (conn->failed) {
+    status |= buffer_printf(&body,
+                            "{\"error\":{\"message\":\"Injected failure\","
+                            "\"type\":\"server_error\",\"code\":%d}}",
+                            g_options.error_status);
+    status |= queue_response(conn, g_options.error_status, &body);
+    conn->state = conn_state_reading;
+  } else if (!conn->stream) {
+    status |= buffer_printf(&body, "{\"id\":\"mock\",\"object\":\"chat."
+                                   "completion\",\"choices\":[{\"index\":0,"
+                                   "\"message\":{\"role\":\"assistant\","
+                                   "\"content\":\"");
+    status |= append_words(&body, 0, g_options.tokens);
+    status |= buffer_printf(
+        &body,
+        "\"},\"finish_reason\":\"stop\"}],\"usage\":{\"prompt_tokens\":%zu,"
+        "\"completion_tokens\":%zu,\"total_tokens\":%zu}}",
+        conn->in.length, usage_tokens, conn->in.length + usage_tokens);
+    status |= queue_response(conn, 200, &body);
+    conn->state = conn_state_reading;
+  } else {
+    if (conn->state == conn_state_waiting) {
+      status |= buffer_printf(&conn->out,
+                              "HTTP/1.1 200 OK\r\n"
+                              "Content-Type: text/event-stream\r\n"
+                              "%s"
+                              "Transfer-Encoding: chunked\r\n\r\n",
+                              conn->limit_headers);
+      conn->state = conn_state_streaming;
+    }
+
+    // Every token that is due goes out, even if the loop woke up late
+    const int64_t now = now_us();
+    while (conn->token < g_options.tokens &&
+           token_deadline(conn, conn->token) <= now) {
+      buffer_clear(&body);
+      status |= buffer_printf(&body, "data: {\"choices\":[{\"index\":0,"
+                                     "\"delta\":{\"content\":\"");
+      status |= append_words(&body, conn->token, conn->token + 1);
+      status |= buffer_printf(&body, "\"}}]}\n\n");
+      status |= queue_chunk(conn, &body);
+      conn->token++;
+    }
+
+    if (conn->token == g_options.tokens) {
+      buffer_clear(&body);
+      status |= buffer_printf(
+          &body,
+          "data: {\"choices\":[],\"usage\":{\"prompt_tokens\":%zu,"
+          "\"completion_tokens\":%zu,\"total_tokens\":%zu}}\n\n"
+          "data: [DONE]\n\n",
+          conn->in.length, usage_tokens, conn->in.length + usage_tokens);
+      status |= queue_chunk(conn, &body);
+      status |= buffer_printf(&conn->out, "0\r\n\r\n");
+      conn->state = conn_state_reading;
+    } else {
+      conn->deadline_us = token_deadline(conn, conn->token);
+    }
+  }
+
+  if (conn->state == conn_state_reading) {
+    buffer_clear(&conn->in);
+  }
+  if (status == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+  return flush_conn(conn);
+}
+
+/**
+ * @brief Inflates a gzip compressed request body
+ * @param src Compressed body
+ * @param length Length of the compressed body
+ * @param dest Buffer receiving the body, replacing its content
+ * @returns The status of the operation
+ */
+static size_t inflate_body(const char *const src, const size_t length,
+                           buffer_t *const dest) {
+  z_stream stream = {
+      .next_in = (Bytef *)src,
+      .avail_in = length,
+  };
+  // A window of 15 bits with 16 added expects the gzip wrapper
+  if (inflateInit2(&stream, 15 + 16) != Z_OK) {
+    return ERR_UNRECOVERABLE;
+  }
+
+  buffer_clear(dest);
+  int result = Z_OK;
+  while (result == Z_OK) {
+    if (buffer_reserve(dest, dest->length + MOCK_READ_SIZE) ==
+        ERR_UNRECOVERABLE) {
+      break;
+    }
+    stream.next_out = (Bytef *)dest->data + dest->length;
+    stream.avail_out = MOCK_READ_SIZE;
+    result = inflate(&stream, Z_NO_FLUSH);
+    dest->length += MOCK_READ_SIZE - stream.avail_out;
+  }
+  inflateEnd(&stream);
+  return result == Z_STREAM_END ? ERR_RECOVERABLE : ERR_UNRECOVERABLE;
+}
+
+/**
+ * @brief Starts answering once a whole request was received
+ * @param conn Connection that received data
+ * @returns The status of the operation
+ */
+static size_t on_request_data(conn_t *const conn) {
+  const char *const head_end =
+      memmem(conn->in.data, conn->in.length, HEADER_END, sizeof(HEADER_END) - 1);
+  if (conn->state != conn_state_reading || head_end == nullptr) {
+    return ERR_RECOVERABLE;
+  }
+
+  size_t content_length = 0;
+  bool gzip = false;
+  for (const char *line = strstr(conn->in.data, "\r\n");
+       line != nullptr && line < head_end; line = strstr(line + 2, "\r\n")) {
+    if (strncasecmp(line + 2, "Content-Length:", 15) == 0) {
+      content_length = strtoull(line + 17, nullptr, 10);
+    } else if (strncasecmp(line + 2, CONTENT_ENCODING_GZIP,
+                           sizeof(CONTENT_ENCODING_GZIP) - 1) == 0) {
+      gzip = true;
+    }
+  }
+
+  const size_t head_length = head_end - conn->in.data + sizeof(HEADER_END) - 1;
+  if (conn->in.length < head_length + content_length) {
+    return ERR_RECOVERABLE;
+  }
+
+  // Clients warming up their connection send a request without a body
+  if (strncmp(conn->in.data, "HEAD ", 5) == 0) {
+    buffer_clear(&conn->in);
+    if (buffer_printf(&conn->out, "HTTP/1.1 405 Error\r\nAllow: POST\r\n"
+                                  "Content-Length: 0\r\n\r\n") ==
+        ERR_UNRECOVERABLE) {
+      return ERR_UNRECOVERABLE;
+    }
+    return flush_conn(conn);
+  }
+
+  if (strncmp(conn->in.data, "POST ", 5) != 0 ||
+      strncmp(conn->in.data + 5, MOCK_PATH, sizeof(MOCK_PATH) - 1) != 0) {
+    static const buffer_t not_found = {
+        .data = (char *)"{\"error\":{\"message\":\"Not found\"}}",
+        .length = 33,
+    };
+    buffer_clear(&conn->in);
+    conn->limit_headers[0] = '\0';
+    if (queue_response(conn, 404, &not_found) == ERR_UNRECOVERABLE) {
+      return ERR_UNRECOVERABLE;
+    }
+    return flush_conn(conn);
+  }
+
+  const char *body = conn->in.data + head_length;
+  size_t body_length = content_length;
+  static buffer_t inflated = {};
+  if (gzip) {
+    if (inflate_body(body, content_length, &inflated) == ERR_UNRECOVERABLE) {
+      fprintf(stderr, "Could not inflate a compressed request\n");
+      return ERR_UNRECOVERABLE;
+    }
+    body = inflated.data;
+    body_length = inflated.length;
+  }
+  conn->stream = memmem(body, body_length, STREAM_FLAG,
+                        sizeof(STREAM_FLAG) - 1) != nullptr;
+  conn->limited = !take_request(conn, head_end);
+  conn->failed = rand() % 100 < g_options.error_percent;
+  conn->token = 0;
+  conn->started_us = now_us();
+  // Non-streamed answers arrive once the last token was generated, rejected
+  // ones right away
+  conn->deadline_us = conn->limited ? conn->started_us
+                      : conn->stream || conn->failed
+                          ? token_deadline(conn, 0)
+                          : token_deadline(conn, g_options.tokens);
+  conn->state = conn_state_waiting;
+  // Only the size of the request is kept, for the usage report
+  conn->in.length = body_length;
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Accepts every pending connection
+ * @param listener Listening socket
+ */
+static void accept_all(const int listener) {
+  while (true) {
+    const int fd = accept4(listener, nullptr, nullptr,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      return;
+    }
+
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    conn_t *const conn = calloc(1, sizeof(conn_t));
+    if (conn == nullptr) {
+      close(fd);
+      continue;
+    }
+    conn->fd = fd;
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+    epoll_ctl(g_epoll, EPOLL_CTL_ADD, fd, &event);
+  }
+}
+
+/**
+ * @brief Reads an option value as a number
+ * @param value Text of the value
+ * @param name Name of the option, for the error message
+ * @param dest Destination of the number
+ * @returns The status of the operation
+ */
+static size_t parse_number(const char *const value, const char *const name,
+                           int64_t *const dest) {
+  char *end = nullptr;
+  const long long number = value != nullptr ? strtoll(value, &end, 10) : -1;
+  if (value == nullptr || *end != '\0' || number < 0) {
+    fprintf(stderr, "Option %s needs a positive number\n", name);
+    return ERR_UNRECOVERABLE;
+  }
+  *dest = number;
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Reads the command line options
+ * @param argc Count of arguments
+ * @param argv Array of arguments
+ * @returns The status of the operation
+ */
+static size_t get_options(const int argc, const char *const *argv) {
+  for (int i = 1; i < argc; i++) {
+    const char *const flag = argv[i];
+    const char *const value = i + 1 < argc ? argv[i + 1] : nullptr;
+    int64_t number = 0;
+    if (strcmp(flag, "-h") == 0) {
+      printf("%s", HELP_TABLE);
+      exit(0);
+    }
+    if (parse_number(value, flag, &number) == ERR_UNRECOVERABLE) {
+      return ERR_UNRECOVERABLE;
+    }
+    i++;
+
+    if (strcmp(flag, "-p") == 0) {
+      g_options.port = number;
+    } else if (strcmp(flag, "-t") == 0) {
+      g_options.ttft_us = number * 1000;
+    } else if (strcmp(flag, "-r") == 0) {
+      g_options.token_rate = number;
+    } else if (strcmp(flag, "-n") == 0) {
+      g_options.tokens = number;
+    } else if (strcmp(flag, "-e") == 0) {
+      g_options.error_percent = number;
+    } else if (strcmp(flag, "-E") == 0) {
+      g_options.error_status = number;
+    } else if (strcmp(flag, "-l") == 0) {
+      g_options.rate_limit = number;
+    } else {
+      fprintf(stderr, "Unknown option %s\n%s", flag, HELP_TABLE);
+      return ERR_UNRECOVERABLE;
+    }
+  }
+  return ERR_RECOVERABLE;
+}
+
+/**
+ * @brief Loopback server emulating `/v1/chat/completions`, answering normal
+ * and streamed requests with a configurable latency, token rate, size,
+ * failure rate and per-key request rate limit
+ * @param argc Count of arguments
+ * @param argv Array of arguments
+ * @returns The status of the operation
+ */
+int main(const int argc, const char *const *argv) {
+  if (get_options(argc, argv) == ERR_UNRECOVERABLE) {
+    return ERR_UNRECOVERABLE;
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  const int listener =
+      socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  const int one = 1;
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in address = {
+      .sin_family = AF_INET,
+      .sin_port = htons(g_options.port),
+      .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  if (listener < 0 ||
+      bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(listener, MOCK_BACKLOG) != 0) {
+    fprintf(stderr, "Could not listen on port %u\n", g_options.port);
+    return ERR_UNRECOVERABLE;
+  }
+
+  g_epoll = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = nullptr};
+  epoll_ctl(g_epoll, EPOLL_CTL_ADD, listener, &event);
+  fprintf(stderr, "Mock listening on http://127.0.0.1:%u%s\n", g_options.port,
+          MOCK_PATH);
+
+  // Connections waiting for a deadline are kept in a plain list; a mock
+  // serving a benchmark holds at most a few hundred of them
+  conn_t **waiting = nullptr;
+  size_t waiting_count = 0, waiting_capacity = 0;
+  char chunk[MOCK_READ_SIZE];
+  struct epoll_event events[MOCK_MAX_EVENTS];
+
+  while (true) {
+    int64_t next = -1;
+    for (size_t i = 0; i < waiting_count; i++) {
+      if (next < 0 || waiting[i]->deadline_us < next) {
+        next = waiting[i]->deadline_us;
+      }
+    }
+    const int64_t now = now_us();
+    const int timeout =
+        next < 0 ? -1 : (next <= now ? 0 : (int)((next - now + 999) / 1000));
+
+    const int count = epoll_wait(g_epoll, events, MOCK_MAX_EVENTS, timeout);
+    for (int i = 0; i < count; i++) {
+      conn_t *const conn = events[i].data.ptr;
+      if (conn == nullptr) {
+        accept_all(listener);
+        continue;
+      }
+
+      bool closed = false;
+      if (events[i].events & EPOLLOUT) {
+        closed = flush_conn(conn) == ERR_UNRECOVERABLE;
+      }
+
+      while (!closed && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        const ssize_t received = recv(conn->fd, chunk, sizeof(chunk), 0);
+        if (received < 0 && errno == EAGAIN) {
+          break;
+        }
+        if (received <= 0 || (conn->state == conn_state_reading &&
+                              buffer_append(&conn->in, chunk, received) ==
+                                  ERR_UNRECOVERABLE)) {
+          closed = true;
+          break;
+        }
+      }
+
+      const conn_state_t before = conn->state;
+      if (!closed && on_request_data(conn) == ERR_UNRECOVERABLE) {
+        closed = true;
+      }
+
+      if (closed) {
+        for (size_t j = 0; j < waiting_count; j++) {
+          if (waiting[j] == conn) {
+            waiting[j] = waiting[--waiting_count];
+            break;
+          }
+        }
+        close_conn(conn);
+      } else if (before == conn_state_reading &&
+                 conn->state == conn_state_waiting) {
+        if (waiting_count == waiting_capacity) {
+          waiting_capacity = waiting_capacity > 0 ? waiting_capacity * 2 : 64;
+          conn_t **const grown =
+              realloc(waiting, waiting_capacity * sizeof(conn_t *));
+          if (grown == nullptr) {
+            fprintf(stderr, "Could not track more connections\n");
+            return ERR_UNRECOVERABLE;
+          }
+          waiting = grown;
+        }
+        waiting[waiting_count++] = conn;
+      }
+    }
+
+    const int64_t current = now_us();
+    for (size_t i = 0; i < waiting_count;) {
+      conn_t *const conn = waiting[i];
+      if (conn->deadline_us > current) {
+        i++;
+        continue;
+      }
+
+      if (on_deadline(conn) == ERR_UNRECOVERABLE) {
+        waiting[i] = waiting[--waiting_count];
+        close_conn(conn);
+        continue;
+      }
+      if (conn->state == conn_state_reading) {
+        waiting[i] = waiting[--waiting_count];
+        continue;
+      }
+      i++;
+    }
+  }
+}